@@ -0,0 +1,781 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Headless benchmark. Renders a fixed set of scenes along scripted camera paths at
+// several resolutions and thread counts, without a window. The game sees a clock
+// that advances exactly one frame per frame, so every run renders the same
+// images and does the same work, and only the wall-clock time differs.
+//
+// Reports frame time percentiles, Mrays/s and scaling efficiency per run, writes
+// them as JSON lines, and compares them with the lines of an earlier run.
+//
+//   ./bench [--scenes demo,prims,glass,lights,rep] [--sizes 640x360,1280x720]
+//           [--threads 1,2,4] [--frames 30] [--warmup 4]
+//           [--out bench.jsonl] [--baseline bench_baseline.jsonl] [--threshold 5]
+//
+// With --golden it instead renders each scene from the middle of its path through
+// each of the fast paths, and checks them against the stored reference images
+// with the PSNR and max error tolerance of that path in that scene.
+// --write-golden renders and stores the reference images instead. The references
+// for 320x180, the size the tolerances are measured at, are in ./golden, and the
+// golden script runs the check.
+//
+//   ./bench --write-golden golden [--scenes ...] [--sizes 320x180]
+//   ./bench --golden golden [--scenes ...] [--sizes 320x180]
+#include "cello.cc"
+#include "jobs.cc"
+#include "bench_common.h"
+
+#define MAX_BENCH_LIST 8
+#define MAX_BENCH_RESULTS 512
+#define MAX_BENCH_FRAMES 4096
+#define BENCH_FRAME_TIME 16666667 // ns the game's clock advances per frame
+#define GOLDEN_FRAMES 8 // rendered of each fast path, so the caches and TAA settle
+#define GOLDEN_TIME 1000000000 // ns, where the demo's animation is stopped for the golden images
+#define GOLDEN_PATH_COUNT 9 // fast paths checked against the reference, see golden_paths
+#define GOLDEN_SIZES "320x180" // of the references in ./golden, the tolerances are measured at it
+#define BENCH_SIZES "640x360,1280x720"
+
+//
+// Platform
+//
+global_variable s32 bench_width;
+global_variable s32 bench_height;
+global_variable u64 bench_clock;
+
+internal void bench_get_window_size(s32* w, s32* h) { *w = bench_width; *h = bench_height; }
+internal void bench_get_input_info(Input_Info* inputs) {}
+internal void bench_set_cursor_visibility(b32 is_visible) {}
+internal void bench_swap_buffers(Bitmap* bitmap) {}
+internal u64 bench_get_time() { return bench_clock; }
+internal Compile_State bench_get_compile_state() { return COMPILE_SUCCESS; }
+
+//
+// Scenes
+//
+internal void add_ground(Retained_Scene* scene, f32 half_size)
+{
+    Edit edits[] = {
+        { SET_MATERIAL_ID, (v3) { 0 } },
+        { SET_SIZE, (v3) { half_size, 1.0, half_size } },
+        { SD_BOX, (v3) { 0.0, -1.0, 0.0 } },
+        { OP_UNION },
+    };
+    add_object(scene, edits, array_count(edits));
+}
+
+// Material 0 is the ground, 1 to 3 are diffuse and 4 and 5 glass
+internal void add_bench_materials(Retained_Scene* scene)
+{
+    add_material(scene, (Material) { (v3) { 0.3, 0.3, 0.3 }, DIFF, 0.0, 0.3, 0.2 });
+    add_material(scene, (Material) { (v3) { 1.0, 0.3, 0.4 }, DIFF, 0.0, 0.3, 1.0 });
+    add_material(scene, (Material) { (v3) { 1.0, 0.8, 0.7 }, DIFF, 0.0, 0.3, 0.9 });
+    add_material(scene, (Material) { (v3) { 0.1, 0.9, 0.1 }, DIFF, 0.0, 0.3, 0.2 });
+    add_material(scene, (Material) { (v3) { 1.0, 1.0, 1.0 }, REFR, 0.0, 0.5, 0.5 });
+    add_material(scene, (Material) { (v3) { 0.1, 0.9, 0.3 }, REFR, 0.0, 0.3, 0.2 });
+}
+
+// The sun and sky of the demo, without the animation
+internal void add_bench_lights(Retained_Scene* scene)
+{
+    add_light(scene, (Light) { (v3) { 100, 100, 50 }, (v3) { 0.7, 0.5, 0.3 }, 1000.0 });
+    add_light(scene, (Light) { (v3) { 0, 100, 0 }, (v3) { 0.7, 0.76, 0.95 }, 1000.0 });
+}
+
+// 32 x 32 spheres and boxes, the spheres on even rows and the boxes on odd ones.
+// Each kind is added as one run that sets the material and size once, so the
+// compiler can batch it.
+internal void build_prims_scene(Retained_Scene* scene)
+{
+    add_ground(scene, 30.0);
+    const OpKind kinds[] = { SD_SPHERE, SD_BOX };
+    foreach(k, 2)
+    foreach(z, 16)
+    foreach(x, 32)
+    {
+        const v3 center = (v3) { (x - 15.5f) * 1.5f, 0.5, (z * 2 + k - 15.5f) * 1.5f };
+        if (x == 0 && z == 0)
+        {
+            Edit edits[] = {
+                { SET_MATERIAL_ID, (v3) { (f32)(1 + k) } },
+                { SET_SIZE, (v3) { 0.5, 0.5, 0.5 } },
+                { kinds[k], center },
+                { OP_UNION },
+            };
+            add_object(scene, edits, array_count(edits));
+        }
+        else
+        {
+            Edit edits[] = {
+                { kinds[k], center },
+                { OP_UNION },
+            };
+            add_object(scene, edits, array_count(edits));
+        }
+    }
+    add_bench_materials(scene);
+    add_bench_lights(scene);
+}
+
+// 6 x 6 glass spheres and rounded boxes, which trace refraction and reflection rays
+internal void build_glass_scene(Retained_Scene* scene)
+{
+    add_ground(scene, 20.0);
+    foreach(z, 6)
+    foreach(x, 6)
+    {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { (f32)(4 + (x + z) % 2) } },
+            { SET_SIZE, (v3) { 1.0, 1.0, 1.0 } },
+            { SET_ROUNDING, (v3) { 0.2 } },
+            { (x + z) % 2 ? SD_ROUND_BOX : SD_SPHERE, (v3) { (x - 2.5f) * 3.0f, 1.0, (z - 2.5f) * 3.0f } },
+            { OP_UNION },
+        };
+        add_object(scene, edits, array_count(edits));
+    }
+    add_bench_materials(scene);
+    add_bench_lights(scene);
+}
+
+// 8 x 8 pillars under as many small colored lights
+internal void build_lights_scene(Retained_Scene* scene)
+{
+    add_ground(scene, 20.0);
+    foreach(z, 8)
+    foreach(x, 8)
+    {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { (f32)(1 + (x + z) % 3) } },
+            { SET_SIZE, (v3) { 0.3, 1.5, 0.0 } },
+            { SD_CAPPED_CYLINDER, (v3) { (x - 3.5f) * 4.0f, 1.5, (z - 3.5f) * 4.0f } },
+            { OP_UNION },
+        };
+        add_object(scene, edits, array_count(edits));
+    }
+    add_bench_materials(scene);
+    add_light(scene, (Light) { (v3) { 0, 100, 0 }, (v3) { 0.7, 0.76, 0.95 }, 1000.0 });
+    foreach(z, 8)
+    foreach(x, 8)
+    {
+        const v3 color = (v3) { (f32)(x % 2), (f32)(z % 2), (f32)((x + z) % 3 == 0) } * 0.8 + 0.2;
+        add_light(scene, (Light) { (v3) { (x - 3.0f) * 4.0f, 3.0, (z - 3.0f) * 4.0f }, color, 20.0 });
+    }
+}
+
+// A lattice of spheres repeated in every direction, with no bounds to cull by
+internal void build_rep_scene(Retained_Scene* scene)
+{
+    Edit edits[] = {
+        { SET_MATERIAL_ID, (v3) { 1 } },
+        { SET_SIZE, (v3) { 0.5, 0.5, 0.5 } },
+        { OP_REP, (v3) { 4.0, 4.0, 4.0 } },
+        { SD_SPHERE, (v3) { 0.0, 0.0, 0.0 } },
+        { OP_UNION },
+        { OP_RESET },
+    };
+    add_object(scene, edits, array_count(edits));
+    add_bench_materials(scene);
+    add_bench_lights(scene);
+}
+
+// How far a fast path's golden image may be from the reference. Measured per scene
+// and path on the references in ./golden, with room for the rounding of another
+// compiler and target, which alone moves the references of the scenes with glass
+// by up to 42.
+struct Golden_Tolerance
+{
+    f64 min_psnr;
+    s32 max_error; // of any 8 bit channel, after averaging GOLDEN_BLOCK_SIZE^2 pixel blocks
+};
+
+// The camera moves from 'from' to 'to' over the run, looking at a point that
+// moves from 'look_from' to 'look_to'. Golden images are taken halfway, and every
+// fast path has to come within its tolerance of the reference.
+struct Bench_Scene
+{
+    const char* name;
+    void (*build)(Retained_Scene* scene); // null keeps the demo scene and its animation
+    v3 from, to;
+    v3 look_from, look_to;
+    Golden_Tolerance golden[GOLDEN_PATH_COUNT]; // in the order of golden_paths
+};
+
+global_variable Bench_Scene bench_scenes[] =
+{
+    //                                                                      march       shadows     lighting2   lighting4   probes      vrs         aa4         taa         default
+    { "demo",   NULL,               { 13.4, 6.3, 20.7 },  { -20.0, 8.0, 10.0 }, { 0, 0, 0 },     { 0, 0, 0 },
+      { TOL_DEMO } },
+    { "prims",  build_prims_scene,  { -30.0, 15.0, 30.0 }, { 30.0, 15.0, 30.0 }, { 0, 0, 0 },     { 0, 0, 0 },
+      { TOL_PRIMS } },
+    { "glass",  build_glass_scene,  { -12.0, 5.0, 12.0 },  { 12.0, 5.0, 12.0 },  { 0, 1, 0 },     { 0, 1, 0 },
+      { TOL_GLASS } },
+    { "lights", build_lights_scene, { -15.0, 10.0, 15.0 }, { 15.0, 10.0, 15.0 }, { 0, 0, 0 },     { 0, 0, 0 },
+      { TOL_LIGHTS } },
+    { "rep",    build_rep_scene,    { 2.0, 2.0, 2.0 },     { 2.0, 2.0, -40.0 },  { 2, 2, -8 },    { 2, 2, -48 },
+      { TOL_REP } },
+};
+
+internal Bench_Scene* find_bench_scene(const char* name)
+{
+    foreach(i, array_count(bench_scenes))
+    {
+        if (strcmp(bench_scenes[i].name, name) == 0) return &bench_scenes[i];
+    }
+    return NULL;
+}
+
+//
+// Runs
+//
+struct Bench_Result
+{
+    char scene[32];
+    s32 width;
+    s32 height;
+    s32 threads;
+    s32 frames;
+    f64 p50_ms;
+    f64 p95_ms;
+    f64 p99_ms;
+    f64 mrays_per_s;
+    f64 map_calls_per_frame;
+    f64 scaling; // speedup over the fewest threads run, divided by the thread ratio
+};
+
+internal int compare_f64(const void* a, const void* b)
+{
+    const f64 x = *(const f64*)a;
+    const f64 y = *(const f64*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Nearest rank percentile of sorted values
+internal f64 percentile(f64* sorted, s32 count, f64 p)
+{
+    s32 rank = (s32)ceil(p / 100.0 * count);
+    rank = rank < 1 ? 1 : rank > count ? count : rank;
+    return sorted[rank - 1];
+}
+
+// Starts the game over at the given size and swaps in the scene
+internal void start_bench(Game_Memory* memory, Bench_Scene* bench_scene, s32 width, s32 height, s32 threads)
+{
+    Game_State* game_state = (Game_State*)memory->permanent_storage;
+
+    // The bitmap is the one buffer initialization doesn't free before allocating it again
+    if (memory->is_initialized) free(game_state->bitmap.buffer);
+    memory->is_initialized = false;
+    bench_width = width;
+    bench_height = height;
+    bench_clock = 0;
+    game_update_and_render(memory);
+
+    if (bench_scene->build)
+    {
+        init_retained_scene(&game_state->scene, &game_state->scene_snapshot, &game_state->frame_constants);
+        bench_scene->build(&game_state->scene);
+        game_state->pulse_object = -1;
+        game_state->sun_light = -1;
+    }
+    game_state->threadCount = threads;
+    game_state->debug_mode = false;
+}
+
+// Times 'frames' frames after 'warmup' frames that fill the caches
+internal Bench_Result run_bench(Game_Memory* memory, Bench_Scene* bench_scene, s32 width, s32 height, s32 threads, s32 warmup, s32 frames)
+{
+    Game_State* game_state = (Game_State*)memory->permanent_storage;
+    start_bench(memory, bench_scene, width, height, threads);
+
+    static f64 times[MAX_BENCH_FRAMES];
+    u64 rays = 0;
+    u64 map_calls = 0;
+    f64 total_time = 0.0;
+    const s32 frame_count = warmup + frames;
+    foreach(f, frame_count)
+    {
+        const f32 s = frame_count > 1 ? (f32)f / (frame_count - 1) : 0.0;
+        Camera* camera = &game_state->camera;
+        camera->position = mix(bench_scene->from, bench_scene->to, (v3) { s, s, s });
+        camera->front = normalize(mix(bench_scene->look_from, bench_scene->look_to, (v3) { s, s, s }) - camera->position);
+
+        bench_clock += BENCH_FRAME_TIME;
+        const u64 start = wall_time();
+        game_update_and_render(memory);
+        const f64 time = (wall_time() - start) / 1e9;
+        if (f < warmup) continue;
+
+        const u64* counts = game_state->work.total.counts;
+        times[f - warmup] = time * 1e3;
+        total_time += time;
+        rays += counts[WORK_PRIMARY_RAYS] + counts[WORK_SHADOW_RAYS] + counts[WORK_AO_RAYS] + counts[WORK_SECONDARY_RAYS];
+        map_calls += counts[WORK_MAP_CALLS];
+    }
+    qsort(times, frames, sizeof(f64), compare_f64);
+
+    Bench_Result result = {};
+    snprintf(result.scene, sizeof(result.scene), "%s", bench_scene->name);
+    result.width = width;
+    result.height = height;
+    result.threads = threads;
+    result.frames = frames;
+    result.p50_ms = percentile(times, frames, 50.0);
+    result.p95_ms = percentile(times, frames, 95.0);
+    result.p99_ms = percentile(times, frames, 99.0);
+    result.mrays_per_s = total_time > 0.0 ? rays / total_time / 1e6 : 0.0;
+    result.map_calls_per_frame = (f64)map_calls / frames;
+    result.scaling = 1.0;
+    return result;
+}
+
+internal b32 same_run(Bench_Result* a, Bench_Result* b)
+{
+    return strcmp(a->scene, b->scene) == 0 && a->width == b->width && a->height == b->height && a->threads == b->threads;
+}
+
+// Compares each run with the run of the same scene and size on the fewest threads
+internal void compute_scaling(Bench_Result* results, s32 count)
+{
+    foreach(i, count)
+    {
+        Bench_Result* base = NULL;
+        foreach(j, count)
+        {
+            Bench_Result* other = &results[j];
+            if (strcmp(other->scene, results[i].scene) != 0 || other->width != results[i].width || other->height != results[i].height) continue;
+            if (!base || other->threads < base->threads) base = other;
+        }
+        const f64 speedup = base->p50_ms / results[i].p50_ms;
+        results[i].scaling = speedup * base->threads / results[i].threads;
+    }
+}
+
+//
+// Baseline
+//
+internal void write_result(FILE* file, Bench_Result* r)
+{
+    fprintf(file, "{\"scene\":\"%s\",\"width\":%d,\"height\":%d,\"threads\":%d,\"frames\":%d,"
+                  "\"p50_ms\":%.3f,\"p95_ms\":%.3f,\"p99_ms\":%.3f,\"mrays_per_s\":%.3f,"
+                  "\"map_calls_per_frame\":%.1f,\"scaling\":%.3f}\n",
+            r->scene, r->width, r->height, r->threads, r->frames,
+            r->p50_ms, r->p95_ms, r->p99_ms, r->mrays_per_s,
+            r->map_calls_per_frame, r->scaling);
+}
+
+// Reads a line write_result writes, it is not a general JSON parser
+internal b32 parse_result(const char* line, Bench_Result* r)
+{
+    const s32 fields = sscanf(line,
+        "{\"scene\":\"%31[^\"]\",\"width\":%d,\"height\":%d,\"threads\":%d,\"frames\":%d,"
+        "\"p50_ms\":%lf,\"p95_ms\":%lf,\"p99_ms\":%lf,\"mrays_per_s\":%lf,"
+        "\"map_calls_per_frame\":%lf,\"scaling\":%lf}",
+        r->scene, &r->width, &r->height, &r->threads, &r->frames,
+        &r->p50_ms, &r->p95_ms, &r->p99_ms, &r->mrays_per_s,
+        &r->map_calls_per_frame, &r->scaling);
+    return fields == 11;
+}
+
+//
+// Golden images
+//
+#define GOLDEN_BLOCK_SIZE 4 // max error is taken over block averages, single edge pixels may differ
+
+// The settings a golden image is rendered with. The reference turns every
+// approximation off, each fast path turns some of them back on.
+struct Golden_Path
+{
+    const char* name;
+    b32 reference; // plain marching with more steps and no frame cache
+    b32 shadow_maps;
+    u16 lighting_scale;
+    b32 probes;
+    u16 aa_samples;
+    b32 vrs;
+    b32 taa;
+};
+
+global_variable Golden_Path golden_reference = { "reference", true, false, 1, false, 16, false, false };
+
+global_variable Golden_Path golden_paths[GOLDEN_PATH_COUNT] =
+{
+    { "march",     false, false, 1, false, 16, false, false }, // relaxation, level of detail and the frame cache
+    { "shadows",   true,  true,  1, false, 16, false, false },
+    { "lighting2", true,  false, 2, false, 16, false, false },
+    { "lighting4", true,  false, 4, false, 16, false, false },
+    { "probes",    true,  false, 1, true,  16, false, false },
+    { "vrs",       true,  false, 1, false, 16, true,  false },
+    { "aa4",       true,  false, 1, false, 4,  false, false },
+    { "taa",       true,  false, 1, false, 16, false, true  },
+    { "default",   false, true,  2, true,  4,  true,  false }, // what the game starts with
+};
+
+// Renders the scene still from halfway along its path and returns the pixels of
+// the last of 'frames' frames
+internal u32* render_golden(Game_Memory* memory, Bench_Scene* bench_scene, s32 width, s32 height, s32 threads, Golden_Path* path, s32 frames)
+{
+    Game_State* game_state = (Game_State*)memory->permanent_storage;
+    start_bench(memory, bench_scene, width, height, threads);
+
+    game_state->reference_mode = path->reference;
+    game_state->shadow_maps_enabled = path->shadow_maps;
+    game_state->lighting_scale = path->lighting_scale;
+    game_state->probes_enabled = path->probes;
+    game_state->aa_samples = path->aa_samples;
+    game_state->vrs_enabled = path->vrs;
+    game_state->taa_enabled = path->taa;
+
+    Camera* camera = &game_state->camera;
+    camera->position = mix(bench_scene->from, bench_scene->to, (v3) { 0.5, 0.5, 0.5 });
+    camera->front = normalize(mix(bench_scene->look_from, bench_scene->look_to, (v3) { 0.5, 0.5, 0.5 }) - camera->position);
+
+    bench_clock = GOLDEN_TIME;
+    foreach(f, frames) game_update_and_render(memory);
+    return (u32*)game_state->bitmap.buffer;
+}
+
+internal void golden_path(char* path, s32 size, const char* dir, Bench_Scene* scene, s32 width, s32 height, const char* suffix)
+{
+    snprintf(path, size, "%s/%s_%dx%d%s.ppm", dir, scene->name, width, height, suffix);
+}
+
+internal b32 write_ppm(const char* path, u32* pixels, s32 width, s32 height)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        printf("could not write '%s': %d %s\n", path, errno, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    foreach(i, width * height)
+    {
+        const u8 rgb[3] = { (u8)(pixels[i] >> 0), (u8)(pixels[i] >> 8), (u8)(pixels[i] >> 16) };
+        fwrite(rgb, 1, 3, file);
+    }
+    if (fclose(file) != 0)
+    {
+        printf("could not write '%s': %d %s\n", path, errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Reads the files write_ppm writes into 'rgb', which holds width * height * 3 bytes
+internal b32 read_ppm(const char* path, u8* rgb, s32 width, s32 height)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        printf("could not read '%s': %d %s\n", path, errno, strerror(errno));
+        return false;
+    }
+
+    s32 w = 0, h = 0, max_value = 0;
+    const b32 ok = fscanf(file, "P6 %d %d %d", &w, &h, &max_value) == 3 && fgetc(file) != EOF &&
+                   w == width && h == height && max_value == 255 &&
+                   fread(rgb, 1, width * height * 3, file) == (size_t)(width * height * 3);
+    fclose(file);
+    if (!ok) printf("'%s' is not a %dx%d golden image\n", path, width, height);
+    return ok;
+}
+
+struct Golden_Error
+{
+    f64 psnr; // INFINITY when the images are the same
+    s32 max_error;
+};
+
+internal Golden_Error compare_golden(u8* reference, u32* pixels, s32 width, s32 height)
+{
+    Golden_Error error = {};
+
+    f64 squared_sum = 0.0;
+    foreach(i, width * height)
+    foreach(c, 3)
+    {
+        const f64 d = (f64)((pixels[i] >> (c * 8)) & 0xff) - reference[i * 3 + c];
+        squared_sum += d * d;
+    }
+    const f64 mse = squared_sum / (width * height * 3);
+    error.psnr = mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : INFINITY;
+
+    for (s32 by = 0; by < height; by += GOLDEN_BLOCK_SIZE)
+    for (s32 bx = 0; bx < width; bx += GOLDEN_BLOCK_SIZE)
+    foreach(c, 3)
+    {
+        s32 sum = 0;
+        s32 count = 0;
+        for (s32 y = by; y < by + GOLDEN_BLOCK_SIZE && y < height; ++y)
+        for (s32 x = bx; x < bx + GOLDEN_BLOCK_SIZE && x < width; ++x)
+        {
+            const s32 i = y * width + x;
+            sum += (s32)((pixels[i] >> (c * 8)) & 0xff) - reference[i * 3 + c];
+            count++;
+        }
+        const s32 block_error = abs(sum) / count;
+        error.max_error = block_error > error.max_error ? block_error : error.max_error;
+    }
+    return error;
+}
+
+// Writes the reference images, or checks every fast path against them and writes
+// the images of the ones that fail next to them. Returns the number of failures,
+// or -1 when an image could not be read or written.
+internal s32 run_golden(Game_Memory* memory, const char* dir, b32 write, Bench_Scene** scenes, s32 scene_count, s32* widths, s32* heights, s32 size_count, s32 threads)
+{
+    char path[512];
+    s32 failures = 0;
+    if (!write) printf("%-8s %10s %-10s %9s %9s\n", "scene", "size", "path", "PSNR dB", "max err");
+
+    foreach(s, scene_count)
+    foreach(z, size_count)
+    {
+        Bench_Scene* scene = scenes[s];
+        const s32 width = widths[z];
+        const s32 height = heights[z];
+        golden_path(path, sizeof(path), dir, scene, width, height, "");
+
+        if (write)
+        {
+            u32* pixels = render_golden(memory, scene, width, height, threads, &golden_reference, 1);
+            if (!write_ppm(path, pixels, width, height)) return -1;
+            printf("wrote %s\n", path);
+            continue;
+        }
+
+        u8* reference = (u8*)malloc(width * height * 3);
+        if (!read_ppm(path, reference, width, height))
+        {
+            free(reference);
+            return -1;
+        }
+
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", width, height);
+        foreach(p, array_count(golden_paths))
+        {
+            Golden_Path* golden = &golden_paths[p];
+            u32* pixels = render_golden(memory, scene, width, height, threads, golden, GOLDEN_FRAMES);
+            const Golden_Error error = compare_golden(reference, pixels, width, height);
+            const Golden_Tolerance* tolerance = &scene->golden[p];
+            const b32 failed = error.psnr < tolerance->min_psnr || error.max_error > tolerance->max_error;
+            printf("%-8s %10s %-10s %9.2f %9d%s\n", scene->name, size, golden->name, error.psnr, error.max_error, failed ? "  FAILED" : "");
+            fflush(stdout);
+
+            if (failed)
+            {
+                char suffix[64];
+                snprintf(suffix, sizeof(suffix), "_%s", golden->name);
+                golden_path(path, sizeof(path), dir, scene, width, height, suffix);
+                if (write_ppm(path, pixels, width, height)) printf("wrote %s\n", path);
+                failures++;
+            }
+        }
+        free(reference);
+    }
+    return failures;
+}
+
+//
+// Arguments
+//
+// Splits a comma separated list in place
+internal s32 split_list(char* list, char** items)
+{
+    s32 count = 0;
+    for (char* item = strtok(list, ","); item && count < MAX_BENCH_LIST; item = strtok(NULL, ",")) items[count++] = item;
+    return count;
+}
+
+s32 main(s32 argc, char** argv)
+{
+    char scenes_arg[BENCH_ARG_LENGTH] = "demo,prims,glass,lights,rep";
+    char sizes_arg[BENCH_ARG_LENGTH] = "";
+    char threads_arg[BENCH_ARG_LENGTH] = "";
+    s32 frames = 30;
+    s32 warmup = 4;
+    const char* out_path = "bench.jsonl";
+    const char* baseline_path = NULL;
+    f64 threshold = 5.0; // percent p50 may grow before it counts as a regression
+    const char* golden_dir = NULL;
+    const char* write_golden_dir = NULL;
+
+    snprintf(threads_arg, sizeof(threads_arg), "1,2,4,%u", std::thread::hardware_concurrency());
+    Bench_Arg args[] = {
+        { "--scenes",       ARG_TEXT,   scenes_arg },
+        { "--sizes",        ARG_TEXT,   sizes_arg },
+        { "--threads",      ARG_TEXT,   threads_arg },
+        { "--frames",       ARG_S32,    &frames },
+        { "--warmup",       ARG_S32,    &warmup },
+        { "--out",          ARG_STRING, &out_path },
+        { "--baseline",     ARG_STRING, &baseline_path },
+        { "--threshold",    ARG_F64,    &threshold },
+        { "--golden",       ARG_STRING, &golden_dir },
+        { "--write-golden", ARG_STRING, &write_golden_dir },
+    };
+    if (!parse_bench_args(argc, argv, args, array_count(args))) return 1;
+
+    const b32 write_golden = write_golden_dir != NULL;
+    if (write_golden) golden_dir = write_golden_dir;
+    if (!sizes_arg[0]) snprintf(sizes_arg, sizeof(sizes_arg), "%s", golden_dir ? GOLDEN_SIZES : BENCH_SIZES);
+    if (frames < 1 || frames > MAX_BENCH_FRAMES || warmup < 0)
+    {
+        printf("frames must be in 1..%d and warmup at least 0\n", MAX_BENCH_FRAMES);
+        return 1;
+    }
+
+    char* items[MAX_BENCH_LIST];
+
+    Bench_Scene* scenes[MAX_BENCH_LIST];
+    const s32 scene_count = split_list(scenes_arg, items);
+    foreach(i, scene_count)
+    {
+        scenes[i] = find_bench_scene(items[i]);
+        if (!scenes[i]) { printf("unknown scene %s\n", items[i]); return 1; }
+    }
+
+    s32 widths[MAX_BENCH_LIST];
+    s32 heights[MAX_BENCH_LIST];
+    const s32 size_count = split_list(sizes_arg, items);
+    foreach(i, size_count)
+    {
+        if (sscanf(items[i], "%dx%d", &widths[i], &heights[i]) != 2 || widths[i] < 1 || heights[i] < 1) { printf("bad size %s\n", items[i]); return 1; }
+    }
+
+    // Each thread count once, in increasing order
+    s32 threads[MAX_BENCH_LIST];
+    s32 thread_count = 0;
+    const s32 thread_item_count = split_list(threads_arg, items);
+    foreach(i, thread_item_count)
+    {
+        const s32 n = atoi(items[i]);
+        if (n < 1) { printf("bad thread count %s\n", items[i]); return 1; }
+        s32 at = thread_count;
+        while (at > 0 && threads[at - 1] > n) at--;
+        if (at > 0 && threads[at - 1] == n) continue;
+        for (s32 j = thread_count; j > at; --j) threads[j] = threads[j - 1];
+        threads[at] = n;
+        thread_count++;
+    }
+
+    static Bench_Result baseline[MAX_BENCH_RESULTS];
+    const s32 baseline_count = baseline_path && !golden_dir ? read_baseline(baseline_path, baseline, MAX_BENCH_RESULTS, parse_result) : 0;
+    if (baseline_count < 0) return 1;
+
+    Game_Memory memory = {};
+    memory.permanent_storage_size = MEGABYTES(64);
+    memory.transient_storage_size = GIGABYTES(1);
+    memory.permanent_storage = mmap(NULL, memory.permanent_storage_size + memory.transient_storage_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (memory.permanent_storage == MAP_FAILED)
+    {
+        printf("mmap error: %d %s\n", errno, strerror(errno));
+        return 1;
+    }
+    memory.transient_storage = (u8*)memory.permanent_storage + memory.permanent_storage_size;
+    memory.get_window_size       = bench_get_window_size;
+    memory.get_input_info        = bench_get_input_info;
+    memory.set_cursor_visibility = bench_set_cursor_visibility;
+    memory.swap_buffers          = bench_swap_buffers;
+    memory.get_time              = bench_get_time;
+    memory.get_compile_state     = bench_get_compile_state;
+    memory.submit_job            = pool_submit_job;
+    memory.parallel_for          = pool_parallel_for;
+    memory.wait_jobs             = pool_wait_jobs;
+
+    // The images don't depend on the thread count, so the most threads render them
+    if (golden_dir)
+    {
+        resize_job_pool(threads[thread_count - 1]);
+        const s32 failures = run_golden(&memory, golden_dir, write_golden, scenes, scene_count, widths, heights, size_count, threads[thread_count - 1]);
+        if (failures < 0) return 1;
+        if (failures)
+        {
+            printf("%d fast paths are outside their scene's tolerance\n", failures);
+            return 2;
+        }
+        return 0;
+    }
+
+#if !WORK_COUNTERS
+    printf("built without work counters, Mrays/s and map() calls are reported as 0\n");
+#endif
+
+    // Workers are only replaced between thread counts
+    static Bench_Result results[MAX_BENCH_RESULTS];
+    s32 result_count = 0;
+    foreach(t, thread_count)
+    {
+        resize_job_pool(threads[t]);
+        foreach(s, scene_count)
+        foreach(z, size_count)
+        {
+            printf("%s %dx%d %d threads\n", scenes[s]->name, widths[z], heights[z], threads[t]);
+            fflush(stdout);
+            results[result_count++] = run_bench(&memory, scenes[s], widths[z], heights[z], threads[t], warmup, frames);
+        }
+    }
+    compute_scaling(results, result_count);
+
+    FILE* out = open_results(out_path);
+    if (!out) return 1;
+
+    printf("\n%-8s %10s %4s %9s %9s %9s %9s %8s", "scene", "size", "thr", "p50 ms", "p95 ms", "p99 ms", "Mrays/s", "scaling");
+    if (baseline_count) printf(" %9s %9s %9s", "p50", "Mrays/s", "work");
+    printf("\n");
+
+    s32 regressions = 0;
+    foreach(s, scene_count)
+    foreach(z, size_count)
+    foreach(t, thread_count)
+    {
+        Bench_Result* r = NULL;
+        foreach(i, result_count)
+        {
+            Bench_Result* candidate = &results[i];
+            if (strcmp(candidate->scene, scenes[s]->name) == 0 && candidate->width == widths[z] && candidate->height == heights[z] && candidate->threads == threads[t]) r = candidate;
+        }
+        write_result(out, r);
+
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", r->width, r->height);
+        printf("%-8s %10s %4d %9.2f %9.2f %9.2f %9.2f %8.2f", r->scene, size, r->threads, r->p50_ms, r->p95_ms, r->p99_ms, r->mrays_per_s, r->scaling);
+
+        // Time is compared against the threshold, the map() calls are deterministic
+        // and any change means the change did more or less work
+        foreach(i, baseline_count)
+        {
+            Bench_Result* b = &baseline[i];
+            if (!same_run(r, b)) continue;
+
+            const b32 regressed = print_change(r->p50_ms, b->p50_ms) > threshold;
+            print_change(r->mrays_per_s, b->mrays_per_s);
+            print_change(r->map_calls_per_frame, b->map_calls_per_frame);
+            if (regressed) printf("  REGRESSION");
+            regressions += regressed;
+            break;
+        }
+        printf("\n");
+    }
+
+    if (!close_results(out, out_path)) return 1;
+    return report_regressions(regressions, "runs", threshold);
+}
@@ -0,0 +1,166 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+// What the headless benchmark and the microbenchmarks share: the clock, the
+// command line, and comparing a run with the JSON lines of an earlier one.
+#ifndef _BENCH_COMMON_H_
+#define _BENCH_COMMON_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "common.h"
+
+#define BENCH_ARG_LENGTH 256 // of the text an ARG_TEXT argument is copied into
+
+internal u64 wall_time()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//
+// Arguments
+//
+enum Bench_Arg_Kind
+{
+    ARG_STRING, // const char*, points into argv
+    ARG_TEXT,   // char[BENCH_ARG_LENGTH], a copy that can be split in place
+    ARG_S32,
+    ARG_F64,
+};
+
+struct Bench_Arg
+{
+    const char* name; // with the dashes
+    Bench_Arg_Kind kind;
+    void* value;
+};
+
+// Every argument is a name followed by a value, which is stored into the value of
+// the argument of that name. Prints the first one it can't use and returns false.
+internal b32 parse_bench_args(s32 argc, char** argv, Bench_Arg* args, s32 arg_count)
+{
+    for (s32 i = 1; i < argc; i += 2)
+    {
+        const char* name = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        Bench_Arg* arg = NULL;
+        foreach(j, arg_count) if (strcmp(args[j].name, name) == 0) arg = &args[j];
+        if (!arg)
+        {
+            printf("unknown argument %s\n", name);
+            return false;
+        }
+        if (!value)
+        {
+            printf("missing value for %s\n", name);
+            return false;
+        }
+
+        switch (arg->kind)
+        {
+            case ARG_STRING: *(const char**)arg->value = value; break;
+            case ARG_TEXT:   snprintf((char*)arg->value, BENCH_ARG_LENGTH, "%s", value); break;
+            case ARG_S32:    *(s32*)arg->value = atoi(value); break;
+            case ARG_F64:    *(f64*)arg->value = atof(value); break;
+        }
+    }
+    return true;
+}
+
+//
+// Baseline
+//
+// Reads up to 'capacity' results from the lines of an earlier run. 'parse' gets
+// each line and the result to fill in, and returns whether the line was one.
+// Returns the count read, or -1 when the file can't be read.
+template <class T, class F>
+internal s32 read_baseline(const char* path, T* results, s32 capacity, F parse)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        printf("could not read baseline '%s': %d %s\n", path, errno, strerror(errno));
+        return -1;
+    }
+
+    s32 count = 0;
+    char line[1024];
+    while (count < capacity && fgets(line, sizeof(line), file))
+    {
+        if (parse(line, &results[count])) count++;
+    }
+    fclose(file);
+    return count;
+}
+
+internal FILE* open_results(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file) printf("could not write '%s': %d %s\n", path, errno, strerror(errno));
+    return file;
+}
+
+internal b32 close_results(FILE* file, const char* path)
+{
+    if (fclose(file) != 0)
+    {
+        printf("could not write '%s': %d %s\n", path, errno, strerror(errno));
+        return false;
+    }
+    printf("\nwrote %s\n", path);
+    return true;
+}
+
+internal f64 percent_change(f64 value, f64 baseline)
+{
+    return baseline != 0.0 ? (value - baseline) / baseline * 100.0 : 0.0;
+}
+
+// Prints the change from the baseline as a column of the report and returns it.
+// A zero on either side means there is nothing to compare, and prints a dash.
+internal f64 print_change(f64 value, f64 baseline)
+{
+    if (value == 0.0 || baseline == 0.0)
+    {
+        printf(" %9s", "-");
+        return 0.0;
+    }
+    const f64 change = percent_change(value, baseline);
+    printf(" %+8.1f%%", change);
+    return change;
+}
+
+// Ends the report: returns 2, what the scripts check for, when anything regressed
+internal s32 report_regressions(s32 regressions, const char* what, f64 threshold)
+{
+    if (!regressions) return 0;
+    printf("%d %s regressed by more than %.1f%%\n", regressions, what, threshold);
+    return 2;
+}
+
+#endif
@@ -17,6 +17,8 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 // DEALINGS IN THE SOFTWARE.
 
+#include <algorithm>
+#include <thread>
 #include <vector>
 
 #include "common.h"
@@ -31,10 +33,20 @@ global_variable Compile_State (*get_compile_state)();
 
 #include "shader_common.h"
 #include "utility.cc"
+#include "trace.cc"
+#include "counters.cc"
 #include "camera.cc"
+#include "scene.cc"
+#include "retained_scene.cc"
+#include "scene_file.cc"
+#include "light.cc"
 #include "kernel.cc"
 #include "dispatch.cc"
+#include "shadow_cache.cc"
+#include "probes.cc"
+#include "frame_cache.cc"
 #include "font.cc"
+#include "overlay.cc"
 
 internal void vsync(s32 target_framerate, u64 frame_start_time, u64 swapbuffer_time)
 {
@@ -73,14 +85,41 @@ struct Game_State
     u64 start_time;
     u64 swap_buffer_time;
     f64 time;
+    f64 paused_time; // spent in progressive mode, where the demo animation holds still
     f64 fps;
     f64 deltaTime;
     s32 threadCount;
     b32 insert_mode;
     b32 debug_mode;
     u8 active_kernel_type;
+    b32 progressive_mode;
+    u16 lighting_scale;
+    b32 probes_enabled;
+    u16 aa_samples;
+    b32 vrs_enabled;
+    b32 taa_enabled;
+    f32 render_scale;
+    b32 shadow_maps_enabled;
+    b32 reference_mode; // plain marching and no frame cache, the bench's golden mode sets these two
+    u32 accumulated_samples;
+    u64 scene_hash;
     Camera camera;
     Bitmap bitmap;
+    v4* accumulation;
+    u8* shading_rates; // per VRS tile, picked from the previous frame
+    v4* taa_history[2]; // output sized, the previous frame's is read while the other is written
+    b32 taa_history_valid;
+    u32 taa_frame;
+    Retained_Scene scene;
+    Scene_Snapshot scene_snapshot;
+    Frame_Constants frame_constants; // last frame's uniform stays in it as 'previous'
+    Scene_Handle pulse_object; // animated by the frame, -1 once a scene file is loaded
+    Scene_Handle sun_light;
+    Shadow_Cache shadow_cache;
+    Probe_Cache probe_cache;
+    Frame_Cache frame_cache;
+    Work_Frame work; // the last frame's counts, kept for the bench
+    Frame_Graph frame_graph;
 };
 
 internal void allocate_bitmap(Bitmap* bitmap)
@@ -92,6 +131,138 @@ internal void allocate_bitmap(Bitmap* bitmap)
     bitmap->buffer = (u8*)malloc(bitmap->pitch * bitmap->height);
 }
 
+internal void allocate_accumulation(v4** accumulation, Bitmap* bitmap)
+{
+    if (*accumulation)
+    {
+        free(*accumulation);
+    }
+    *accumulation = (v4*)calloc(bitmap->width * bitmap->height, sizeof(v4));
+}
+
+internal void allocate_shading_rates(u8** rates, Bitmap* bitmap)
+{
+    if (*rates)
+    {
+        free(*rates);
+    }
+    const s32 tiles_x = (bitmap->width + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    const s32 tiles_y = (bitmap->height + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    *rates = (u8*)malloc(tiles_x * tiles_y);
+    memset(*rates, 1, tiles_x * tiles_y);
+}
+
+// Hash of everything that affects the rendered image. Fields are hashed one by one
+// since the structs contain uninitialized padding, the scene by its versions.
+internal u64 hash_frame_inputs(Uniform* uniform, Scene_Snapshot* snapshot)
+{
+    u64 hash = FNV_OFFSET_BASIS;
+    hash = hash_v3(hash, uniform->camera_position);
+    hash = hash_v3(hash, uniform->camera_target);
+    hash = hash_f32(hash, uniform->camera_zoom);
+    hash = hash_bytes(hash, &uniform->viewport_size, sizeof(uniform->viewport_size));
+    hash = hash_bytes(hash, &snapshot->edits_version, sizeof(snapshot->edits_version));
+    hash = hash_bytes(hash, &snapshot->materials_version, sizeof(snapshot->materials_version));
+    return hash_bytes(hash, &snapshot->lights_version, sizeof(snapshot->lights_version));
+}
+
+// Fills the scene once at startup, the frame animates the returned objects.
+internal void build_demo_scene(Retained_Scene* scene, Scene_Handle* pulse_object, Scene_Handle* sun_light)
+{
+    {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { 2 } },
+            { SET_SIZE, (v3) { 10.0, 100.0, 10.0 } },
+            // { OP_REP, (v3) { 1.0, 1000.0, 1.0 } },
+            { SD_BOX, (v3) { 0.0, -101.0, 0.0 } },
+            // { OP_RESET },
+            { OP_UNION },
+        };
+        add_object(scene, edits, array_count(edits));
+    }
+    {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { 4 } },
+            { SET_SIZE, (v3) { 1.0, 0.0, 1.0 } },
+            { SD_CAPPED_CYLINDER, (v3) { 0.0, 4.0, 0.0 } },
+            { OP_UNION },
+        };
+        *pulse_object = add_object(scene, edits, array_count(edits));
+    }
+    {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { 10 } },
+            { SET_SIZE, (v3) { 1.0, 1.0, 1.0 } },
+            { SD_SPHERE, (v3) { 0.0, 0.0, 0.0 } },
+            { OP_UNION },
+        };
+        add_object(scene, edits, array_count(edits));
+    }
+    {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { 4 } },
+            { SET_SIZE, (v3) { 1.0, 0.5, 1.0 } },
+            { SD_TORUS, (v3) { 0.0, 0.0, 4.0 } },
+            { OP_UNION },
+        };
+        add_object(scene, edits, array_count(edits));
+    }
+    {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { 3 } },
+            { SET_SIZE, (v3) { 1.0, 1.0, 1.0 } },
+            { SD_BOX, (v3) { 0.0, 0.0, -4.0 } },
+            { OP_UNION },
+        };
+        add_object(scene, edits, array_count(edits));
+    }
+    {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { 9 } },
+            { SET_SIZE, (v3) { 0.2, 1.0, 0.0 } },
+            { SD_CAPPED_CYLINDER, (v3) { 0.0, 0.0, 8.0 } },
+            { OP_UNION },
+        };
+        add_object(scene, edits, array_count(edits));
+    }
+    {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { 7 } },
+            { SD_CAPPED_CYLINDER, (v3) { 0.0, 0.0, -8.0 } },
+            { OP_UNION },
+        };
+        add_object(scene, edits, array_count(edits));
+    }
+    for (int i = 0; i < 10; ++i) {
+        Edit edits[] = {
+            { SET_MATERIAL_ID, (v3) { static_cast<f32>(i) } },
+            { SD_CAPPED_CYLINDER, (v3) { static_cast<f32>(sin(i) * 10.0), 0.0, static_cast<f32>(cos(i) * 10.0) } },
+            { OP_UNION },
+        };
+        add_object(scene, edits, array_count(edits));
+    }
+
+    // Materials
+    add_material(scene, (Material) { (v3) { 0.3, 0.3, 0.3 }, DIFF, 0.0, 0.3, 0.2 });
+    add_material(scene, (Material) { (v3) { 1.0, 0.3, 0.4 }, DIFF, 0.0, 0.3, 1.0 });
+    add_material(scene, (Material) { (v3) { 1.0, 0.8, 0.7 }, DIFF, 0.0, 0.3, 0.9 });
+    add_material(scene, (Material) { (v3) { 1.0, 0.3, 0.5 }, REFR, 1.0, 0.5, 0.5 });
+    add_material(scene, (Material) { (v3) { 1.0, 1.0, 1.0 }, REFR, 0.0, 0.5, 0.5 });
+    add_material(scene, (Material) { (v3) { 1.0, 0.1, 0.1 }, DIFF, 10.0, 0.3, 0.2 });
+    add_material(scene, (Material) { (v3) { 0.3, 0.4, 0.3 }, DIFF, 0.0, 0.3, 0.2 });
+    add_material(scene, (Material) { (v3) { 0.1, 0.9, 0.3 }, REFR, 0.0, 0.3, 0.2 });
+    add_material(scene, (Material) { (v3) { 0.1, 0.9, 0.1 }, DIFF, 0.0, 0.3, 0.2 });
+    add_material(scene, (Material) { (v3) { 1.0, 1.0, 1.0 }, DIFF, 0.0, 0.3, 0.2 });
+    add_material(scene, (Material) { (v3) { 1.0, 1.0, 1.0 }, REFR, 0.0, 0.3, 1 });
+    add_material(scene, (Material) { (v3) { 1.0, 1.0, 0.5 }, DIFF, 1.0, 0.5, 1.0 });
+    add_material(scene, (Material) { (v3) { 0.8, 0.1, 0.3 }, DIFF, 0.0, 0.3, 0.2 });
+    add_material(scene, (Material) { (v3) { 0.58, 0.38, 0.21 }, DIFF, 0.0, 0.1, 0.01 });
+
+    // Lights
+    *sun_light = add_light(scene, (Light) { (v3) { 1000, 1000, 0 }, (v3) { 0.7, 0.5, 0.3 }, 1000.0 });
+    add_light(scene, (Light) { (v3) { 0, 100, 0 }, (v3) { 0.7, 0.76, 0.95 }, 1000.0 });
+}
+
 extern "C" b32 game_update_and_render(Game_Memory *memory)
 {
     Game_State* game_state = (Game_State*)memory->permanent_storage;
@@ -107,6 +278,9 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
     swap_buffers           = memory->swap_buffers;
     get_time               = memory->get_time;
     get_compile_state      = memory->get_compile_state;
+    submit_job             = memory->submit_job;
+    parallel_for           = memory->parallel_for;
+    wait_jobs              = memory->wait_jobs;
 
     if (!memory->is_initialized)
     {
@@ -115,12 +289,25 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
         game_state->start_time       = get_time();
         game_state->swap_buffer_time = 0;
         game_state->time             = 0;
+        game_state->paused_time      = 0;
         game_state->fps              = 0;
         game_state->deltaTime        = 0;
         game_state->threadCount      = std::thread::hardware_concurrency();
         game_state->insert_mode      = true;
         game_state->debug_mode       = true;
         game_state->active_kernel_type = 0;
+        game_state->progressive_mode = false;
+        game_state->lighting_scale   = 2;
+        game_state->probes_enabled   = true;
+        game_state->aa_samples       = 4;
+        game_state->vrs_enabled      = true;
+        game_state->taa_enabled      = false;
+        game_state->render_scale     = 1.0;
+        game_state->shadow_maps_enabled = true;
+        game_state->reference_mode   = false;
+        game_state->accumulated_samples = 0;
+        game_state->scene_hash       = 0;
+        game_state->frame_graph      = {};
         game_state->camera           = defaultCamera();
 
         s32 w,h;
@@ -136,6 +323,17 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
         };
 
         allocate_bitmap(&game_state->bitmap);
+        allocate_accumulation(&game_state->accumulation, &game_state->bitmap);
+        allocate_shading_rates(&game_state->shading_rates, &game_state->bitmap);
+        allocate_accumulation(&game_state->taa_history[0], &game_state->bitmap);
+        allocate_accumulation(&game_state->taa_history[1], &game_state->bitmap);
+        game_state->taa_history_valid = false;
+        game_state->taa_frame = 0;
+        init_retained_scene(&game_state->scene, &game_state->scene_snapshot, &game_state->frame_constants);
+        build_demo_scene(&game_state->scene, &game_state->pulse_object, &game_state->sun_light);
+        init_shadow_cache(&game_state->shadow_cache);
+        init_probe_cache(&game_state->probe_cache);
+        init_frame_cache(&game_state->frame_cache, &game_state->bitmap);
 
         memory->is_initialized = true;
     }
@@ -148,22 +346,41 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
     u64 start_time         =  game_state->start_time;
     u64 swap_buffer_time   =  game_state->swap_buffer_time;
     f64 time               =  game_state->time;
+    f64 paused_time        =  game_state->paused_time;
     f64 fps                =  game_state->fps;
     f64 deltaTime          =  game_state->deltaTime;
     s32 threadCount        =  game_state->threadCount;
     b32 insert_mode        =  game_state->insert_mode;
     b32 debug_mode         =  game_state->debug_mode;
     u8 active_kernel_type  =  game_state->active_kernel_type;
+    b32 progressive_mode   =  game_state->progressive_mode;
+    u16 lighting_scale     =  game_state->lighting_scale;
+    b32 probes_enabled     =  game_state->probes_enabled;
+    u16 aa_samples         =  game_state->aa_samples;
+    b32 vrs_enabled        =  game_state->vrs_enabled;
+    b32 taa_enabled        =  game_state->taa_enabled;
+    f32 render_scale       =  game_state->render_scale;
+    b32 shadow_maps_enabled = game_state->shadow_maps_enabled;
+    b32 reference_mode     =  game_state->reference_mode;
+    u32 accumulated_samples=  game_state->accumulated_samples;
     Camera* camera         =  &game_state->camera;
     Bitmap* bitmap         =  &game_state->bitmap;
+    Retained_Scene* scene  =  &game_state->scene;
     //
 
     // Print some frame stats
     u64 frame_start_time = get_time();
+    TRACE_BEGIN("frame");
     {
+        const f64 previous_time = time;
         time = (frame_start_time - start_time) / 1e9;
         fps = (s32)(1.0 / deltaTime);
+
+        // Progressive mode only accumulates while nothing moves, so the animation
+        // is paused for it and picks up where it stopped
+        if (progressive_mode) paused_time += time - previous_time;
     }
+    const f64 animation_time = time - paused_time;
 
     // Get inputs
     // get_input_info(inputs);
@@ -185,6 +402,8 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
     //     }
     // }
 
+    b32 dump_trace = false;
+    b32 capture_work = false;
     foreach(i, inputs->count)
     {
         Input input = inputs->buffer[i];
@@ -212,6 +431,23 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
                 }
 
                 if (key == KEY_H && state == KEY_PRESSED) debug_mode ^= 1;
+                if (key == KEY_P && state == KEY_PRESSED) progressive_mode ^= 1;
+                if (key == KEY_L && state == KEY_PRESSED) lighting_scale = lighting_scale == 4 ? 1 : lighting_scale * 2;
+                if (key == KEY_G && state == KEY_PRESSED) probes_enabled ^= 1;
+                if (key == KEY_M && state == KEY_PRESSED) aa_samples = aa_samples == 16 ? 1 : aa_samples * 2;
+                if (key == KEY_V && state == KEY_PRESSED) vrs_enabled ^= 1;
+                if (key == KEY_T && state == KEY_PRESSED) taa_enabled ^= 1;
+                if (key == KEY_R && state == KEY_PRESSED) render_scale = render_scale == 0.5 ? 1.0 : render_scale - 0.25;
+
+                // A loaded scene is shown as it was saved, without the demo animation
+                if (key == KEY_F5 && state == KEY_PRESSED) write_scene(SCENE_FILE_PATH, scene, camera, &game_state->frame_constants);
+                if (key == KEY_F7 && state == KEY_PRESSED) dump_trace = true;
+                if (key == KEY_F8 && state == KEY_PRESSED) capture_work = true;
+                if (key == KEY_F9 && state == KEY_PRESSED && load_scene(SCENE_FILE_PATH, scene, &game_state->scene_snapshot, &game_state->frame_constants, camera))
+                {
+                    game_state->pulse_object = -1;
+                    game_state->sun_light = -1;
+                }
 
                 if (key == KEY_1 && state == KEY_PRESSED) active_kernel_type = 1;
                 if (key == KEY_2 && state == KEY_PRESSED) active_kernel_type = 2;
@@ -235,6 +471,14 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
     s64 height = bitmap->height;
     s64 width = bitmap->width;
 
+    // With TAA the scene can be rendered below the output resolution, the temporal
+    // resolve reconstructs it to full size. Progressive mode always renders at
+    // full size.
+    const b32 use_taa = taa_enabled && !progressive_mode;
+    const f32 scale = use_taa ? render_scale : 1.0;
+    const s64 render_width = width * scale > 1 ? width * scale : 1;
+    const s64 render_height = height * scale > 1 ? height * scale : 1;
+
     // Calculate camera matrix
     const auto ro = camera->position;
     const auto ta = camera->position + camera->front;
@@ -246,166 +490,312 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
     const auto cv = cross(cu, cw);
     const auto matrix = mat3(cu, cv, cw);
 
-    // Setup edits
-    Edit_Info edit_info = {};
-    edit_info.count = 0;
-
-    edit_info.edits[edit_info.count++] = (Edit) { SET_MATERIAL_ID, (v3) { 2 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SET_SIZE, (v3) { 10.0, 100.0, 10.0 } };
-    // edit_info.edits[edit_info.count++] = (Edit) { OP_REP, (v3) { 1.0, 1000.0, 1.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SD_BOX, (v3) { 0.0, -101.0, 0.0 } };
-    // edit_info.edits[edit_info.count++] = (Edit) { OP_RESET };
-    edit_info.edits[edit_info.count++] = (Edit) { OP_UNION };
-
-    edit_info.edits[edit_info.count++] = (Edit) { SET_MATERIAL_ID, (v3) { 4 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SET_SIZE, (v3) { 1.0, (f32)abs(sin(time)), 1.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SD_CAPPED_CYLINDER, (v3) { 0.0, 4.0, 0.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { OP_UNION };
-
-    edit_info.edits[edit_info.count++] = (Edit) { SET_MATERIAL_ID, (v3) { 10 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SET_SIZE, (v3) { 1.0, 1.0, 1.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SD_SPHERE, (v3) { 0.0, 0.0, 0.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { OP_UNION };
-
-    edit_info.edits[edit_info.count++] = (Edit) { SET_MATERIAL_ID, (v3) { 4 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SET_SIZE, (v3) { 1.0, 0.5, 1.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SD_TORUS, (v3) { 0.0, 0.0, 4.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { OP_UNION };
-
-    edit_info.edits[edit_info.count++] = (Edit) { SET_MATERIAL_ID, (v3) { 3 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SET_SIZE, (v3) { 1.0, 1.0, 1.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SD_BOX, (v3) { 0.0, 0.0, -4.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { OP_UNION };
-
-    edit_info.edits[edit_info.count++] = (Edit) { SET_MATERIAL_ID, (v3) { 9 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SET_SIZE, (v3) { 0.2, 1.0, 0.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SD_CAPPED_CYLINDER, (v3) { 0.0, 0.0, 8.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { OP_UNION };
-
-    edit_info.edits[edit_info.count++] = (Edit) { SET_MATERIAL_ID, (v3) { 7 } };
-    edit_info.edits[edit_info.count++] = (Edit) { SD_CAPPED_CYLINDER, (v3) { 0.0, 0.0, -8.0 } };
-    edit_info.edits[edit_info.count++] = (Edit) { OP_UNION };
+    // Animate the scene, setters leave it alone when nothing changed
+    {
+        Edit pulse[] = {
+            { SET_MATERIAL_ID, (v3) { 4 } },
+            { SET_SIZE, (v3) { 1.0, (f32)abs(sin(animation_time)), 1.0 } },
+            { SD_CAPPED_CYLINDER, (v3) { 0.0, 4.0, 0.0 } },
+            { OP_UNION },
+        };
+        if (game_state->pulse_object >= 0) set_object(scene, game_state->pulse_object, pulse, array_count(pulse));
 
-    for (int i = 0; i < 10; ++i) {
-        edit_info.edits[edit_info.count++] = (Edit) { SET_MATERIAL_ID, (v3) { static_cast<f32>(i) } };
-        edit_info.edits[edit_info.count++] = (Edit) { SD_CAPPED_CYLINDER, (v3) { static_cast<f32>(sin(i) * 10.0), 0.0, static_cast<f32>(cos(i) * 10.0) } };
-        edit_info.edits[edit_info.count++] = (Edit) { OP_UNION };
+        if (game_state->sun_light >= 0)
+        {
+            Light sun = scene->lights[game_state->sun_light];
+            sun.pos = (v3) { static_cast<float>(sin(animation_time) * 100.0), 100, static_cast<float>(cos(animation_time) * 100) };
+            set_light(scene, game_state->sun_light, sun);
+        }
     }
 
+    // Kernels read the frame constants, only the parts of the scene that changed
+    // are written to them
+    Frame_Constants* constants = &game_state->frame_constants;
+    Scene_Snapshot* snapshot = &game_state->scene_snapshot;
+    snapshot_scene(scene, snapshot, constants);
 
-    // Materials
-    Material materials[18];
-    s32 materialCount = 0;
-    materials[materialCount++] = (Material) { (v3) { 0.3, 0.3, 0.3 }, DIFF, 0.0, 0.3, 0.2 };
-    materials[materialCount++] = (Material) { (v3) { 1.0, 0.3, 0.4 }, DIFF, 0.0, 0.3, 1.0 };
-    materials[materialCount++] = (Material) { (v3) { 1.0, 0.8, 0.7 }, DIFF, 0.0, 0.3, 0.9 };
-    materials[materialCount++] = (Material) { (v3) { 1.0, 0.3, 0.5 }, REFR, 1.0, 0.5, 0.5 };
-    materials[materialCount++] = (Material) { (v3) { 1.0, 1.0, 1.0 }, REFR, 0.0, 0.5, 0.5 };
-    materials[materialCount++] = (Material) { (v3) { 1.0, 0.1, 0.1 }, DIFF, 10.0, 0.3, 0.2 };
-    materials[materialCount++] = (Material) { (v3) { 0.3, 0.4, 0.3 }, DIFF, 0.0, 0.3, 0.2 };
-    materials[materialCount++] = (Material) { (v3) { 0.1, 0.9, 0.3 }, REFR, 0.0, 0.3, 0.2 };
-    materials[materialCount++] = (Material) { (v3) { 0.1, 0.9, 0.1 }, DIFF, 0.0, 0.3, 0.2 };
-    materials[materialCount++] = (Material) { (v3) { 1.0, 1.0, 1.0 }, DIFF, 0.0, 0.3, 0.2 };
-    materials[materialCount++] = (Material) { (v3) { 1.0, 1.0, 1.0 }, REFR, 0.0, 0.3, 1 };
-    materials[materialCount++] = (Material) { (v3) { 1.0, 1.0, 0.5 }, DIFF, 1.0, 0.5, 1.0 };
-    materials[materialCount++] = (Material) { (v3) { 0.8, 0.1, 0.3 }, DIFF, 0.0, 0.3, 0.2 };
-    materials[materialCount++] = (Material) { (v3) { 0.58, 0.38, 0.21 }, DIFF, 0.0, 0.1, 0.01 };
-
-    // Setup lights
-    Light_Info light_info;
-    light_info.count = 0;
-    light_info.lights[light_info.count++] = (Light) { (v3) { 1000, 1000, 0 }, (v3) { 0.7, 0.5, 0.3 }, 1000.0 };
-    light_info.lights[light_info.count - 1].pos = (v3) { static_cast<float>(sin(time) * 100.0), 100, static_cast<float>(cos(time) * 100) };
-    light_info.lights[light_info.count++] = (Light) { (v3) { 0, 100, 0 }, (v3) { 0.7, 0.76, 0.95 }, 1000.0 };
-
-    Uniform uniform = {
+    Light_Info& light_info = constants->light_info;
+
+    Uniform& uniform = constants->uniform;
+    uniform = (Uniform) {
         .camera_position = ro,
         .camera_target = ta,
         .camera_zoom = 1.0,
         .camera_matrix = matrix,
-        .viewport_size = ushort2(width, height)
+        .viewport_size = ushort2(render_width, render_height),
+        .sample_index = 0,
+        .lighting_scale = lighting_scale,
+        .use_probes = (u16)probes_enabled,
+        .aa_samples = aa_samples,
+        .jitter = v2(0, 0),
+        .reference = (u16)reference_mode
     };
 
+    // A new sub-pixel offset every frame for the temporal resolve to accumulate
+    const u32 taa_frame = game_state->taa_frame;
+    if (use_taa) uniform.jitter = v2(halton(taa_frame % 16 + 1, 2), halton(taa_frame % 16 + 1, 3)) - 0.5;
+
+    // Everything allocated from here on only lives for this frame
+    Memory_Arena frame_arena = make_arena(memory->transient_storage, memory->transient_storage_size);
+
+    Light_Clusters* clusters = push_struct(&frame_arena, Light_Clusters);
+    assign_lights(&uniform, &light_info, clusters);
+
+    Shadow_Cache* shadow_cache = &game_state->shadow_cache;
+    constants->output_size = ushort2(width, height);
+    constants->clusters = clusters;
+    constants->shadow_maps = &shadow_cache->maps;
+    constants->shadow_depths = shadow_cache->depths;
+
+    const Bounds scene_changes = snapshot->changes;
+
+    // Without shadow maps every shadow ray is marched
+    TRACE_BEGIN("update_shadow_cache");
+    if (!shadow_maps_enabled) clear_shadow_cache(shadow_cache);
+    else update_shadow_cache(shadow_cache, constants, scene_changes, threadCount * 4);
+    TRACE_END();
+
+    Probe_Cache* probe_cache = &game_state->probe_cache;
+    invalidate_probes(probe_cache, scene_changes);
+
+    // Progressive accumulation takes over once the camera and scene have stayed
+    // the same for a frame. Any change restarts it from the first sample.
+    const u64 scene_hash = hash_frame_inputs(&uniform, snapshot);
+    const b32 scene_changed = scene_hash != game_state->scene_hash;
+    if (scene_changed || !progressive_mode) accumulated_samples = 0;
+
+    const b32 is_debug_view = active_kernel_type == 1 || active_kernel_type == 2;
+    const b32 is_progressive = progressive_mode && !scene_changed && !is_debug_view;
+
+    // Probes are requested around the surfaces seen last frame, so that the
+    // tiles their changes reach are known before rendering
+    Frame_Cache* frame_cache = &game_state->frame_cache;
+    Bounds probe_changes = bounds_empty();
+    f64 probeTime = 0;
+    if (probes_enabled && !is_debug_view && !is_progressive)
+    {
+        TRACE_SCOPE("update_probes");
+        const auto start = get_time();
+        if (frame_cache->valid) request_probes(probe_cache, &constants->previous, frame_cache->gbuffer);
+        probe_changes = update_probes(probe_cache, constants, threadCount * 4, &frame_arena);
+        probeTime = (get_time() - start) / 1e9;
+    }
+
+    // With a still camera only the tiles something changed in are rendered, the
+    // rest keep last frame's results. TAA jitters every frame and progressive
+    // mode has no G-buffer, so they render everything, as does a frame whose work
+    // is captured per pixel and a reference render.
+    const s32 rate_tiles_x = (render_width + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    const s32 rate_tiles_y = (render_height + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    ushort2* dirty_tiles = push_array(&frame_arena, rate_tiles_x * rate_tiles_y, ushort2);
+    s32 dirty_count = 0;
+    {
+        u64 settings_hash = FNV_OFFSET_BASIS;
+        settings_hash = hash_bytes(settings_hash, &active_kernel_type, sizeof(active_kernel_type));
+        settings_hash = hash_bytes(settings_hash, &lighting_scale, sizeof(lighting_scale));
+        settings_hash = hash_bytes(settings_hash, &probes_enabled, sizeof(probes_enabled));
+        settings_hash = hash_bytes(settings_hash, &aa_samples, sizeof(aa_samples));
+        settings_hash = hash_bytes(settings_hash, &vrs_enabled, sizeof(vrs_enabled));
+        settings_hash = hash_bytes(settings_hash, &shadow_maps_enabled, sizeof(shadow_maps_enabled));
+        settings_hash = hash_bytes(settings_hash, &reference_mode, sizeof(reference_mode));
+        const u64 view_hash = hash_view(&uniform, snapshot->materials_version, settings_hash);
+
+        TRACE_SCOPE("find_dirty_tiles");
+        if (use_taa || is_progressive || capture_work || reference_mode) frame_cache->valid = false;
+        dirty_count = find_dirty_tiles(frame_cache, constants, view_hash, scene_changes, probe_changes, dirty_tiles, threadCount * 4);
+    }
+
     u32* pixels = (u32*)bitmap->buffer;
 
-    const auto runKernel = [&](auto&& kernel, auto&&... params) {
-        s32 workload_count = threadCount * 4;
+    Pixel_Work* work_pixels = NULL;
+    if (capture_work)
+    {
+        work_pixels = push_array(&frame_arena, render_width * render_height, Pixel_Work);
+        memset(work_pixels, 0, render_width * render_height * sizeof(Pixel_Work));
+    }
+    begin_work_frame(work_pixels, render_width);
 
-        auto tasks = std::vector<std::future<void>>();
-        tasks.reserve(workload_count);
+    // Splits a grid of grid_width x grid_height threads into tiles, one job each.
+    // Every job gets the frame constants by reference, the params are the rest of
+    // the kernel's buffers, and the work counts of the worker running it last.
+    const auto runKernelOver = [&](const char* name, s32 grid_width, s32 grid_height, auto&& kernel, auto&&... params) {
+        TRACE_SCOPE(name);
+        s32 workload_count = threadCount * 4;
 
         s32 col_count = sqrt(workload_count);
         s32 row_count = sqrt(workload_count);
 
-        const s32 col = width / col_count;
-        const s32 row = height / row_count;
+        const s32 col = grid_width / col_count;
+        const s32 row = grid_height / row_count;
 
         const auto start = get_time();
-        foreach(y, row_count)
-        foreach(x, col_count)
-        {
-            tasks.emplace_back(
-                dispatch.async(
-                    kernel,
-                    params...,
-                    ushort2(x * col, y * row),
-                    ushort2((x + 1) * col, (y + 1) * row)
-                )
-            );
-        }
-        for (auto& task : tasks) task.get();
+        dispatch_for(name, row_count * col_count, [&](s32 i, s32 worker) {
+            // The last row and column take what is left over
+            const s32 x = i % col_count;
+            const s32 y = i / col_count;
+            const s32 end_x = x == col_count - 1 ? grid_width : (x + 1) * col;
+            const s32 end_y = y == row_count - 1 ? grid_height : (y + 1) * row;
+            kernel(*constants, params..., ushort2(x * col, y * row), ushort2(end_x, end_y), get_worker_work(worker));
+        });
         return (get_time() - start) / 1e9;
     };
 
+    // Runs a kernel over the parts of a grid that cover the dirty tiles, one job
+    // per tile. tile_size is the size of a VRS tile in the grid.
+    const auto runKernelTiles = [&](const char* name, s32 grid_width, s32 grid_height, s32 tile_size, auto&& kernel, auto&&... params) {
+        if (dirty_count == rate_tiles_x * rate_tiles_y) return runKernelOver(name, grid_width, grid_height, kernel, params...);
+        TRACE_SCOPE(name);
+
+        const auto start = get_time();
+        dispatch_for(name, dirty_count, [&](s32 i, s32 worker) {
+            const s32 x0 = dirty_tiles[i].x * tile_size;
+            const s32 y0 = dirty_tiles[i].y * tile_size;
+            const s32 x1 = x0 + tile_size < grid_width ? x0 + tile_size : grid_width;
+            const s32 y1 = y0 + tile_size < grid_height ? y0 + tile_size : grid_height;
+            if (x0 < x1 && y0 < y1) kernel(*constants, params..., ushort2(x0, y0), ushort2(x1, y1), get_worker_work(worker));
+        });
+        return (get_time() - start) / 1e9;
+    };
+
+    // Runs a kernel over the dirty tiles of the viewport, which is smaller than the
+    // window when TAA renders below the output resolution
+    const auto runKernel = [&](const char* name, auto&& kernel, auto&&... params) {
+        return runKernelTiles(name, render_width, render_height, VRS_TILE_SIZE, kernel, params...);
+    };
 
+    // HDR output of whichever view is active, tone mapped into pixels by the post
+    // pass. It and the G-buffer are kept for the tiles that don't change next frame.
+    v4* hdr = frame_cache->hdr;
+    G_Buffer_Texel* gbuffer = frame_cache->gbuffer;
 
-    v4 clearColor = (v4){0.0, 0.0, 0.0, 1.0};
-    const auto clearTime = runKernel(clear, uniform, clearColor, pixels);
-    auto active_kernel = uber;
-    switch (active_kernel_type) {
-        case 1: active_kernel = normals; break;
-        case 2: active_kernel = steps; break;
-        default: break;
+    // Shading rates picked at the end of the previous frame, full rate everywhere without VRS
+    u8* rates = game_state->shading_rates;
+    if (!vrs_enabled) memset(rates, 1, rate_tiles_x * rate_tiles_y);
+
+    f64 geometryTime = 0;
+    f64 uberTime = 0;
+    f64 aaTime = 0;
+    s32 edge_count = 0;
+    if (is_progressive)
+    {
+        uniform.sample_index = accumulated_samples++;
+        uberTime = runKernel("progressive", progressive, game_state->accumulation, hdr);
+    }
+    else
+    {
+        // Primary rays are traced once, every view below shades the G-buffer
+        geometryTime = runKernel("geometry", geometry, gbuffer);
+
+        switch (active_kernel_type) {
+            case 1: uberTime = runKernel("normals", normals, gbuffer, hdr); break;
+            case 2: uberTime = runKernel("steps", steps, gbuffer, hdr); break;
+            default:
+            {
+                // The slowly varying lighting terms at a lower resolution, then
+                // shading at full resolution.
+                const s32 lighting_width = (render_width + lighting_scale - 1) / lighting_scale;
+                const s32 lighting_height = (render_height + lighting_scale - 1) / lighting_scale;
+                v4* lighting = frame_cache->lighting;
+
+                if (lighting_scale > 1)
+                    uberTime += runKernelTiles("lowResLighting", lighting_width, lighting_height, VRS_TILE_SIZE / lighting_scale, lowResLighting, gbuffer, lighting);
+                uberTime += runKernel("uber", uber, gbuffer, lighting, probe_cache->probes, rates, hdr);
+                if (vrs_enabled)
+                    uberTime += runKernel("vrsFill", vrsFill, gbuffer, lighting, probe_cache->probes, rates, hdr);
+
+                // Supersample only the pixels on an edge, gathered into a list so
+                // the work is spread evenly over the tasks
+                if (aa_samples > 1)
+                {
+                    u8* edge_mask = push_array(&frame_arena, render_width * render_height, u8);
+                    aaTime += runKernel("edgeDetect", edgeDetect, gbuffer, edge_mask);
+
+                    const s32 list_capacity = (render_width * render_height + EDGE_LIST_WIDTH - 1) / EDGE_LIST_WIDTH * EDGE_LIST_WIDTH;
+                    s32* edges = push_array(&frame_arena, list_capacity, s32);
+                    foreach(i, dirty_count)
+                    {
+                        const s32 x0 = dirty_tiles[i].x * VRS_TILE_SIZE;
+                        const s32 y0 = dirty_tiles[i].y * VRS_TILE_SIZE;
+                        const s32 x1 = x0 + VRS_TILE_SIZE < render_width ? x0 + VRS_TILE_SIZE : render_width;
+                        const s32 y1 = y0 + VRS_TILE_SIZE < render_height ? y0 + VRS_TILE_SIZE : render_height;
+                        for (s32 y = y0; y < y1; ++y)
+                        for (s32 x = x0; x < x1; ++x)
+                        {
+                            if (edge_mask[y * render_width + x]) edges[edge_count++] = y * render_width + x;
+                        }
+                    }
+
+                    const s32 edge_rows = (edge_count + EDGE_LIST_WIDTH - 1) / EDGE_LIST_WIDTH;
+                    for (s32 i = edge_count; i < edge_rows * EDGE_LIST_WIDTH; ++i) edges[i] = -1;
+                    if (edge_count > 0)
+                        aaTime += runKernelOver("edgeSupersample", EDGE_LIST_WIDTH, edge_rows, edgeSupersample, probe_cache->probes, edges, hdr);
+                }
+
+                if (vrs_enabled)
+                    uberTime += runKernelTiles("shadingRates", rate_tiles_x, rate_tiles_y, 1, shadingRates, gbuffer, hdr, rates);
+            } break;
+        }
+    }
+    frame_cache->valid = !is_progressive;
+
+    // Accumulate the jittered frames and reconstruct them at the output resolution.
+    // Debug views are only reconstructed, and start the history over.
+    v4* resolved = hdr;
+    f64 taaTime = 0;
+    b32 taa_history_valid = game_state->taa_history_valid;
+    if (use_taa)
+    {
+        v4* history = game_state->taa_history[taa_frame & 1];
+        resolved = game_state->taa_history[(taa_frame + 1) & 1];
+        const u32 accumulate = taa_history_valid && !is_debug_view;
+        taaTime = runKernelOver("taaResolve", width, height, taaResolve, gbuffer, hdr, history, accumulate, resolved);
+        taa_history_valid = !is_debug_view;
     }
-    const auto uberTime = runKernel(active_kernel, uniform, light_info, materials, edit_info, pixels);
-    if (active_kernel_type == 3) runKernel(tiles, uniform, light_info, materials, edit_info, pixels);
+    else
+    {
+        taa_history_valid = false;
+    }
+
+    const auto postTime = runKernelOver("post", width, height, post, resolved, (u32)!is_debug_view, pixels);
+    if (active_kernel_type == 3) runKernelOver("tiles", width, height, tiles, pixels);
+
+    Work_Frame* work = &game_state->work;
+    merge_work(work);
 
     //
     // Draw Text
     //
     if (debug_mode)
     {
-        s32 xp = 5;
-        s32 yp = 5;
+        Overlay* overlay = begin_overlay(&frame_arena, 5, 5);
+        overlay_line(overlay, pack_color(255,179,186), "%ds %dfps", (s32)time, (s32)fps);
+        overlay_line(overlay, pack_color(186,255,201), "%dx%d %0.1fms %0.1fms", width, height, deltaTime * 1e3, (f64)(swap_buffer_time / 1e6));
+        overlay_line(overlay, pack_color(186,225,255), "%dE %dM %dL", constants->edit_info.count, constants->material_count, light_info.count);
+        overlay_line(overlay, pack_color(255,225,255), "geometryTime: %.1fms", geometryTime*1e3);
+        overlay_line(overlay, pack_color(255,225,255), "uberTime: %.1fms", uberTime*1e3);
+        overlay_line(overlay, pack_color(255,225,255), "postTime: %.1fms", postTime*1e3);
+        overlay_line(overlay, pack_color(255,225,255), "lighting: 1/%d", lighting_scale);
+        overlay_line(overlay, pack_color(255,225,255), "dirty tiles: %d/%d", dirty_count, rate_tiles_x * rate_tiles_y);
+        if (use_taa) overlay_line(overlay, pack_color(255,225,255), "taa: %dx%d %.1fms", (s32)render_width, (s32)render_height, taaTime*1e3);
+        if (vrs_enabled)
         {
-            u8* text = strf("%ds %dfps", (s32)time, (s32)fps);
-            draw_text(pixels, width, height, text, xp, yp, 255,179,186);
-            free(text);
-        }
-        yp += 14 + 5;
-        {
-            u8* text = strf("%dx%d %0.1fms %0.1fms", width, height, deltaTime * 1e3, (f64)(swap_buffer_time / 1e6));
-            draw_text(pixels, width, height, text, xp, yp, 186,255,201);
-            free(text);
-        }
-        yp += 14 + 5;
-        {
-            u8* text = strf("%dE %dM %dL", edit_info.count, materialCount, light_info.count);
-            draw_text(pixels, width, height, text, xp, yp, 186,225,255);
-            free(text);
-        }
-        yp += 14 + 5;
-        {
-            u8* text = strf("clearTime: %.1fms", clearTime *1e3);
-            draw_text(pixels, width, height, text, xp, yp, 186,225,255);
-            free(text);
+            s32 rate_counts[5] = {};
+            foreach(i, rate_tiles_x * rate_tiles_y) rate_counts[rates[i]]++;
+
+            overlay_line(overlay, pack_color(255,225,255), "vrs tiles: %d %d %d", rate_counts[1], rate_counts[2], rate_counts[4]);
         }
-        yp += 14 + 5;
+        if (aa_samples > 1) overlay_line(overlay, pack_color(255,225,255), "aa: %dx %dpx %.1fms", aa_samples, edge_count, aaTime*1e3);
+        if (probes_enabled) overlay_line(overlay, pack_color(255,225,255), "probes: %d %.1fms", probe_cache->valid_count, probeTime*1e3);
+        if (progressive_mode) overlay_line(overlay, pack_color(255,225,255), "progressive: %dspp", accumulated_samples);
+#if WORK_COUNTERS
         {
-            u8* text = strf("uberTime: %.1fms", uberTime*1e3);
-            draw_text(pixels, width, height, text, xp, yp, 255,225,255);
-            free(text);
+            const u64* counts = work->total.counts;
+            overlay_line(overlay, pack_color(255,225,255), "map: %.2fM %.1fMe %.2fMs", counts[WORK_MAP_CALLS] / 1e6, counts[WORK_EDITS] / 1e6, counts[WORK_MARCH_STEPS] / 1e6);
+            overlay_line(overlay, pack_color(255,225,255), "rays: %.2fM %.2fMs %.2fMao %.2fMr", counts[WORK_PRIMARY_RAYS] / 1e6, counts[WORK_SHADOW_RAYS] / 1e6, counts[WORK_AO_RAYS] / 1e6, counts[WORK_SECONDARY_RAYS] / 1e6);
         }
+#endif
+        overlay_graph(overlay, &game_state->frame_graph, 5, height - 5);
+        runKernelOver("overlay", width, height, drawOverlay, overlay, pixels);
     }
 
     // switch (get_compile_state()) {
@@ -437,10 +827,20 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
 
 
     // vsync(60, frame_start_time, swap_buffer_time);
+    TRACE_BEGIN("present");
     swap_buffers(bitmap);
+    TRACE_END();
+    TRACE_END(); // frame
+
+    // Written once the frame's tasks are done, so no worker is recording
+    if (dump_trace && write_trace(TRACE_FILE_PATH)) printf("wrote %s\n", TRACE_FILE_PATH);
+    if (capture_work && write_work(WORK_FILE_PREFIX, work, work_pixels, render_width, render_height)) printf("wrote %s_*.csv\n", WORK_FILE_PREFIX);
 
     deltaTime = (get_time() - frame_start_time) / 1e9;
 
+    const f64 kernel_times[GRAPH_SERIES_COUNT] = { geometryTime, uberTime, aaTime, probeTime, taaTime + postTime };
+    record_frame(&game_state->frame_graph, deltaTime, kernel_times);
+
     //
     // Update game state
     //
@@ -449,12 +849,25 @@ extern "C" b32 game_update_and_render(Game_Memory *memory)
     game_state->start_time       = start_time;
     game_state->swap_buffer_time = swap_buffer_time;
     game_state->time             = time;
+    game_state->paused_time      = paused_time;
     game_state->fps              = fps;
     game_state->deltaTime        = deltaTime;
     game_state->threadCount      = threadCount;
     game_state->insert_mode      = insert_mode;
     game_state->debug_mode       = debug_mode;
     game_state->active_kernel_type = active_kernel_type;
+    game_state->progressive_mode = progressive_mode;
+    game_state->lighting_scale   = lighting_scale;
+    game_state->probes_enabled   = probes_enabled;
+    game_state->aa_samples       = aa_samples;
+    game_state->vrs_enabled      = vrs_enabled;
+    game_state->taa_enabled      = taa_enabled;
+    game_state->render_scale     = render_scale;
+    game_state->taa_history_valid = taa_history_valid;
+    game_state->taa_frame        = taa_frame + 1;
+    constants->previous = uniform;
+    game_state->accumulated_samples = accumulated_samples;
+    game_state->scene_hash       = scene_hash;
     game_state->camera           = *camera;
     game_state->bitmap           = *bitmap;
 
@@ -41,6 +41,19 @@ struct Bitmap
     s32 pitch;
 };
 
+// Jobs run on worker threads the platform owns, so they keep running while the
+// game code is reloaded. A group counts the jobs submitted to it that have not
+// finished, the platform only touches it while holding its own lock. Every job is
+// told which worker runs it, so the game keeps per thread state in arrays indexed
+// by worker rather than in thread locals, which would pin the dylib in memory.
+#define MAX_JOB_WORKERS 63 // numbered from 1, 0 is the thread running the frame
+typedef void Job_Proc(void* data, s32 index, s32 worker);
+
+struct Job_Group
+{
+    s32 pending;
+};
+
 struct Game_Memory
 {
     b32 is_initialized;
@@ -57,6 +70,10 @@ struct Game_Memory
     void (*swap_buffers)(Bitmap* buffer);
     u64 (*get_time)();
     Compile_State (*get_compile_state)();
+
+    void (*submit_job)(Job_Group* group, Job_Proc* proc, void* data);              // runs proc(data, 0, worker)
+    void (*parallel_for)(Job_Group* group, s32 count, Job_Proc* proc, void* data); // runs proc(data, i, worker) for i in [0, count)
+    void (*wait_jobs)(Job_Group* group);                                           // returns once the group's jobs have run
 };
 
 
@@ -65,6 +82,9 @@ struct Game_Memory
 // void set_cursor_visibility(b32 is_visible);
 // void swap_buffers(Bitmap* buffer);
 // u64 get_time();
+// void submit_job(Job_Group* group, Job_Proc* proc, void* data);
+// void parallel_for(Job_Group* group, s32 count, Job_Proc* proc, void* data);
+// void wait_jobs(Job_Group* group);
 // b32 game_update_and_render(Game_Memory *memory);
 
 #endif
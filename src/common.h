@@ -35,6 +35,7 @@
 
 #define foreach(i, c) for (s64 (i) = 0; (i) < (c); ++(i))
 #define foreach_reverse(i, c) for (s64 (i) = c-1; (i) >= 0; --(i))
+#define array_count(a) ((s32)(sizeof(a) / sizeof((a)[0])))
 
 #define internal static
 #define global_variable static
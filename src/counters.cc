@@ -0,0 +1,301 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Counts of the work the kernels do: map() calls, edits evaluated, march steps and
+// rays by kind. Each worker adds to its own counts for the kernel it is running,
+// and merge_work sums them once a frame. On a frame that captures them, map()
+// calls, steps and rays are also added up per pixel. The kernels reach their
+// worker's counts through the Scene they trace. Building with WORK_COUNTERS 0
+// removes all of it, which is the default outside DEV builds.
+#ifndef WORK_COUNTERS
+#define WORK_COUNTERS DEV
+#endif
+
+#define WORK_FILE_PREFIX "work" // work_kernels.csv, work_tiles.csv and work_histogram.csv, written with F8
+
+enum Work_Counter : u32
+{
+    WORK_MAP_CALLS,
+    WORK_EDITS,          // edits run by map(), and the primitives of each batch
+    WORK_MARCH_STEPS,
+    WORK_PRIMARY_RAYS,
+    WORK_SHADOW_RAYS,
+    WORK_AO_RAYS,        // one per ambientOcclusion call, however many samples it takes
+    WORK_SECONDARY_RAYS, // reflection, refraction and probe rays
+    WORK_COUNTER_COUNT,
+};
+
+global_variable const char* work_counter_names[WORK_COUNTER_COUNT] =
+{
+    "map_calls", "edits", "march_steps", "primary_rays", "shadow_rays", "ao_rays", "secondary_rays",
+};
+
+struct Work_Counts
+{
+    u64 counts[WORK_COUNTER_COUNT];
+};
+
+// The work of one pixel, rays of all kinds together
+struct Pixel_Work
+{
+    u32 map_calls;
+    u32 march_steps;
+    u32 rays;
+};
+
+#define MAX_WORK_KERNELS 32
+
+struct Kernel_Work
+{
+    const char* name; // a string literal, the name the kernel was dispatched with
+    Work_Counts work;
+};
+
+// One frame's work, merged from every thread
+struct Work_Frame
+{
+    Kernel_Work kernels[MAX_WORK_KERNELS];
+    s32 kernel_count;
+    Work_Counts total;
+};
+
+internal Work_Counts* find_kernel_work(Kernel_Work* kernels, s32* kernel_count, const char* name)
+{
+    foreach(i, *kernel_count)
+    {
+        if (kernels[i].name == name || strcmp(kernels[i].name, name) == 0) return &kernels[i].work;
+    }
+    if (*kernel_count == MAX_WORK_KERNELS) return NULL;
+
+    Kernel_Work* kernel = &kernels[(*kernel_count)++];
+    kernel->name = name;
+    memset(&kernel->work, 0, sizeof(kernel->work));
+    return &kernel->work;
+}
+
+#if WORK_COUNTERS
+
+#include <errno.h>
+#include <stdio.h>
+
+// Only the owning worker adds to its counts. merge_work reads and clears them
+// between frames, once the tasks that wrote them have been waited on.
+struct Worker_Work
+{
+    Kernel_Work kernels[MAX_WORK_KERNELS];
+    s32 kernel_count;
+    Work_Counts* counts; // the running kernel's, null outside of a scope
+    Pixel_Work* pixel;   // the pixel being worked on, null if not captured
+};
+
+// Indexed by worker, see Job_Proc
+global_variable Worker_Work worker_work[MAX_JOB_WORKERS + 1];
+
+// Set by the frame thread before dispatching, null on frames that don't capture pixels
+global_variable Pixel_Work* work_pixels;
+global_variable s32 work_pixels_width;
+
+internal inline void count_work(Worker_Work* work, Work_Counter counter, u32 n)
+{
+    if (!work || !work->counts) return;
+    work->counts->counts[counter] += n;
+
+    if (!work->pixel) return;
+    switch (counter)
+    {
+        case WORK_MAP_CALLS:   work->pixel->map_calls += n;   break;
+        case WORK_MARCH_STEPS: work->pixel->march_steps += n; break;
+        case WORK_EDITS:                                       break;
+        default:               work->pixel->rays += n;        break;
+    }
+}
+
+// Work counted from here on is the pixel's, until the next pixel or the end of the task
+internal inline void count_pixel(Worker_Work* work, s32 x, s32 y)
+{
+    if (work) work->pixel = work_pixels ? &work_pixels[y * work_pixels_width + x] : NULL;
+}
+
+// The counts of the worker a job was given, passed to the kernels it runs
+internal Worker_Work* get_worker_work(s32 worker)
+{
+    return &worker_work[worker];
+}
+
+// Counts the work done by a task under its kernel's name
+struct Work_Scope
+{
+    Worker_Work* work;
+    Work_Counts* previous;
+    Work_Scope(s32 worker, const char* name)
+    {
+        work = &worker_work[worker];
+        previous = work->counts;
+        work->counts = find_kernel_work(work->kernels, &work->kernel_count, name);
+        work->pixel = NULL;
+    }
+    ~Work_Scope()
+    {
+        work->counts = previous;
+        work->pixel = NULL;
+    }
+};
+
+#define COUNT_WORK(work, counter, n) count_work(work, counter, n)
+#define COUNT_PIXEL(work, x, y) count_pixel(work, x, y)
+#define WORK_CONCAT_(a, b) a##b
+#define WORK_CONCAT(a, b) WORK_CONCAT_(a, b)
+#define WORK_SCOPE(worker, name) Work_Scope WORK_CONCAT(work_scope_, __LINE__)(worker, name)
+
+// Starts counting a frame. With 'pixels' the work is also added up per pixel of a
+// viewport 'width' wide, the caller clears them.
+internal void begin_work_frame(Pixel_Work* pixels, s32 width)
+{
+    work_pixels = pixels;
+    work_pixels_width = width;
+}
+
+// Sums the counts of every thread into 'frame' and clears them for the next one.
+// Call it once the frame's tasks are done.
+internal void merge_work(Work_Frame* frame)
+{
+    memset(frame, 0, sizeof(*frame));
+    foreach(worker, MAX_JOB_WORKERS + 1)
+    {
+        Worker_Work* counts = &worker_work[worker];
+        foreach(k, counts->kernel_count)
+        {
+            Kernel_Work* kernel = &counts->kernels[k];
+            Work_Counts* merged = find_kernel_work(frame->kernels, &frame->kernel_count, kernel->name);
+            foreach(c, WORK_COUNTER_COUNT)
+            {
+                if (merged) merged->counts[c] += kernel->work.counts[c];
+                frame->total.counts[c] += kernel->work.counts[c];
+            }
+            memset(&kernel->work, 0, sizeof(kernel->work));
+        }
+    }
+    work_pixels = NULL;
+}
+
+internal FILE* open_work_file(const char* prefix, const char* kind)
+{
+    u8* path = strf("%s_%s.csv", prefix, kind);
+    FILE* file = fopen((const char*)path, "w");
+    if (!file) printf("could not write '%s': %d %s\n", path, errno, strerror(errno));
+    free(path);
+    return file;
+}
+
+internal b32 close_work_file(FILE* file)
+{
+    if (fclose(file) == 0) return true;
+    printf("could not write work counters: %d %s\n", errno, strerror(errno));
+    return false;
+}
+
+// Writes the frame's work per kernel, per VRS tile and as a histogram of map()
+// calls per pixel, with power of two buckets. The tiles and the histogram need the
+// pixels the frame captured and are left out without them.
+internal b32 write_work(const char* prefix, Work_Frame* frame, Pixel_Work* pixels, s32 width, s32 height)
+{
+    FILE* file = open_work_file(prefix, "kernels");
+    if (!file) return false;
+
+    fprintf(file, "kernel");
+    foreach(c, WORK_COUNTER_COUNT) fprintf(file, ",%s", work_counter_names[c]);
+    fprintf(file, "\n");
+    foreach(k, frame->kernel_count)
+    {
+        fprintf(file, "%s", frame->kernels[k].name);
+        foreach(c, WORK_COUNTER_COUNT) fprintf(file, ",%llu", (unsigned long long)frame->kernels[k].work.counts[c]);
+        fprintf(file, "\n");
+    }
+    fprintf(file, "total");
+    foreach(c, WORK_COUNTER_COUNT) fprintf(file, ",%llu", (unsigned long long)frame->total.counts[c]);
+    fprintf(file, "\n");
+    if (!close_work_file(file)) return false;
+
+    if (!pixels) return true;
+
+    file = open_work_file(prefix, "tiles");
+    if (!file) return false;
+
+    u64 histogram[33] = {};
+    fprintf(file, "tile_x,tile_y,map_calls,march_steps,rays\n");
+    const s32 tiles_x = (width + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    const s32 tiles_y = (height + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    foreach(ty, tiles_y)
+    foreach(tx, tiles_x)
+    {
+        u64 map_calls = 0, march_steps = 0, rays = 0;
+        const s32 x0 = tx * VRS_TILE_SIZE;
+        const s32 y0 = ty * VRS_TILE_SIZE;
+        const s32 x1 = x0 + VRS_TILE_SIZE < width ? x0 + VRS_TILE_SIZE : width;
+        const s32 y1 = y0 + VRS_TILE_SIZE < height ? y0 + VRS_TILE_SIZE : height;
+        for (s32 y = y0; y < y1; ++y)
+        for (s32 x = x0; x < x1; ++x)
+        {
+            const Pixel_Work pixel = pixels[y * width + x];
+            map_calls += pixel.map_calls;
+            march_steps += pixel.march_steps;
+            rays += pixel.rays;
+
+            // Bucket b holds [2^(b-1), 2^b), bucket 0 the pixels without any calls
+            s32 bucket = 0;
+            while (bucket < 32 && (pixel.map_calls >> bucket) != 0) bucket++;
+            histogram[bucket]++;
+        }
+        fprintf(file, "%d,%d,%llu,%llu,%llu\n", (s32)tx, (s32)ty, (unsigned long long)map_calls, (unsigned long long)march_steps, (unsigned long long)rays);
+    }
+    if (!close_work_file(file)) return false;
+
+    file = open_work_file(prefix, "histogram");
+    if (!file) return false;
+
+    fprintf(file, "map_calls_min,map_calls_max,pixels\n");
+    foreach(b, 33)
+    {
+        if (!histogram[b]) continue;
+        const u64 low = b == 0 ? 0 : 1ull << (b - 1);
+        const u64 high = b == 0 ? 0 : (1ull << b) - 1;
+        fprintf(file, "%llu,%llu,%llu\n", (unsigned long long)low, (unsigned long long)high, (unsigned long long)histogram[b]);
+    }
+    return close_work_file(file);
+}
+
+#else
+
+#define COUNT_WORK(work, counter, n)
+#define COUNT_PIXEL(work, x, y)
+#define WORK_SCOPE(worker, name)
+
+internal Worker_Work* get_worker_work(s32 worker) { return NULL; }
+
+internal void begin_work_frame(Pixel_Work* pixels, s32 width) {}
+internal void merge_work(Work_Frame* frame) { memset(frame, 0, sizeof(*frame)); }
+
+internal b32 write_work(const char* prefix, Work_Frame* frame, Pixel_Work* pixels, s32 width, s32 height)
+{
+    printf("built without work counters, not writing '%s'\n", prefix);
+    return false;
+}
+
+#endif
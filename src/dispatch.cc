@@ -18,72 +18,32 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 // DEALINGS IN THE SOFTWARE.
 
-#include <cassert> // assert
-#include <condition_variable> // condition_variable
-#include <functional> // std::function<void()>
-#include <future> // std::future
-#include <mutex> // mutex
-#include <queue> // std::queue
-#include <thread> // thread
-#include <vector> // vector
+#include <type_traits> // std::remove_reference_t
 
-struct Dispatch
-{
-    s32 num_workers;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    std::condition_variable completed;
-    bool stop { false };
-    std::queue<std::function<void()>> tasks;
-    std::vector<std::thread> workers;
-    s32 size() { return num_workers; }
-    bool stopped() { return stop; }
-    Dispatch(s32 num_workers = std::thread::hardware_concurrency())
-    {
-        assert(num_workers != 0 && "0 workers doesn't make sense.");
-        workers.resize(num_workers);
-        this->num_workers = num_workers;
-        for (auto&& worker : workers) {
-            worker = std::thread([this] {
-                while (true) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(queue_mutex);
-                        condition.wait(lock, [this] { return stop || !tasks.empty(); });
-                        if (stop && tasks.empty())
-                            return;
-                        task = std::move(tasks.front());
-                        tasks.pop();
-                    }
-                    task();
-                }
-            });
-        }
-    }
-    ~Dispatch()
-    {
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            stop = true;
-        }
-        condition.notify_all();
-        for (auto&& worker : workers)
-            worker.join();
-    }
+// Game side of the platform's job system, see jobs.cc. Set from Game_Memory every
+// frame like the other platform functions, since a reload resets them.
+global_variable void (*submit_job)(Job_Group* group, Job_Proc* proc, void* data);
+global_variable void (*parallel_for)(Job_Group* group, s32 count, Job_Proc* proc, void* data);
+global_variable void (*wait_jobs)(Job_Group* group);
 
-    template <class F, class... Args>
-    auto async(F&& f, Args&&... args) -> std::future<std::result_of_t<F(Args...)>>
+// Runs f(i, worker) for every i in [0, count) on the workers and returns once all
+// have run. Each shows up in the trace and work counters as 'name'.
+template <class F>
+internal void dispatch_for(const char* name, s32 count, F&& f)
+{
+    struct Closure
     {
-        using return_type = std::result_of_t<F(Args...)>;
-        auto task = std::make_shared<std::packaged_task<return_type()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-        auto result = task->get_future();
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            tasks.emplace([task]() { (*task)(); });
-        }
-        condition.notify_one();
-        return result;
-    }
-};
+        const char* name;
+        std::remove_reference_t<F>* f;
+    };
+    Closure closure = { name, &f };
 
-static Dispatch dispatch;
+    Job_Group group = {};
+    parallel_for(&group, count, [](void* data, s32 index, s32 worker) {
+        Closure* closure = (Closure*)data;
+        TRACE_WORKER_SCOPE(worker, closure->name);
+        WORK_SCOPE(worker, closure->name);
+        (*closure->f)(index, worker);
+    }, &closure);
+    wait_jobs(&group);
+}
@@ -48,20 +48,66 @@ return (("0@P01248@00120000P49B0000000000000:DXlW2UoDX@10008@h;IR4n@R<Y?48000PYD
 "24`@P01R30000000S9S10000000"[i / 6] - '0') >> (i % 6)) & 1;
 }
 
-internal void draw_text(u32* pixels, u32 width, u32 height, u8* text, u32 xp, u32 yp, u8 R, u8 G, u8 B)
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 14
+
+// Every glyph decoded once, a byte per row with bit x set for pixel x. Indexed by
+// the character, the ones without a glyph are blank.
+global_variable u8 glyph_atlas[256][GLYPH_HEIGHT];
+global_variable b32 glyph_atlas_built;
+
+internal void build_glyph_atlas()
 {
-    u8 len = strlen((const char*)text);
-    foreach(i, len)
+    foreach(c, 256)
+    foreach(y, GLYPH_HEIGHT)
     {
-        foreach(y, 14)
-        foreach(x, 8)
+        u8 bits = 0;
+        foreach(x, GLYPH_WIDTH) bits |= glyph_pixel(c, x, y) << x;
+        glyph_atlas[c][y] = bits;
+    }
+    glyph_atlas_built = true;
+}
+
+// Sets the pixels of a glyph row whose bit is set. The row is one simd_uint8, and
+// each lane picks between its pixel and the color by its bit.
+internal inline void blit_glyph_row(u32* row, u32 bits, u32 color)
+{
+    static_assert(GLYPH_WIDTH == 8, "a glyph row is one simd_uint8");
+    const simd_uint8 lane_bits = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    const simd_uint8 colors = { color, color, color, color, color, color, color, color };
+    const simd_int8 mask = (bits & lane_bits) != 0;
+
+    simd_packed_uint8* pixels = (simd_packed_uint8*)row;
+    *pixels = simd_bitselect(*pixels, colors, mask);
+}
+
+// Draws the part of a line of text that falls within [from, to), so a line that
+// crosses tiles is drawn by the job of each one.
+internal void draw_text(u32* pixels, u32 pitch, const u8* text, s32 length, s32 xp, s32 yp, u32 color, ushort2 from, ushort2 to)
+{
+    const s32 y0 = yp > from.y ? yp : from.y;
+    const s32 y1 = yp + GLYPH_HEIGHT < to.y ? yp + GLYPH_HEIGHT : to.y;
+    const s32 first = from.x > xp ? (from.x - xp) / GLYPH_WIDTH : 0;
+    const s32 last = to.x > xp ? (to.x - xp + GLYPH_WIDTH - 1) / GLYPH_WIDTH : 0;
+    const s32 end = last < length ? last : length;
+
+    for (s32 y = y0; y < y1; ++y)
+    {
+        u32* row = pixels + y * pitch;
+        for (s32 i = first; i < end; ++i)
         {
-            const u8 Y = glyph_pixel(text[i], x,y);
-            if (!Y) continue;
-            const u8 A = 255;
-            const u32 index = (y+yp) * width + (x+xp);
-            pixels[index] = ((R << 0) | (G << 8) | (B << 16) | (A << 24));
+            const s32 gx = xp + i * GLYPH_WIDTH;
+            const u32 bits = glyph_atlas[text[i]][y - yp];
+            if (gx >= from.x && gx + GLYPH_WIDTH <= to.x)
+            {
+                blit_glyph_row(row + gx, bits, color);
+                continue;
+            }
+
+            // Cut by the tile, the pixels outside it belong to another job
+            const s32 x0 = from.x > gx ? from.x - gx : 0;
+            const s32 x1 = to.x < gx + GLYPH_WIDTH ? to.x - gx : GLYPH_WIDTH;
+            for (s32 x = x0; x < x1; ++x) if (bits & (1u << x)) row[gx + x] = color;
         }
-        xp += 8;
     }
 }
@@ -0,0 +1,190 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// The previous frame's G-buffer, lighting and HDR color, kept so a still camera
+// only re-renders the screen tiles something changed in. Changes are found in
+// world space: edits that moved, including the shadows they cast, lights that
+// moved or changed, and probes that were traced again. Their bounds are projected
+// to VRS sized tiles. Anything that changes the whole image, like the camera,
+// materials or render settings, makes every tile dirty.
+struct Frame_Cache
+{
+    G_Buffer_Texel* gbuffer;
+    v4* lighting;
+    v4* hdr;
+    u8* dirty; // per VRS tile
+
+    b32 valid;
+    u64 view_hash;
+    Light_Info lights;
+};
+
+internal void init_frame_cache(Frame_Cache* cache, Bitmap* bitmap)
+{
+    if (cache->gbuffer)
+    {
+        free(cache->gbuffer);
+        free(cache->lighting);
+        free(cache->hdr);
+        free(cache->dirty);
+    }
+    const s32 pixel_count = bitmap->width * bitmap->height;
+    const s32 tiles_x = (bitmap->width + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    const s32 tiles_y = (bitmap->height + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    cache->gbuffer = (G_Buffer_Texel*)malloc(pixel_count * sizeof(G_Buffer_Texel));
+    cache->lighting = (v4*)malloc(pixel_count * sizeof(v4));
+    cache->hdr = (v4*)malloc(pixel_count * sizeof(v4));
+    cache->dirty = (u8*)malloc(tiles_x * tiles_y);
+    cache->valid = false;
+}
+
+// Everything besides edits and lights that the rendered image depends on.
+internal u64 hash_view(Uniform* uniform, u32 materials_version, u64 settings_hash)
+{
+    u64 hash = settings_hash;
+    hash = hash_v3(hash, uniform->camera_position);
+    hash = hash_v3(hash, uniform->camera_target);
+    hash = hash_f32(hash, uniform->camera_zoom);
+    hash = hash_bytes(hash, &uniform->viewport_size, sizeof(uniform->viewport_size));
+    hash = hash_f32(hash, uniform->jitter.x);
+    hash = hash_f32(hash, uniform->jitter.y);
+    return hash_bytes(hash, &materials_version, sizeof(materials_version));
+}
+
+internal Bounds light_bounds(Light light)
+{
+    const v3 r = v3(light.radius, light.radius, light.radius);
+    return (Bounds) { light.pos - r, light.pos + r, false };
+}
+
+internal void mark_all_tiles(u8* dirty, s32 tiles_x, s32 tiles_y)
+{
+    memset(dirty, 1, tiles_x * tiles_y);
+}
+
+// Marks the tiles a world space box covers on screen, and a ring of one tile
+// around them for the passes that filter across tile borders.
+internal void mark_bounds(u8* dirty, s32 tiles_x, s32 tiles_y, Uniform* uniform, Bounds bounds)
+{
+    if (bounds_is_empty(bounds)) return;
+    if (bounds.is_unbounded)
+    {
+        mark_all_tiles(dirty, tiles_x, tiles_y);
+        return;
+    }
+
+    const v2 res = v2(uniform->viewport_size.x, uniform->viewport_size.y);
+    v2 lo = v2(FLT_MAX, FLT_MAX);
+    v2 hi = v2(-FLT_MAX, -FLT_MAX);
+    foreach(i, 8)
+    {
+        const v3 q = projectToPixel(*uniform, bounds_corner(bounds, i), res);
+        if (q.z <= CLUSTER_NEAR)
+        {
+            // Reaches behind the camera, where the projection folds over
+            mark_all_tiles(dirty, tiles_x, tiles_y);
+            return;
+        }
+        lo = min(lo, v2(q.x, q.y));
+        hi = max(hi, v2(q.x, q.y));
+    }
+    if (hi.x < 0.0 || hi.y < 0.0 || lo.x >= res.x || lo.y >= res.y) return;
+
+    const s32 x0 = clamp(floor(lo.x / VRS_TILE_SIZE) - 1.0f, 0.0f, tiles_x - 1.0f);
+    const s32 y0 = clamp(floor(lo.y / VRS_TILE_SIZE) - 1.0f, 0.0f, tiles_y - 1.0f);
+    const s32 x1 = clamp(floor(hi.x / VRS_TILE_SIZE) + 1.0f, 0.0f, tiles_x - 1.0f);
+    const s32 y1 = clamp(floor(hi.y / VRS_TILE_SIZE) + 1.0f, 0.0f, tiles_y - 1.0f);
+    for (s32 y = y0; y <= y1; ++y)
+    for (s32 x = x0; x <= x1; ++x)
+    {
+        dirty[y * tiles_x + x] = 1;
+    }
+}
+
+// Finds the tiles that have to be rendered again this frame and returns them in
+// 'tiles'. 'scene_changes' comes from diff_scene and 'probe_changes' covers the
+// probes traced this frame. Returns the number of dirty tiles.
+internal s32 find_dirty_tiles(Frame_Cache* cache, Frame_Constants* constants, u64 view_hash, Bounds scene_changes, Bounds probe_changes, ushort2* tiles, s32 task_count)
+{
+    Uniform* uniform = &constants->uniform;
+    Light_Info* light_info = &constants->light_info;
+
+    const s32 tiles_x = (uniform->viewport_size.x + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    const s32 tiles_y = (uniform->viewport_size.y + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    u8* dirty = cache->dirty;
+    memset(dirty, 0, tiles_x * tiles_y);
+
+    if (!cache->valid || view_hash != cache->view_hash || light_info->count != cache->lights.count)
+    {
+        mark_all_tiles(dirty, tiles_x, tiles_y);
+    }
+    else
+    {
+        b32 changed = false;
+
+        // Lights that changed light everything in their reach differently
+        foreach(i, light_info->count)
+        {
+            const Light light = light_info->lights[i];
+            const Light old = cache->lights.lights[i];
+            if (v3_equal(light.pos, old.pos) && v3_equal(light.color, old.color) && light.intensity == old.intensity) continue;
+            mark_bounds(dirty, tiles_x, tiles_y, uniform, bounds_union(light_bounds(light), light_bounds(old)));
+            changed = true;
+        }
+
+        // Edits change what is around them, AO only reaches a little way. The
+        // probes they affect are in probe_changes.
+        if (!bounds_is_empty(scene_changes))
+        {
+            mark_bounds(dirty, tiles_x, tiles_y, uniform, bounds_expand(scene_changes, 0.5));
+            changed = true;
+        }
+
+        if (!bounds_is_empty(probe_changes))
+        {
+            mark_bounds(dirty, tiles_x, tiles_y, uniform, probe_changes);
+            changed = true;
+        }
+
+        // Then the shadows the edits cast and the glass that sees them, tested
+        // against last frame's surfaces since the camera stayed put
+        if (changed)
+        {
+            const s32 rows = (tiles_y + task_count - 1) / task_count;
+
+            dispatch_for("changedTiles", task_count, [&](s32 i, s32 worker) {
+                const s32 y0 = i * rows;
+                const s32 y1 = y0 + rows < tiles_y ? y0 + rows : tiles_y;
+                if (y0 < y1) changedTiles(*constants, scene_changes, cache->gbuffer, dirty, ushort2(0, y0), ushort2(tiles_x, y1), get_worker_work(worker));
+            });
+        }
+    }
+
+    s32 count = 0;
+    foreach(y, tiles_y)
+    foreach(x, tiles_x)
+    {
+        if (dirty[y * tiles_x + x]) tiles[count++] = ushort2(x, y);
+    }
+
+    cache->view_hash = view_hash;
+    cache->lights = *light_info;
+    return count;
+}
@@ -0,0 +1,131 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Worker threads for the game, part of the platform layer. The game reaches them
+// through the job functions in Game_Memory, so reloading the game code leaves them
+// running. The game waits on every group it submits before returning from a frame,
+// so no job points into the old code once it is unloaded. The functions are
+// prefixed since the bench includes them in the same file as the game.
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Job
+{
+    Job_Group* group;
+    Job_Proc* proc;
+    void* data;
+    s32 index;
+};
+
+internal void stop_job_pool();
+
+struct Job_Pool
+{
+    std::mutex mutex;
+    std::condition_variable work;     // workers wait here for jobs
+    std::condition_variable finished; // wait_jobs waits here for its group
+    std::deque<Job> queue;
+    std::vector<std::thread> workers;
+    bool stop;
+
+    // The pool is a global, so the workers are joined on exit
+    ~Job_Pool() { stop_job_pool(); }
+};
+
+global_variable Job_Pool job_pool;
+
+internal void run_jobs(s32 worker)
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(job_pool.mutex);
+            job_pool.work.wait(lock, [] { return job_pool.stop || !job_pool.queue.empty(); });
+            if (job_pool.stop && job_pool.queue.empty()) return;
+            job = job_pool.queue.front();
+            job_pool.queue.pop_front();
+        }
+
+        job.proc(job.data, job.index, worker);
+
+        std::unique_lock<std::mutex> lock(job_pool.mutex);
+        if (--job.group->pending == 0) job_pool.finished.notify_all();
+    }
+}
+
+// The workers are numbered from 1 every time, so a new pool reuses the numbers
+// of the one it replaces
+internal void start_job_pool(s32 worker_count)
+{
+    if (worker_count > MAX_JOB_WORKERS) worker_count = MAX_JOB_WORKERS;
+    job_pool.stop = false;
+    job_pool.workers.resize(worker_count);
+    foreach(i, worker_count) job_pool.workers[i] = std::thread(run_jobs, (s32)i + 1);
+}
+
+// Lets the workers finish the queued jobs and joins them
+internal void stop_job_pool()
+{
+    {
+        std::unique_lock<std::mutex> lock(job_pool.mutex);
+        job_pool.stop = true;
+    }
+    job_pool.work.notify_all();
+    for (auto& worker : job_pool.workers) worker.join();
+    job_pool.workers.clear();
+}
+
+// Replaces the workers with 'worker_count' new ones, once the queued jobs are done
+internal void resize_job_pool(s32 worker_count)
+{
+    stop_job_pool();
+    start_job_pool(worker_count);
+}
+
+internal void pool_submit_job(Job_Group* group, Job_Proc* proc, void* data)
+{
+    {
+        std::unique_lock<std::mutex> lock(job_pool.mutex);
+        group->pending++;
+        job_pool.queue.push_back((Job) { group, proc, data, 0 });
+    }
+    job_pool.work.notify_one();
+}
+
+internal void pool_parallel_for(Job_Group* group, s32 count, Job_Proc* proc, void* data)
+{
+    if (count <= 0) return;
+    {
+        std::unique_lock<std::mutex> lock(job_pool.mutex);
+        group->pending += count;
+        foreach(i, count) job_pool.queue.push_back((Job) { group, proc, data, (s32)i });
+    }
+    job_pool.work.notify_all();
+}
+
+internal void pool_wait_jobs(Job_Group* group)
+{
+    std::unique_lock<std::mutex> lock(job_pool.mutex);
+    job_pool.finished.wait(lock, [group] { return group->pending == 0; });
+}
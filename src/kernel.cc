@@ -19,6 +19,33 @@
 // DEALINGS IsN THE SOFTWARE.
 #include "kernel_common.cc"
 
+// Step budget of primary rays, the steps view is relative to it.
+#define GEOMETRY_MAX_STEPS 128
+
+// Reference renders march without over-relaxation or level of detail, to a fixed
+// epsilon, with this many times the steps.
+#define REFERENCE_STEP_SCALE 4
+
+METAL_INTERNAL March rayMarch(METAL(constant) Uniform& uniform, f32 relaxation)
+{
+    if (uniform.reference) return (March) { 1.0, 0.0 };
+    return (March) { relaxation, pixelAngle(uniform) };
+}
+
+METAL_INTERNAL s32 stepCount(METAL(constant) Uniform& uniform, s32 steps)
+{
+    return uniform.reference ? steps * REFERENCE_STEP_SCALE : steps;
+}
+
+// Smooth window that reaches zero at the light's influence radius.
+METAL_INTERNAL f32 lightFalloff(f32 dist, f32 radius)
+{
+    const f32 x = dist / radius;
+    const f32 x2 = x * x;
+    const f32 w = saturate(1.0 - x2 * x2);
+    return w * w;
+}
+
 METAL_INTERNAL v3 directLight(const METAL(constant) Light& light, v3 eye, v3 P, v3 N)
 {
     const v3 lightDelta = light.pos - P;
@@ -57,7 +84,133 @@ METAL_INTERNAL v3 directLight(const METAL(constant) Light& light, v3 eye, v3 P,
         rimContrib = intensity * light.color;
     }
 
-    return (lightContrib + specularContrib + rimContrib);
+    // Fade out towards the influence radius so lights can be culled by it
+    const f32 window = lightFalloff(sqrt(dot(lightDelta, lightDelta)), light.radius);
+
+    return (lightContrib + specularContrib + rimContrib) * window;
+}
+
+// Cluster containing the world space point P, or -1 when P is outside the part of
+// the view frustum the clusters cover, like the hit points of reflection rays.
+METAL_INTERNAL s32 lightCluster(METAL(constant) Uniform& uniform, v3 P)
+{
+    const v3 v = transpose(uniform.camera_matrix) * (P - uniform.camera_position);
+    if (v.z < CLUSTER_NEAR || v.z >= CLUSTER_FAR) return -1;
+
+    const f32 aspect = (f32)uniform.viewport_size.x / (f32)uniform.viewport_size.y;
+    const v2 uv = v.xy * (uniform.camera_zoom / v.z);
+    const s32 x = (s32)floor((uv.x / aspect + 0.5) * CLUSTER_X);
+    const s32 y = (s32)floor((0.5 - uv.y) * CLUSTER_Y);
+    if (x < 0 || x >= CLUSTER_X || y < 0 || y >= CLUSTER_Y) return -1;
+
+    const f32 slice = log(v.z / CLUSTER_NEAR) / log(CLUSTER_FAR / CLUSTER_NEAR) * CLUSTER_Z;
+    const s32 z = (s32)min(slice, CLUSTER_Z - 1.0f);
+    return (z * CLUSTER_Y + y) * CLUSTER_X + x;
+}
+
+// Visibility of the light from P according to its shadow map, filtered over the
+// four nearest texels. Returns -1 if the light has no map or P is outside it.
+METAL_INTERNAL f32 cachedShadow(
+    METAL(constant) Shadow_Maps* shadow_maps,
+    METAL(device)   f32* shadow_depths,
+    s32 light_index, v3 P, v3 N)
+{
+    for (s32 m = 0; m < MAX_SHADOW_MAPS; ++m)
+    {
+        const METAL(constant) Shadow_Map& map = shadow_maps->maps[m];
+        if (map.light_index != light_index) continue;
+
+        // Offset along the normal by a couple of texels to keep surfaces from shadowing themselves
+        const f32 texel_angle = 2.0 * map.tan_half_angle / SHADOW_MAP_SIZE;
+        const v3 d0 = P - map.position;
+        const v3 d = d0 + N * (length(d0) * texel_angle * 2.0);
+
+        const f32 z = dot(d, map.forward);
+        if (z <= 0.0) return -1.0;
+        const v2 uv = v2(dot(d, map.right), dot(d, map.up)) / (z * map.tan_half_angle);
+        if (fabs(uv.x) >= 1.0 || fabs(uv.y) >= 1.0) return -1.0;
+
+        const v2 texel = (uv * 0.5 + 0.5) * SHADOW_MAP_SIZE - 0.5;
+        const v2 base = floor(texel);
+        const v2 f = texel - base;
+
+        const f32 dist = length(d);
+        const f32 bias = dist * texel_angle * 2.0;
+        METAL(device) f32* depths = shadow_depths + m * SHADOW_MAP_SIZE * SHADOW_MAP_SIZE;
+
+        f32 lit[4];
+        for (s32 k = 0; k < 4; ++k)
+        {
+            const s32 x = clamp(base.x + (k & 1), 0.0f, SHADOW_MAP_SIZE - 1.0f);
+            const s32 y = clamp(base.y + (k >> 1), 0.0f, SHADOW_MAP_SIZE - 1.0f);
+            lit[k] = depths[y * SHADOW_MAP_SIZE + x] + bias >= dist ? 1.0 : 0.0;
+        }
+        return mix(mix(lit[0], lit[1], f.x), mix(lit[2], lit[3], f.x), f.y);
+    }
+    return -1.0;
+}
+
+// Visibility of light i from P. Hard shadows come from the light's cached map
+// when it has one, otherwise a shadow ray is marched. A light_size above zero
+// jitters the ray over a sphere of that radius around the light.
+template <class T>
+METAL_INTERNAL f32 lightShadow(
+    METAL(constant) Light_Info& light_info,
+    METAL(constant) Shadow_Maps* shadow_maps,
+    METAL(device)   f32* shadow_depths,
+    s32 i, v3 P, v3 N,
+    T scene, f32 nearClip, f32 farClip,
+    f32 light_size, METAL(thread) u32& seed)
+{
+    const METAL(constant) Light& light = light_info.lights[i];
+
+    if (light_size == 0.0)
+    {
+        const f32 cached = cachedShadow(shadow_maps, shadow_depths, i, P, N);
+        if (cached >= 0.0) return cached;
+    }
+
+    const March shadowMarch = { SHADOW_RELAXATION, 0.0 };
+    v3 target = light.pos;
+    if (light_size > 0.0) target += randomUnitVector(seed) * light_size;
+    const v3 toLight = target - P;
+    const f32 dist = length(toLight);
+    return shadow(P+N*PIXEL_RADIUS, toLight / dist, nearClip, min(dist, farClip), scene, shadowMarch);
+}
+
+// Direct light at P from the lights binned to its cluster, each shadowed on its
+// own. Points outside the clusters visit every light and let the falloff reject
+// them. The first LOW_RES_SHADOWED_LIGHTS lights take their shadow from
+// known_shadows when it is not negative.
+template <class T>
+METAL_INTERNAL v3 directLighting(
+    METAL(constant) Uniform& uniform,
+    METAL(constant) Light_Info& light_info,
+    METAL(constant) Light_Clusters* clusters,
+    METAL(constant) Shadow_Maps* shadow_maps,
+    METAL(device)   f32* shadow_depths,
+    v3 eye, v3 P, v3 N,
+    T scene, f32 nearClip, f32 farClip,
+    v3 known_shadows,
+    f32 light_size, METAL(thread) u32& seed)
+{
+    const s32 cluster = lightCluster(uniform, P);
+    const s32 count = cluster < 0 ? light_info.count : clusters->count[cluster];
+
+    v3 result = v3(0,0,0);
+    for (s32 j = 0; j < count; ++j)
+    {
+        const s32 i = cluster < 0 ? j : clusters->lights[cluster][j];
+        const METAL(constant) Light& light = light_info.lights[i];
+
+        const v3 contrib = directLight(light, eye, P, N);
+        if (max(contrib.x, max(contrib.y, contrib.z)) <= 0.0) continue;
+
+        const f32 known = i < LOW_RES_SHADOWED_LIGHTS ? known_shadows[i] : -1.0;
+        const f32 sha = known >= 0.0 ? known : lightShadow(light_info, shadow_maps, shadow_depths, i, P, N, scene, nearClip, farClip, light_size, seed);
+        result += contrib * sha;
+    }
+    return result;
 }
 
 METAL_INTERNAL v3 Irradiance_SphericalHarmonics(v3 n)
@@ -77,105 +230,125 @@ METAL_INTERNAL v3 ambientLight(v3 P, v3 N)
     return al;
 }
 
-METAL_INTERNAL METAL(kernel) void
-steps(
-    METAL(constant) Uniform& uniform        METAL([[buffer(0)]]),
-    METAL(constant) Light_Info& light_info  METAL([[buffer(1)]]),
-    METAL(constant) Material* materials     METAL([[buffer(2)]]),
-    METAL(constant) Edit_Info& edit_info    METAL([[buffer(3)]]),
-    METAL(device)   u32* pixels             METAL([[buffer(4)]]),
-    ushort2 tid                             METAL([[thread_position_in_grid]]),
-    ushort2 gs                              METAL([[threads_per_grid]]))
+METAL_INTERNAL u32 probeHash(s32 x, s32 y, s32 z)
 {
-    for (u16 y = tid.y; y < gs.y; ++y)
-    for (u16 x = tid.x; x < gs.x; ++x)
+    return ((u32)x * 73856093u ^ (u32)y * 19349663u ^ (u32)z * 83492791u) & (PROBE_TABLE_SIZE - 1);
+}
+
+// Slot of the probe in a grid cell, or -1 if the cell has none.
+METAL_INTERNAL s32 findProbe(METAL(device) Probe* probes, s32 x, s32 y, s32 z)
+{
+    const u32 start = probeHash(x, y, z);
+    for (u32 i = 0; i < PROBE_MAX_PROBES; ++i)
     {
-        v2 uv = SS2NDC(v2(x,y), v2(uniform.viewport_size.x,uniform.viewport_size.y));
+        const u32 slot = (start + i) & (PROBE_TABLE_SIZE - 1);
+        const METAL(device) Probe& probe = probes[slot];
+        if (probe.state == PROBE_EMPTY) return -1;
+        if (probe.cell[0] == x && probe.cell[1] == y && probe.cell[2] == z) return slot;
+    }
+    return -1;
+}
 
-        uv.y *= -1; // we are software rendering, so we need to flip it manually.
+// Cosine convolution of the probe's radiance, divided by pi so an unoccluded sky
+// gives back the same value ambientLight does.
+METAL_INTERNAL v3 probeLight(const METAL(device) Probe& probe, v3 N)
+{
+    const f32 A0 = 1.0;
+    const f32 A1 = 2.0 / 3.0;
+    const v3 L0 = probe.sh[0] * (A0 * 0.282095);
+    const v3 L1 = (probe.sh[1] * N.y + probe.sh[2] * N.z + probe.sh[3] * N.x) * (A1 * 0.488603);
+    return max(L0 + L1, v3(0,0,0));
+}
 
-        const v3 ro = uniform.camera_position;
-        const v3 rd = uniform.camera_matrix * normalize(v3(uv.x, uv.y, uniform.camera_zoom));
+// Ambient light at P from the eight surrounding probes, weighted trilinearly and by
+// how much each one is in front of the surface. Returns a negative color when none
+// of them are traced yet.
+METAL_INTERNAL v3 probeIrradiance(METAL(device) Probe* probes, v3 P, v3 N)
+{
+    // Look up from slightly above the surface, so probes lying on it still count as in front
+    const v3 g = (P + N * (PROBE_SPACING * 0.25)) / PROBE_SPACING;
+    const v3 base = floor(g);
+    const v3 f = g - base;
+
+    v3 sum = v3(0,0,0);
+    f32 total = 0.0;
+    for (s32 k = 0; k < 8; ++k)
+    {
+        const v3 offset = v3(k & 1, (k >> 1) & 1, (k >> 2) & 1);
+        const v3 cell = base + offset;
+        const s32 slot = findProbe(probes, (s32)cell.x, (s32)cell.y, (s32)cell.z);
+        if (slot < 0) continue;
 
-        const auto scene = (Scene) { edit_info };
+        const METAL(device) Probe& probe = probes[slot];
+        if (probe.state != PROBE_VALID && probe.state != PROBE_STALE) continue;
 
-        const f32 farClip = (distance(ro, rd * v3(40,40,40)));
-        const s32 maxStepCount = 256;
-        const f32 nearClip = PIXEL_RADIUS;
+        const v3 trilinear = mix(v3(1,1,1) - f, f, offset);
+        const v3 toProbe = cell * PROBE_SPACING - P;
+        const f32 facing = (dot(toProbe, N) / (length(toProbe) + 1e-4) + 1.0) * 0.5;
+        const f32 w = trilinear.x * trilinear.y * trilinear.z * (facing * facing + 0.05);
+
+        sum += probeLight(probe, N) * w;
+        total += w;
+    }
+
+    if (total < 1e-4) return v3(-1,-1,-1);
+    return sum / total;
+}
+
+METAL_INTERNAL METAL(kernel) void
+steps(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(1)]]),
+    METAL(device)   v4* output              METAL([[buffer(2)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
 
-        const f32 side = 1.0;
-        const auto hit = castRay(ro, rd, maxStepCount, nearClip, farClip, side, scene);
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
+        const s32 index = y * uniform.viewport_size.x + x;
+        const G_Buffer_Texel texel = gbuffer[index];
 
         v3 color = v3(1,1,1)*0.0;
 
-        if (hit.t < farClip)
+        if (texel.t < FLT_MAX)
         {
-            f32 xxx = (f32)hit.steps / maxStepCount;
+            f32 xxx = (f32)texel.steps / GEOMETRY_MAX_STEPS;
             color = v3(0.0,xxx,0.0);
         }
 
-
-        // color = OECF_sRGBFast(color);
-        // color = ACES(color);
-
-        const u8 R = saturate(color.x) * 255.0;
-        const u8 G = saturate(color.y) * 255.0;
-        const u8 B = saturate(color.z) * 255.0;
-        const u8 A = 255;
-
-        const s32 index = y * uniform.viewport_size.x + x;
-        pixels[index] = ((R << 0) | (G << 8) | (B << 16) | (A << 24));
+        output[index] = (v4){color.x, color.y, color.z, 1.0};
     }
 }
 
 METAL_INTERNAL METAL(kernel) void
 normals(
-    METAL(constant) Uniform& uniform        METAL([[buffer(0)]]),
-    METAL(constant) Light_Info& light_info  METAL([[buffer(1)]]),
-    METAL(constant) Material* materials     METAL([[buffer(2)]]),
-    METAL(constant) Edit_Info& edit_info    METAL([[buffer(3)]]),
-    METAL(device)   u32* pixels             METAL([[buffer(4)]]),
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(1)]]),
+    METAL(device)   v4* output              METAL([[buffer(2)]]),
     ushort2 tid                             METAL([[thread_position_in_grid]]),
-    ushort2 gs                              METAL([[threads_per_grid]]))
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
 {
+    METAL(constant) Uniform& uniform = frame.uniform;
+
     for (u16 y = tid.y; y < gs.y; ++y)
     for (u16 x = tid.x; x < gs.x; ++x)
     {
-        v2 uv = SS2NDC(v2(x,y), v2(uniform.viewport_size.x,uniform.viewport_size.y));
-
-        uv.y *= -1; // we are software rendering, so we need to flip it manually.
-
-        const v3 ro = uniform.camera_position;
-        const v3 rd = uniform.camera_matrix * normalize(v3(uv.x, uv.y, uniform.camera_zoom));
-
-        const auto scene = (Scene) { edit_info };
-
-        const f32 farClip = (distance(ro, rd * v3(40,40,40)));
-        const s32 maxStepCount = 256;
-        const f32 nearClip = PIXEL_RADIUS;
-
-        const f32 side = 1.0;
-        const auto hit = castRay(ro, rd, maxStepCount, nearClip, farClip, side, scene);
+        const s32 index = y * uniform.viewport_size.x + x;
+        const G_Buffer_Texel texel = gbuffer[index];
 
         v3 color = v3(1,1,1)*0.0;
 
-        if (hit.t < farClip)
+        if (texel.t < FLT_MAX)
         {
-            v3 P = ro + rd * hit.t;
-            v3 N = calcNormal(P, scene);
-            color = N;
+            color = texel.normal;
         }
 
-        // color = OECF_sRGBFast(color);
-        // color = ACES(color);
-
-        const u8 R = saturate(color.x) * 255.0;
-        const u8 G = saturate(color.y) * 255.0;
-        const u8 B = saturate(color.z) * 255.0;
-        const u8 A = 255;
-
-        const s32 index = y * uniform.viewport_size.x + x;
-        pixels[index] = ((R << 0) | (G << 8) | (B << 16) | (A << 24));
+        output[index] = (v4){color.x, color.y, color.z, 1.0};
     }
 }
 
@@ -183,51 +356,39 @@ normals(
 METAL_INTERNAL v3 rayColor(
     Uniform& uniform,
     Light_Info& light_info,
+    Light_Clusters* clusters,
+    Shadow_Maps* shadow_maps,
+    f32* shadow_depths,
     Material* materials,
-    Edit_Info& edit_info,
-    v3 ro, v3 rd)
+    Scene scene,
+    v3 ro, v3 rd,
+    v3 background = v3(0,0,0))
 {
-    const auto scene = (Scene) { edit_info };
-
     const f32 farClip = 100.0; //(distance(ro, rd * v3(50,50,50)));
-    const s32 maxStepCount = 128;
+    const s32 maxStepCount = stepCount(uniform, 128);
     const f32 nearClip = PIXEL_RADIUS;
 
-    const auto hit = castRay(ro, rd, maxStepCount, nearClip, farClip, 1.0, scene);
+    const March march = rayMarch(uniform, SECONDARY_RELAXATION);
 
-    v3 color = v3(1,1,1)*0.0;
+    COUNT_WORK(scene.work, WORK_SECONDARY_RAYS, 1);
+    const auto hit = castRay(ro, rd, maxStepCount, nearClip, farClip, 1.0, scene, march);
+
+    v3 color = background;
 
     if (hit.t < farClip)
     {
         v3 P = ro + rd * hit.t;
         v3 N = calcNormal(P, scene);
 
-        // Shadow
-        f32 sha = 0.0;
-        {
-            for (s8 i = 0; i < light_info.count; ++i)
-            {
-                const METAL(constant) auto& light = light_info.lights[0]; // only the sun casts shadow
-                const v3 L = normalize(light.pos - P);
-                sha += shadow(P+N*PIXEL_RADIUS, L, nearClip, farClip, scene);
-            }
-        }
-
         // Ambient Occlusion
         f32 ao = 0.0;
         {
             ao = ambientOcclusion(P, N, scene);
         }
 
-        // Direct Illumination
-        v3 directLightContrib = {};
-        {
-            const v3 eye = ro;
-            for (s8 i = 0; i < light_info.count; ++i) {
-                const METAL(constant) auto& light = light_info.lights[i];
-                directLightContrib += directLight(light, eye, P, N);
-            }
-        }
+        // Direct Illumination, shadowed per light
+        u32 seed = 0;
+        const v3 directLightContrib = directLighting(uniform, light_info, clusters, shadow_maps, shadow_depths, ro, P, N, scene, nearClip, farClip, v3(-1,-1,-1), 0.0, seed);
 
         // Ambient Illumination
         v3 ambientLightContrib = {};
@@ -237,114 +398,337 @@ METAL_INTERNAL v3 rayColor(
 
         {
             const v3 albedo = materials[hit.material_id].color;
-            color = albedo * (sha * directLightContrib + ao * ambientLightContrib);
+            color = albedo * (directLightContrib + ao * ambientLightContrib);
         }
     }
 
     return color;
 }
 
+// Refraction through a glass object hit at P, blended with the reflection along R by fresnel.
+METAL_INTERNAL v3 glassColor(
+    Uniform& uniform,
+    Light_Info& light_info,
+    Light_Clusters* clusters,
+    Shadow_Maps* shadow_maps,
+    f32* shadow_depths,
+    Material* materials,
+    Scene scene,
+    v3 P, v3 N, v3 rd, v3 R, v3 albedo,
+    s32 maxStepCount, f32 nearClip, f32 farClip)
+{
+    float IOR = 1.45; // index of refraction
+    v3 rd_in = refract(rd , N, 1.0/IOR); // ray dir when entering
+    // Primary rays stop within a pixel footprint of the surface, so P can still be
+    // outside by more than PIXEL_RADIUS. Push through by the remaining distance.
+    v3 P_enter = P - N*(map(P, scene).x + PIXEL_RADIUS*3.0);
+    // Plain sphere tracing inside, the interiors are thin and the exit has to be exact.
+    COUNT_WORK(scene.work, WORK_SECONDARY_RAYS, 1);
+    const auto hit_in = castRay(P_enter, rd_in, maxStepCount, nearClip, farClip, -1.0, scene);
+    v3 P_exit = P_enter + rd_in * hit_in.t;
+    v3 N_exit = -calcNormal(P_exit, scene);
+    v3 rd_out = refract(rd_in, N_exit, IOR);
+    if (dot(rd_out, rd_out) == 0.0)
+        rd_out = reflect(rd_in, N_exit);
+    f32 dens = 0.5;
+    f32 optDist = exp(-hit_in.t*dens);
+    f32 fresnel = pow(1.0 + dot(rd, N), 3.0);
+
+    // Rays terminate as soon as they are within epsilon of a surface, so step off the exit first.
+    v3 refrColor = albedo * optDist * rayColor(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, P_exit - N_exit*PIXEL_RADIUS*3.0, rd_out);
+    v3 reflColor = rayColor(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, P + N*PIXEL_RADIUS*3.0, R);
+    return mix(refrColor, reflColor, (v3){fresnel,fresnel,fresnel});
+}
+
+// Shading rate of the VRS tile a pixel is in: 1, 2 or 4, where a rate of r shades
+// one pixel out of every r x r block.
+METAL_INTERNAL s32 shadingRate(METAL(constant) Uniform& uniform, METAL(device) u8* rates, s32 x, s32 y)
+{
+    const s32 tiles_x = (uniform.viewport_size.x + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+    return rates[(y / VRS_TILE_SIZE) * tiles_x + x / VRS_TILE_SIZE];
+}
+
+// Whether a pixel is shaded at its tile's rate, rather than interpolated.
+METAL_INTERNAL bool isShadedPixel(METAL(constant) Uniform& uniform, METAL(device) u8* rates, s32 x, s32 y)
+{
+    if (x < 0 || y < 0 || x >= uniform.viewport_size.x || y >= uniform.viewport_size.y) return false;
+    const s32 rate = shadingRate(uniform, rates, x, y);
+    return x % rate == 0 && y % rate == 0;
+}
+
+// Coarse tiles are smooth and close by, so the secondary rays they shade with make
+// do with a smaller march budget. Primary rays always get the full budget, a ray
+// that runs out of steps would lose thin geometry and read as a miss.
+METAL_INTERNAL s32 stepBudget(s32 maxStepCount, s32 rate)
+{
+    return rate == 1 ? maxStepCount : rate == 2 ? maxStepCount * 3 / 4 : maxStepCount / 2;
+}
+
+// Primary visibility for every pixel, shared by the passes that shade it.
 METAL_INTERNAL METAL(kernel) void
-uber(
-    METAL(constant) Uniform& uniform        METAL([[buffer(0)]]),
-    METAL(constant) Light_Info& light_info  METAL([[buffer(1)]]),
-    METAL(constant) Material* materials     METAL([[buffer(2)]]),
-    METAL(constant) Edit_Info& edit_info    METAL([[buffer(3)]]),
-    METAL(device)   u32* pixels             METAL([[buffer(4)]]),
+geometry(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(1)]]),
     ushort2 tid                             METAL([[thread_position_in_grid]]),
-    ushort2 gs                              METAL([[threads_per_grid]]))
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
 {
+    METAL(constant) Uniform& uniform = frame.uniform;
+    METAL(constant) Edit_Info& edit_info = frame.edit_info;
+    METAL(constant) Compiled_Scene& compiled = frame.compiled;
+
     for (u16 y = tid.y; y < gs.y; ++y)
     for (u16 x = tid.x; x < gs.x; ++x)
     {
-        v2 uv = SS2NDC(v2(x,y), v2(uniform.viewport_size.x,uniform.viewport_size.y));
-
-        uv.y *= -1; // we are software rendering, so we need to flip it manually.
-
+        COUNT_PIXEL(work, x, y);
         const v3 ro = uniform.camera_position;
-        const v3 rd = uniform.camera_matrix * normalize(v3(uv.x, uv.y, uniform.camera_zoom));
+        const v3 rd = primaryRay(uniform, v2(x,y));
 
-        const auto scene = (Scene) { edit_info };
+        const auto scene = (Scene) { edit_info, compiled, work };
 
-        const f32 farClip = 100.0; //(distance(ro, rd * v3(50,50,50)));
-        const s32 maxStepCount = 128;
+        const f32 farClip = 100.0;
         const f32 nearClip = PIXEL_RADIUS;
 
-        const f32 side = 1.0;
-        const auto hit = castRay(ro, rd, maxStepCount, nearClip, farClip, side, scene);
-
-        v3 color = v3(1,1,1)*0.0;
+        const March march = rayMarch(uniform, PRIMARY_RELAXATION);
+        const s32 maxStepCount = stepCount(uniform, GEOMETRY_MAX_STEPS);
+        COUNT_WORK(scene.work, WORK_PRIMARY_RAYS, 1);
+        const auto hit = castRay(ro, rd, maxStepCount, nearClip, farClip, 1.0, scene, march);
 
+        G_Buffer_Texel texel = { v3(0,0,0), FLT_MAX, 0, hit.steps };
         if (hit.t < farClip)
         {
-            v3 P = ro + rd * hit.t;
-            v3 N = calcNormal(P, scene);
+            texel.t = hit.t;
+            texel.normal = calcNormal(ro + rd * hit.t, scene);
+            texel.material_id = hit.material_id;
+        }
 
-            // Shadow
-            f32 sha = 0.0;
-            {
-                for (s8 i = 0; i < light_info.count; ++i)
-                {
-                    const METAL(constant) auto& light = light_info.lights[0]; // only the sun casts shadow
-                    const v3 L = normalize(light.pos - P);
-                    sha += shadow(P+N*PIXEL_RADIUS, L, nearClip, farClip, scene);
-                }
-            }
+        const s32 index = y * uniform.viewport_size.x + x;
+        gbuffer[index] = texel;
+    }
+}
 
-            // Ambient Occlusion
-            f32 ao = 1.0;
-            {
-                ao = ambientOcclusion(P, N, scene);
-            }
+// The full resolution pixel a low resolution lighting texel is traced from.
+METAL_INTERNAL ushort2 lowResPixel(METAL(constant) Uniform& uniform, u16 x, u16 y)
+{
+    const s32 scale = uniform.lighting_scale;
+    const s32 px = x * scale + scale / 2;
+    const s32 py = y * scale + scale / 2;
+    return ushort2(px < uniform.viewport_size.x ? px : uniform.viewport_size.x - 1,
+                   py < uniform.viewport_size.y ? py : uniform.viewport_size.y - 1);
+}
 
-            // Direct Illumination
-            v3 directLightContrib = {};
-            {
-                const v3 eye = ro;
-                for (s8 i = 0; i < light_info.count; ++i) {
-                    const METAL(constant) auto& light = light_info.lights[i];
-                    directLightContrib += directLight(light, eye, P, N);
-                }
-            }
+// AO and the shadows of the first lights at 1/lighting_scale resolution. Both
+// vary slowly over a surface, so uber upsamples them instead of tracing per pixel.
+// The grid is in low resolution texels.
+METAL_INTERNAL METAL(kernel) void
+lowResLighting(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(1)]]),
+    METAL(device)   v4* lighting            METAL([[buffer(2)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+    METAL(constant) Light_Info& light_info = frame.light_info;
+    METAL(constant) Shadow_Maps* shadow_maps = frame.shadow_maps;
+    METAL(device) f32* shadow_depths = frame.shadow_depths;
+    METAL(constant) Edit_Info& edit_info = frame.edit_info;
+    METAL(constant) Compiled_Scene& compiled = frame.compiled;
+
+    const s32 width = (uniform.viewport_size.x + uniform.lighting_scale - 1) / uniform.lighting_scale;
+
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
+        const ushort2 pixel = lowResPixel(uniform, x, y);
+        const METAL(device) G_Buffer_Texel& texel = gbuffer[pixel.y * uniform.viewport_size.x + pixel.x];
+        COUNT_PIXEL(work, pixel.x, pixel.y);
 
-            // Ambient Illumination
-            v3 ambientLightContrib = {};
+        v4 result = (v4){1,1,1,1};
+        if (texel.t < FLT_MAX)
+        {
+            const v3 rd = primaryRay(uniform, v2(pixel.x,pixel.y));
+            const v3 P = uniform.camera_position + rd * texel.t;
+            const v3 N = texel.normal;
+
+            const auto scene = (Scene) { edit_info, compiled, work };
+            const f32 farClip = 100.0;
+            const f32 nearClip = PIXEL_RADIUS;
+
+            // Probes replace AO, uber only traces it where they are missing
+            result.x = uniform.use_probes ? -1.0 : ambientOcclusion(P, N, scene);
+            u32 seed = 0;
+            for (s32 i = 0; i < LOW_RES_SHADOWED_LIGHTS && i < light_info.count; ++i)
             {
-                ambientLightContrib = ambientLight(P, N);
+                // Lights that cannot reach P are skipped by the shading anyway
+                if (distance(light_info.lights[i].pos, P) >= light_info.lights[i].radius) continue;
+                result[i + 1] = lightShadow(light_info, shadow_maps, shadow_depths, i, P, N, scene, nearClip, farClip, 0.0, seed);
             }
+        }
 
-            const MaterialKind kind = materials[hit.material_id].kind;
-            const v3 albedo = materials[hit.material_id].color;
-            switch (kind) {
-                case DIFF: {
-                    color = albedo * (sha * directLightContrib + ao * ambientLightContrib);
-                    break;
-                }
-                case SPEC:
-                    break;
-                case REFR: {
-                    float IOR = 1.45; // index of refraction
-                    v3 R = reflect(rd, N);
-                    v3 rd_in = refract(rd , N, 1.0/IOR); // ray dir when entering
-                    v3 P_enter = P - N*PIXEL_RADIUS*3.0;
-                    const auto hit_in = castRay(P_enter, rd_in, maxStepCount, nearClip, farClip, -1.0, scene);
-                    v3 P_exit = P_enter + rd_in * hit_in.t;
-                    v3 N_exit = -calcNormal(P_exit, scene);
-                    v3 rd_out = refract(rd_in, N_exit, IOR);
-                    if (dot(rd_out, rd_out) == 0.0)
-                        rd_out = reflect(rd_in, N_exit);
-                    f32 dens = 0.5;
-                    f32 optDist = exp(-hit_in.t*dens);
-                    f32 fresnel = pow(1.0 + dot(rd, N), 3.0);
-
-                    v3 refrColor = albedo * optDist * rayColor(uniform, light_info, materials, edit_info, P_exit, rd_out);
-                    v3 reflColor = rayColor(uniform, light_info, materials, edit_info, P + N*PIXEL_RADIUS*3.0, R);
-                    color = mix(refrColor, reflColor, (v3){fresnel,fresnel,fresnel});
+        lighting[y * width + x] = result;
+    }
+}
 
-                    break;
-                }
+// Weight of corner k (bit 0 right, bit 1 below) of the four samples around a
+// pixel at fraction f between them. Bilinear, and by how well the surface the
+// sample was taken from matches the pixel's in depth and normal.
+METAL_INTERNAL f32 bilateralWeight(s32 k, v2 f, G_Buffer_Texel other, G_Buffer_Texel texel)
+{
+    const f32 bilinear = ((k & 1) ? f.x : 1.0 - f.x) * ((k >> 1) ? f.y : 1.0 - f.y);
+    const f32 depth = exp(-fabs(other.t - texel.t) / (0.02 * texel.t));
+    const f32 normal = pow(saturate(dot(other.normal, texel.normal)), 16.0);
+    return (bilinear + 1e-3) * depth * normal;
+}
+
+// Joint bilateral upsampling of the low resolution lighting from the four nearest
+// texels. Returns -1 when none of them match.
+METAL_INTERNAL v4 upsampleLighting(
+    METAL(constant) Uniform& uniform,
+    METAL(device)   G_Buffer_Texel* gbuffer,
+    METAL(device)   v4* lighting,
+    u16 x, u16 y, G_Buffer_Texel texel)
+{
+    const s32 scale = uniform.lighting_scale;
+    const s32 width = (uniform.viewport_size.x + scale - 1) / scale;
+    const s32 height = (uniform.viewport_size.y + scale - 1) / scale;
+
+    // Position in the low resolution grid, with texel centers on whole numbers
+    const v2 p = (v2(x, y) - (f32)(scale / 2)) / (f32)scale;
+    const v2 base = floor(p);
+    const v2 f = p - base;
+
+    v4 sum = (v4){0,0,0,0};
+    f32 total = 0.0;
+    for (s32 k = 0; k < 4; ++k)
+    {
+        const s32 lx = clamp(base.x + (k & 1), 0.0f, width - 1.0f);
+        const s32 ly = clamp(base.y + (k >> 1), 0.0f, height - 1.0f);
+        const ushort2 pixel = lowResPixel(uniform, lx, ly);
+        const METAL(device) G_Buffer_Texel& other = gbuffer[pixel.y * uniform.viewport_size.x + pixel.x];
+        if (!(other.t < FLT_MAX)) continue;
+
+        const f32 w = bilateralWeight(k, f, other, texel);
+        sum += lighting[ly * width + lx] * w;
+        total += w;
+    }
+
+    if (total < 1e-4) return (v4){-1,-1,-1,-1};
+    return sum / total;
+}
+
+// Shades a surface seen along a primary ray. 'low' holds AO and the shadows of the
+// first lights when they are already known, negative values are traced here. With
+// use_probes the ambient light comes from the irradiance probes instead of the sky
+// and AO. Coarser shading rates take fewer AO samples and march steps.
+METAL_INTERNAL v3 shadeSurface(
+    Uniform& uniform,
+    Light_Info& light_info,
+    Light_Clusters* clusters,
+    Shadow_Maps* shadow_maps,
+    f32* shadow_depths,
+    Material* materials,
+    Scene scene,
+    METAL(device) Probe* probes,
+    v3 ro, v3 rd, v3 P, v3 N, s16 material_id, v4 low, s32 rate)
+{
+    const f32 farClip = 100.0;
+    const s32 maxStepCount = stepCount(uniform, stepBudget(128, rate));
+    const f32 nearClip = PIXEL_RADIUS;
+
+    v3 color = v3(0,0,0);
+
+    const MaterialKind kind = materials[material_id].kind;
+    const v3 albedo = materials[material_id].color;
+    switch (kind) {
+        case DIFF: {
+            // Direct Illumination, shadowed per light
+            u32 seed = 0;
+            const v3 directLightContrib = directLighting(uniform, light_info, clusters, shadow_maps, shadow_depths, ro, P, N, scene, nearClip, farClip, low.yzw, 0.0, seed);
+
+            // Ambient Illumination from the probes, or the sky occluded by AO
+            v3 ambientLightContrib = uniform.use_probes ? probeIrradiance(probes, P, N) : v3(-1,-1,-1);
+            if (ambientLightContrib.x < 0.0)
+            {
+                const f32 ao = low.x >= 0.0 ? low.x : ambientOcclusion(P, N, scene, rate == 1 ? 5 : rate == 2 ? 4 : 3);
+                ambientLightContrib = ao * ambientLight(P, N);
             }
+
+            color = albedo * (directLightContrib + ambientLightContrib);
+            break;
         }
+        case SPEC:
+            break;
+        case REFR: {
+            color = glassColor(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, P, N, rd, reflect(rd, N), albedo, maxStepCount, nearClip, farClip);
+            break;
+        }
+    }
+
+    return color;
+}
+
+// Shades the G-buffer texel of one pixel. AO and the shadows of the first lights
+// are upsampled from the low resolution lighting when lighting_scale > 1, and
+// traced here otherwise or where the upsampling found no matching surface.
+METAL_INTERNAL v3 shadePixel(
+    Uniform& uniform,
+    Light_Info& light_info,
+    Light_Clusters* clusters,
+    Shadow_Maps* shadow_maps,
+    f32* shadow_depths,
+    Material* materials,
+    Scene scene,
+    METAL(device) G_Buffer_Texel* gbuffer,
+    METAL(device) v4* lighting,
+    METAL(device) Probe* probes,
+    u16 x, u16 y, s32 rate)
+{
+    const G_Buffer_Texel texel = gbuffer[y * uniform.viewport_size.x + x];
+    if (!(texel.t < FLT_MAX)) return v3(0,0,0);
+
+    const v3 ro = uniform.camera_position;
+    const v3 rd = primaryRay(uniform, v2(x,y));
+    const v3 P = ro + rd * texel.t;
+
+    const bool needs_lighting = materials[texel.material_id].kind == DIFF && uniform.lighting_scale > 1;
+    const v4 low = needs_lighting ? upsampleLighting(uniform, gbuffer, lighting, x, y, texel) : (v4){-1,-1,-1,-1};
+    return shadeSurface(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, probes, ro, rd, P, texel.normal, texel.material_id, low, rate);
+}
+
+// Shades the G-buffer at the tile shading rates. In coarse tiles only the top left
+// pixel of each block is shaded here, vrsFill fills in the rest.
+METAL_INTERNAL METAL(kernel) void
+uber(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(1)]]),
+    METAL(device)   v4* lighting            METAL([[buffer(2)]]),
+    METAL(device)   Probe* probes           METAL([[buffer(3)]]),
+    METAL(device)   u8* rates               METAL([[buffer(4)]]),
+    METAL(device)   v4* output              METAL([[buffer(5)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+    METAL(constant) Light_Info& light_info = frame.light_info;
+    METAL(constant) Light_Clusters* clusters = frame.clusters;
+    METAL(constant) Shadow_Maps* shadow_maps = frame.shadow_maps;
+    METAL(device) f32* shadow_depths = frame.shadow_depths;
+    METAL(constant) Material* materials = frame.materials;
+    METAL(constant) Edit_Info& edit_info = frame.edit_info;
+    METAL(constant) Compiled_Scene& compiled = frame.compiled;
+    const auto scene = (Scene) { edit_info, compiled, work };
+
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
+        if (!isShadedPixel(uniform, rates, x, y)) continue;
+        COUNT_PIXEL(work, x, y);
+
+        const s32 rate = shadingRate(uniform, rates, x, y);
+        const v3 color = shadePixel(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, gbuffer, lighting, probes, x, y, rate);
 
         // Draw workload grid
         // if (x == tid.x ||
@@ -354,49 +738,582 @@ uber(
         //     color = v3(0.0, 1.0, 0.0) * 0.5;
         // }
 
-        // color = OECF_sRGBFast(color);
-        color = ACES(color);
+        const s32 index = y * uniform.viewport_size.x + x;
+        output[index] = (v4){color.x, color.y, color.z, 1.0};
+    }
+}
 
-        const u8 R = saturate(color.x) * 255.0;
-        const u8 G = saturate(color.y) * 255.0;
-        const u8 B = saturate(color.z) * 255.0;
-        const u8 A = 255;
+// Interpolates the pixels uber skipped in coarse tiles from the four shaded pixels
+// around them, those of the same material weighted like the upsampled lighting.
+// Pixels without a matching neighbour are shaded.
+METAL_INTERNAL METAL(kernel) void
+vrsFill(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(1)]]),
+    METAL(device)   v4* lighting            METAL([[buffer(2)]]),
+    METAL(device)   Probe* probes           METAL([[buffer(3)]]),
+    METAL(device)   u8* rates               METAL([[buffer(4)]]),
+    METAL(device)   v4* output              METAL([[buffer(5)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+    METAL(constant) Light_Info& light_info = frame.light_info;
+    METAL(constant) Light_Clusters* clusters = frame.clusters;
+    METAL(constant) Shadow_Maps* shadow_maps = frame.shadow_maps;
+    METAL(device) f32* shadow_depths = frame.shadow_depths;
+    METAL(constant) Material* materials = frame.materials;
+    METAL(constant) Edit_Info& edit_info = frame.edit_info;
+    METAL(constant) Compiled_Scene& compiled = frame.compiled;
+    const auto scene = (Scene) { edit_info, compiled, work };
+
+    const s32 width = uniform.viewport_size.x;
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
+        if (isShadedPixel(uniform, rates, x, y)) continue;
+
+        const s32 index = y * width + x;
+        const G_Buffer_Texel texel = gbuffer[index];
+        if (!(texel.t < FLT_MAX))
+        {
+            output[index] = (v4){0,0,0,1};
+            continue;
+        }
+
+        const s32 rate = shadingRate(uniform, rates, x, y);
+        const s32 x0 = x - x % rate;
+        const s32 y0 = y - y % rate;
+        const v2 f = v2(x - x0, y - y0) / (f32)rate;
 
+        v4 sum = (v4){0,0,0,0};
+        f32 total = 0.0;
+        for (s32 k = 0; k < 4; ++k)
+        {
+            const s32 sx = x0 + (k & 1) * rate;
+            const s32 sy = y0 + (k >> 1) * rate;
+            if (!isShadedPixel(uniform, rates, sx, sy)) continue;
+
+            const METAL(device) G_Buffer_Texel& other = gbuffer[sy * width + sx];
+            if (!(other.t < FLT_MAX) || other.material_id != texel.material_id) continue;
+
+            const f32 w = bilateralWeight(k, f, other, texel);
+            sum += output[sy * width + sx] * w;
+            total += w;
+        }
+
+        if (total < 1e-4)
+        {
+            COUNT_PIXEL(work, x, y);
+            const v3 color = shadePixel(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, gbuffer, lighting, probes, x, y, rate);
+            output[index] = (v4){color.x, color.y, color.z, 1.0};
+        }
+        else
+        {
+            output[index] = sum / total;
+        }
+    }
+}
+
+// Picks the shading rate of each VRS tile for the next frame, one thread per tile.
+// Tiles that contain an edge, a lot of marching or varying normals are shaded at
+// full rate, and the rest by how much the color of their shaded pixels varies.
+METAL_INTERNAL METAL(kernel) void
+shadingRates(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(1)]]),
+    METAL(device)   v4* colors              METAL([[buffer(2)]]),
+    METAL(device)   u8* rates               METAL([[buffer(3)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+
+    const s32 width = uniform.viewport_size.x;
+    const s32 height = uniform.viewport_size.y;
+    const s32 tiles_x = (width + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+
+    for (u16 ty = tid.y; ty < gs.y; ++ty)
+    for (u16 tx = tid.x; tx < gs.x; ++tx)
+    {
+        const s32 x0 = tx * VRS_TILE_SIZE;
+        const s32 y0 = ty * VRS_TILE_SIZE;
+        const s32 x1 = x0 + VRS_TILE_SIZE < width ? x0 + VRS_TILE_SIZE : width;
+        const s32 y1 = y0 + VRS_TILE_SIZE < height ? y0 + VRS_TILE_SIZE : height;
+
+        const G_Buffer_Texel first = gbuffer[y0 * width + x0];
+        const bool first_hit = first.t < FLT_MAX;
+
+        s32 rate = 4;
+        f32 t_min = FLT_MAX;
+        f32 t_max = 0.0;
+        f32 luma_sum = 0.0;
+        f32 luma_sq_sum = 0.0;
+        f32 luma_count = 0.0;
+        for (s32 y = y0; y < y1; ++y)
+        for (s32 x = x0; x < x1; ++x)
+        {
+            const G_Buffer_Texel texel = gbuffer[y * width + x];
+            const bool hit = texel.t < FLT_MAX;
+            if (hit != first_hit || texel.material_id != first.material_id) rate = 1;
+            if (texel.steps >= GEOMETRY_MAX_STEPS / 2) rate = 1;
+            else if (texel.steps >= GEOMETRY_MAX_STEPS / 4 && rate > 2) rate = 2;
+            if (!hit) continue;
+
+            const f32 facing = dot(texel.normal, first.normal);
+            if (facing < 0.8) rate = 1;
+            else if (facing < 0.95 && rate > 2) rate = 2;
+            t_min = min(t_min, texel.t);
+            t_max = max(t_max, texel.t);
+
+            // Only the pixels that were shaded last frame tell how the color varies
+            if (!isShadedPixel(uniform, rates, x, y)) continue;
+            const v3 color = colors[y * width + x].xyz;
+            const f32 luma = dot(color, v3(0.2126, 0.7152, 0.0722));
+            luma_sum += luma;
+            luma_sq_sum += luma * luma;
+            luma_count += 1.0;
+        }
+
+        if (first_hit && rate > 1)
+        {
+            if ((t_max - t_min) > 0.5 * t_min && rate > 2) rate = 2;
+
+            const f32 mean = luma_sum / max(luma_count, 1.0f);
+            const f32 deviation = sqrt(max(luma_sq_sum / max(luma_count, 1.0f) - mean * mean, 0.0f));
+            const f32 variation = deviation / (mean + 1e-3);
+            if (variation > 0.08) rate = 1;
+            else if (variation > 0.02 && rate > 2) rate = 2;
+        }
+
+        rates[ty * tiles_x + tx] = rate;
+    }
+}
+
+#define EDGE_LIST_WIDTH 256
+
+// Whether the surfaces of two neighbouring pixels are different enough that the
+// pixel footprint likely straddles an edge.
+METAL_INTERNAL bool isEdge(G_Buffer_Texel a, G_Buffer_Texel b)
+{
+    const bool a_hit = a.t < FLT_MAX;
+    const bool b_hit = b.t < FLT_MAX;
+    if (a_hit != b_hit) return true;
+    if (!a_hit) return false;
+    if (a.material_id != b.material_id) return true;
+    if (fabs(a.t - b.t) > 0.05 * min(a.t, b.t)) return true;
+    return dot(a.normal, b.normal) < 0.9;
+}
+
+// Marks the pixels that differ from a neighbour in material, depth or normal.
+METAL_INTERNAL METAL(kernel) void
+edgeDetect(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(1)]]),
+    METAL(device)   u8* edges               METAL([[buffer(2)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+
+    const s32 width = uniform.viewport_size.x;
+    const s32 height = uniform.viewport_size.y;
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
+        const s32 index = y * width + x;
+        const G_Buffer_Texel texel = gbuffer[index];
+
+        bool edge = false;
+        if (x > 0)          edge = edge || isEdge(texel, gbuffer[index - 1]);
+        if (x < width - 1)  edge = edge || isEdge(texel, gbuffer[index + 1]);
+        if (y > 0)          edge = edge || isEdge(texel, gbuffer[index - width]);
+        if (y < height - 1) edge = edge || isEdge(texel, gbuffer[index + width]);
+        edges[index] = edge;
+    }
+}
+
+// Adds uniform.aa_samples - 1 jittered samples to the edge pixels listed in
+// 'edges' and replaces their color with the average. The list is laid out in rows
+// of EDGE_LIST_WIDTH entries, one thread each, padded with -1. The jitter follows
+// the R2 sequence so any sample count covers the pixel evenly.
+METAL_INTERNAL METAL(kernel) void
+edgeSupersample(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   Probe* probes           METAL([[buffer(1)]]),
+    METAL(device)   s32* edges              METAL([[buffer(2)]]),
+    METAL(device)   v4* output              METAL([[buffer(3)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+    METAL(constant) Light_Info& light_info = frame.light_info;
+    METAL(constant) Light_Clusters* clusters = frame.clusters;
+    METAL(constant) Shadow_Maps* shadow_maps = frame.shadow_maps;
+    METAL(device) f32* shadow_depths = frame.shadow_depths;
+    METAL(constant) Material* materials = frame.materials;
+    METAL(constant) Edit_Info& edit_info = frame.edit_info;
+    METAL(constant) Compiled_Scene& compiled = frame.compiled;
+
+    const auto scene = (Scene) { edit_info, compiled, work };
+
+    const f32 farClip = 100.0;
+    const f32 nearClip = PIXEL_RADIUS;
+    const s32 maxStepCount = stepCount(uniform, GEOMETRY_MAX_STEPS);
+
+    // Each sample covers 1/aa_samples of the pixel, and stops within its own footprint
+    March march = rayMarch(uniform, PRIMARY_RELAXATION);
+    march.pixel_angle /= sqrt((f32)uniform.aa_samples);
+
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
+        const s32 index = edges[y * EDGE_LIST_WIDTH + x];
+        if (index < 0) continue;
+
+        const s32 px = index % uniform.viewport_size.x;
+        const s32 py = index / uniform.viewport_size.x;
+        COUNT_PIXEL(work, px, py);
+
+        // The primary sample through the pixel center is already shaded
+        v3 sum = output[index].xyz;
+        for (s32 i = 1; i < uniform.aa_samples; ++i)
+        {
+            const v2 jitter = fract(v2(0.5, 0.5) + v2(0.7548777, 0.5698403) * i) - 0.5;
+            const v3 ro = uniform.camera_position;
+            const v3 rd = primaryRay(uniform, v2(px,py) + jitter);
+
+            COUNT_WORK(scene.work, WORK_PRIMARY_RAYS, 1);
+            const auto hit = castRay(ro, rd, maxStepCount, nearClip, farClip, 1.0, scene, march);
+            if (hit.t < farClip)
+            {
+                const v3 P = ro + rd * hit.t;
+                const v3 N = calcNormal(P, scene);
+                sum += shadeSurface(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, probes, ro, rd, P, N, hit.material_id, (v4){-1,-1,-1,-1}, 1);
+            }
+        }
+
+        const v3 color = sum / uniform.aa_samples;
+        output[index] = (v4){color.x, color.y, color.z, 1.0};
+    }
+}
+
+// Soft light radius used to jitter shadow rays in progressive mode.
+#define LIGHT_RADIUS 4.0
+
+// One stochastic sample of the scene along a primary ray. Unlike uber it honors
+// the roughness, metallic and emission of the material, so it has to be averaged
+// over many samples to converge.
+METAL_INTERNAL v3 traceSample(
+    Uniform& uniform,
+    Light_Info& light_info,
+    Light_Clusters* clusters,
+    Shadow_Maps* shadow_maps,
+    f32* shadow_depths,
+    Material* materials,
+    Scene scene,
+    v3 ro, v3 rd,
+    METAL(thread) u32& seed)
+{
+    const f32 farClip = 100.0;
+    const s32 maxStepCount = 128;
+    const f32 nearClip = PIXEL_RADIUS;
+
+    const March march = { PRIMARY_RELAXATION, pixelAngle(uniform) };
+
+    COUNT_WORK(scene.work, WORK_PRIMARY_RAYS, 1);
+    const auto hit = castRay(ro, rd, maxStepCount, nearClip, farClip, 1.0, scene, march);
+    if (hit.t >= farClip) return v3(0,0,0);
+
+    const v3 P = ro + rd * hit.t;
+    const v3 N = calcNormal(P, scene);
+    const METAL(constant) Material& material = materials[hit.material_id];
+    const v3 albedo = material.color;
+
+    // Glossy reflection direction, spread by roughness and kept above the surface.
+    v3 R = normalize(reflect(rd, N) + randomUnitVector(seed) * (material.roughness * material.roughness));
+    if (dot(R, N) < 0.0) R = reflect(R, N);
+
+    v3 color = albedo * material.emission;
+    switch (material.kind) {
+        case DIFF: {
+            // Soft shadows from jittered points on each light
+            const v3 directLightContrib = directLighting(uniform, light_info, clusters, shadow_maps, shadow_depths, ro, P, N, scene, nearClip, farClip, v3(-1,-1,-1), LIGHT_RADIUS, seed);
+
+            const f32 ao = ambientOcclusion(P, N, scene);
+
+            const v3 diffuse = albedo * (directLightContrib + ao * ambientLight(P, N));
+
+            // Schlick fresnel towards the metallic tint
+            const f32 NdotV = saturate(dot(N, -rd));
+            const v3 F0 = mix(v3(0.04, 0.04, 0.04), albedo, material.metallic);
+            const v3 F = F0 + (v3(1,1,1) - F0) * pow(1.0 - NdotV, 5.0);
+
+            const v3 reflColor = rayColor(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, P + N*PIXEL_RADIUS*3.0, R, ambientLight(P, R));
+            color += diffuse * (1.0 - material.metallic) * (v3(1,1,1) - F) + reflColor * F;
+        } break;
+        case SPEC: {
+            color += albedo * rayColor(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, P + N*PIXEL_RADIUS*3.0, R, ambientLight(P, R));
+        } break;
+        case REFR: {
+            color += glassColor(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, P, N, rd, R, albedo, maxStepCount, nearClip, farClip);
+        } break;
+    }
+
+    return color;
+}
+
+// Progressive accumulation for a still camera. Each frame adds one jittered sample
+// per pixel to the accumulation buffer and outputs the running average.
+// uniform.sample_index == 0 restarts the accumulation.
+METAL_INTERNAL METAL(kernel) void
+progressive(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   v4* accumulation        METAL([[buffer(1)]]),
+    METAL(device)   v4* output              METAL([[buffer(2)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+    METAL(constant) Light_Info& light_info = frame.light_info;
+    METAL(constant) Light_Clusters* clusters = frame.clusters;
+    METAL(constant) Shadow_Maps* shadow_maps = frame.shadow_maps;
+    METAL(device) f32* shadow_depths = frame.shadow_depths;
+    METAL(constant) Material* materials = frame.materials;
+    METAL(constant) Edit_Info& edit_info = frame.edit_info;
+    METAL(constant) Compiled_Scene& compiled = frame.compiled;
+    const auto scene = (Scene) { edit_info, compiled, work };
+
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
         const s32 index = y * uniform.viewport_size.x + x;
-        pixels[index] = ((R << 0) | (G << 8) | (B << 16) | (A << 24));
+        COUNT_PIXEL(work, x, y);
+
+        u32 seed = pcgHash(index ^ pcgHash(uniform.sample_index));
+
+        // Jitter within the pixel for antialiasing
+        const v2 jitter = v2(randomFloat(seed), randomFloat(seed)) - 0.5;
+        v2 uv = SS2NDC(v2(x,y) + jitter, v2(uniform.viewport_size.x,uniform.viewport_size.y));
+
+        uv.y *= -1; // we are software rendering, so we need to flip it manually.
+
+        const v3 ro = uniform.camera_position;
+        const v3 rd = uniform.camera_matrix * normalize(v3(uv.x, uv.y, uniform.camera_zoom));
+
+        const v3 sample = traceSample(uniform, light_info, clusters, shadow_maps, shadow_depths, materials, scene, ro, rd, seed);
+
+        v4 accum = uniform.sample_index == 0 ? (v4){0,0,0,0} : accumulation[index];
+        accum += (v4){sample.x, sample.y, sample.z, 1.0};
+        accumulation[index] = accum;
+
+        output[index] = accum / accum.w;
+    }
+}
+
+// Marks the VRS tiles last frame's change can reach besides where it is seen
+// directly: tiles with a surface whose path to a light passes through 'changed',
+// which the change may have shadowed or unshadowed, and tiles with glass, which
+// sees the whole scene. One thread per tile.
+METAL_INTERNAL METAL(kernel) void
+changedTiles(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(constant) Bounds& changed         METAL([[buffer(1)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(2)]]),
+    METAL(device)   u8* dirty               METAL([[buffer(3)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+    METAL(constant) Light_Info& light_info = frame.light_info;
+    METAL(constant) Material* materials = frame.materials;
+
+    const s32 width = uniform.viewport_size.x;
+    const s32 height = uniform.viewport_size.y;
+    const s32 tiles_x = (width + VRS_TILE_SIZE - 1) / VRS_TILE_SIZE;
+
+    for (u16 ty = tid.y; ty < gs.y; ++ty)
+    for (u16 tx = tid.x; tx < gs.x; ++tx)
+    {
+        METAL(device) u8& tile = dirty[ty * tiles_x + tx];
+
+        const s32 x0 = tx * VRS_TILE_SIZE;
+        const s32 y0 = ty * VRS_TILE_SIZE;
+        const s32 x1 = x0 + VRS_TILE_SIZE < width ? x0 + VRS_TILE_SIZE : width;
+        const s32 y1 = y0 + VRS_TILE_SIZE < height ? y0 + VRS_TILE_SIZE : height;
+        for (s32 y = y0; y < y1 && !tile; ++y)
+        for (s32 x = x0; x < x1 && !tile; ++x)
+        {
+            const G_Buffer_Texel texel = gbuffer[y * width + x];
+            if (!(texel.t < FLT_MAX)) continue;
+            if (materials[texel.material_id].kind == REFR)
+            {
+                tile = 1;
+                break;
+            }
+
+            const v3 P = uniform.camera_position + primaryRay(uniform, v2(x,y)) * texel.t;
+            for (s32 i = 0; i < light_info.count; ++i)
+            {
+                const v3 toLight = light_info.lights[i].pos - P;
+                const f32 dist = length(toLight);
+                if (dist >= light_info.lights[i].radius) continue;
+
+                const v2 range = clipRay(P, toLight / dist, 0.0, dist, changed);
+                if (range.x < range.y)
+                {
+                    tile = 1;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Weight of the new frame in the temporal history, scaled by how close its nearest
+// sample lies to the output pixel.
+#define TAA_BLEND 0.25
+
+METAL_INTERNAL v4 sampleBilinear(METAL(device) v4* image, ushort2 size, v2 p)
+{
+    const v2 base = floor(p);
+    const v2 f = p - base;
+    v4 sum = (v4){0,0,0,0};
+    for (s32 k = 0; k < 4; ++k)
+    {
+        const s32 x = clamp(base.x + (k & 1), 0.0f, size.x - 1.0f);
+        const s32 y = clamp(base.y + (k >> 1), 0.0f, size.y - 1.0f);
+        const f32 w = ((k & 1) ? f.x : 1.0 - f.x) * ((k >> 1) ? f.y : 1.0 - f.y);
+        sum += image[y * size.x + x] * w;
+    }
+    return sum;
+}
+
+// Temporal resolve into an output_size image, which may be larger than the
+// viewport. The jittered samples around each output pixel are filtered with a
+// Gaussian, and blended into the previous frame's history at the position the
+// surface had under the previous camera. The history is clamped to the range of
+// the samples around the pixel so moving and disoccluded surfaces don't smear.
+// Without 'accumulate' the samples are only reconstructed to the output size.
+METAL_INTERNAL METAL(kernel) void
+taaResolve(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   G_Buffer_Texel* gbuffer METAL([[buffer(1)]]),
+    METAL(device)   v4* color               METAL([[buffer(2)]]),
+    METAL(device)   v4* history             METAL([[buffer(3)]]),
+    METAL(constant) u32 accumulate          METAL([[buffer(4)]]),
+    METAL(device)   v4* resolved            METAL([[buffer(5)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+    METAL(constant) Uniform& previous = frame.previous;
+    const ushort2 output_size = frame.output_size;
+
+    const v2 res = v2(uniform.viewport_size.x, uniform.viewport_size.y);
+    const v2 out_res = v2(output_size.x, output_size.y);
+
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
+        // The same point in viewport pixels, both images share their center
+        const v2 p = (v2(x,y) - out_res * 0.5) * (res.y / out_res.y) + res * 0.5;
+        const v2 nearest = floor(p - uniform.jitter + 0.5);
+
+        v4 sum = (v4){0,0,0,0};
+        f32 total = 0.0;
+        f32 confidence = 0.0;
+        v4 lo = (v4){FLT_MAX,FLT_MAX,FLT_MAX,FLT_MAX};
+        v4 hi = (v4){-FLT_MAX,-FLT_MAX,-FLT_MAX,-FLT_MAX};
+        f32 closest = FLT_MAX;
+        for (s32 dy = -1; dy <= 1; ++dy)
+        for (s32 dx = -1; dx <= 1; ++dx)
+        {
+            const s32 sx = clamp(nearest.x + dx, 0.0f, res.x - 1.0f);
+            const s32 sy = clamp(nearest.y + dy, 0.0f, res.y - 1.0f);
+            const s32 index = sy * uniform.viewport_size.x + sx;
+            const v4 sample = color[index];
+
+            // Gaussian around the output pixel, tone mapped so fireflies don't dominate
+            const v2 d = v2(sx, sy) + uniform.jitter - p;
+            const f32 gaussian = exp(-dot(d, d) * 2.0);
+            const f32 luma = dot(sample.xyz, v3(0.2126, 0.7152, 0.0722));
+            const f32 w = gaussian / (1.0 + luma);
+
+            sum += sample * w;
+            total += w;
+            confidence = max(confidence, gaussian);
+            lo = min(lo, sample);
+            hi = max(hi, sample);
+            closest = min(closest, gbuffer[index].t);
+        }
+        const v4 current = sum / total;
+
+        f32 alpha = 1.0;
+        v4 previous_color = current;
+        if (accumulate)
+        {
+            // Reproject the closest surface around the pixel, so edges follow the
+            // foreground. Misses are reprojected as if they were very far away.
+            const v3 ro = uniform.camera_position;
+            const v3 rd = cameraRay(uniform, v2(x,y), out_res);
+            const v3 P = ro + rd * (closest < FLT_MAX ? closest : 1e4);
+            const v3 q = projectToPixel(previous, P, out_res);
+            if (q.z > 0.0 && q.x >= 0.0 && q.y >= 0.0 && q.x <= out_res.x - 1.0 && q.y <= out_res.y - 1.0)
+            {
+                previous_color = clamp(sampleBilinear(history, output_size, v2(q.x, q.y)), lo, hi);
+                alpha = clamp(TAA_BLEND * confidence, 0.04f, 1.0f);
+            }
+        }
+
+        resolved[y * output_size.x + x] = mix(previous_color, current, alpha);
     }
 }
 
+// Turns the HDR color of a view into display pixels. Debug views are shown as
+// they are, shaded ones are tone mapped.
 METAL_INTERNAL METAL(kernel) void
-clear(
-    METAL(constant) Uniform& uniform        METAL([[buffer(0)]]),
-    METAL(constant) v4 color                METAL([[buffer(1)]]),
-    METAL(device)   u32* pixels             METAL([[buffer(2)]]),
+post(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   v4* input               METAL([[buffer(1)]]),
+    METAL(constant) u32 tonemap             METAL([[buffer(2)]]),
+    METAL(device)   u32* pixels             METAL([[buffer(3)]]),
     ushort2 tid                             METAL([[thread_position_in_grid]]),
-    ushort2 gs                              METAL([[threads_per_grid]]))
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
 {
     for (u16 y = tid.y; y < gs.y; ++y)
     for (u16 x = tid.x; x < gs.x; ++x)
     {
+        const s32 index = y * frame.output_size.x + x;
+        v3 color = input[index].xyz;
+
+        // color = OECF_sRGBFast(color);
+        if (tonemap) color = ACES(color);
+
         const u8 R = saturate(color.x) * 255.0;
         const u8 G = saturate(color.y) * 255.0;
         const u8 B = saturate(color.z) * 255.0;
-        const u8 A = saturate(color.w) * 255.0;
+        const u8 A = 255;
 
-        const s32 index = y * uniform.viewport_size.x + x;
         pixels[index] = ((R << 0) | (G << 8) | (B << 16) | (A << 24));
     }
 }
 
 METAL_INTERNAL METAL(kernel) void
 tiles(
-    METAL(constant) Uniform& uniform        METAL([[buffer(0)]]),
-    METAL(constant) Light_Info& light_info  METAL([[buffer(1)]]),
-    METAL(constant) Material* materials     METAL([[buffer(2)]]),
-    METAL(constant) Edit_Info& edit_info    METAL([[buffer(3)]]),
-    METAL(device)   u32* pixels             METAL([[buffer(4)]]),
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   u32* pixels             METAL([[buffer(1)]]),
     ushort2 tid                             METAL([[thread_position_in_grid]]),
-    ushort2 gs                              METAL([[threads_per_grid]]))
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
 {
     for (u16 y = tid.y; y < gs.y; ++y)
     for (u16 x = tid.x; x < gs.x; ++x)
@@ -404,8 +1321,8 @@ tiles(
         v3 color = v3(0.0, 0.0, 0.0);
         if (x == tid.x ||
             y == tid.y ||
-            x == uniform.viewport_size.x-1 ||
-            y == uniform.viewport_size.y-1) {
+            x == frame.output_size.x-1 ||
+            y == frame.output_size.y-1) {
             color = v3(0.0, 1.0, 0.0) * 0.5;
         } else continue;
 
@@ -414,7 +1331,113 @@ tiles(
         const u8 B = saturate(color.z) * 255.0;
         const u8 A = 255;
 
-        const s32 index = y * uniform.viewport_size.x + x;
+        const s32 index = y * frame.output_size.x + x;
         pixels[index] = ((R << 0) | (G << 8) | (B << 16) | (A << 24));
     }
 }
+
+// Fills the texels of a shadow map whose rays pass through 'region' with the
+// distance to the first surface. Everything else keeps what it had.
+METAL_INTERNAL METAL(kernel) void
+shadowMapBuild(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(constant) Shadow_Map& map         METAL([[buffer(1)]]),
+    METAL(constant) Bounds& region          METAL([[buffer(2)]]),
+    METAL(device)   f32* depths             METAL([[buffer(3)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Edit_Info& edit_info = frame.edit_info;
+    METAL(constant) Compiled_Scene& compiled = frame.compiled;
+
+    const auto scene = (Scene) { edit_info, compiled, work };
+    const March march = { SHADOW_RELAXATION, 0.0 };
+    const s32 maxStepCount = 128;
+
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
+        const v2 uv = (v2(x, y) + 0.5) / SHADOW_MAP_SIZE * 2.0 - 1.0;
+        const v3 rd = normalize(map.forward + (map.right * uv.x + map.up * uv.y) * map.tan_half_angle);
+
+        const v2 range = clipRay(map.position, rd, 0.0, map.far, region);
+        if (range.x >= range.y) continue;
+
+        COUNT_WORK(scene.work, WORK_SHADOW_RAYS, 1);
+        const auto hit = castRay(map.position, rd, maxStepCount, 0.0, map.far, 1.0, scene, march);
+        depths[y * SHADOW_MAP_SIZE + x] = hit.t < map.far ? hit.t : FLT_MAX;
+    }
+}
+
+// Traces the probes in the slots listed in 'updates', one thread per entry. Rays
+// that hit something see that surface lit by the direct lights and the sky, rays
+// that miss see the sky.
+METAL_INTERNAL METAL(kernel) void
+updateProbes(
+    METAL(constant) Frame_Constants& frame  METAL([[buffer(0)]]),
+    METAL(device)   Probe* probes           METAL([[buffer(1)]]),
+    METAL(device)   s32* updates            METAL([[buffer(2)]]),
+    ushort2 tid                             METAL([[thread_position_in_grid]]),
+    ushort2 gs                              METAL([[threads_per_grid]]),
+    Worker_Work* work)
+{
+    METAL(constant) Uniform& uniform = frame.uniform;
+    METAL(constant) Light_Info& light_info = frame.light_info;
+    METAL(constant) Light_Clusters* clusters = frame.clusters;
+    METAL(constant) Shadow_Maps* shadow_maps = frame.shadow_maps;
+    METAL(device) f32* shadow_depths = frame.shadow_depths;
+    METAL(constant) Material* materials = frame.materials;
+    METAL(constant) Edit_Info& edit_info = frame.edit_info;
+    METAL(constant) Compiled_Scene& compiled = frame.compiled;
+
+    const auto scene = (Scene) { edit_info, compiled, work };
+    const March march = { SECONDARY_RELAXATION, 0.0 };
+    const s32 maxStepCount = 64;
+
+    for (u16 y = tid.y; y < gs.y; ++y)
+    for (u16 x = tid.x; x < gs.x; ++x)
+    {
+        METAL(device) Probe& probe = probes[updates[x]];
+        const v3 P = v3(probe.cell[0], probe.cell[1], probe.cell[2]) * PROBE_SPACING;
+
+        if (map(P, scene).x < 0.0)
+        {
+            probe.state = PROBE_INSIDE;
+            continue;
+        }
+
+        v3 sh[4] = { v3(0,0,0), v3(0,0,0), v3(0,0,0), v3(0,0,0) };
+        for (s32 i = 0; i < PROBE_RAYS; ++i)
+        {
+            // Spherical Fibonacci points spread the rays evenly
+            const f32 z = 1.0 - (2.0 * i + 1.0) / PROBE_RAYS;
+            const f32 r = sqrt(1.0 - z * z);
+            const f32 phi = i * 2.399963;
+            const v3 rd = v3(cos(phi) * r, z, sin(phi) * r);
+
+            v3 radiance = ambientLight(P, rd);
+            COUNT_WORK(scene.work, WORK_SECONDARY_RAYS, 1);
+            const auto hit = castRay(P, rd, maxStepCount, PIXEL_RADIUS, PROBE_RAY_LENGTH, 1.0, scene, march);
+            if (hit.t < PROBE_RAY_LENGTH)
+            {
+                const v3 H = P + rd * hit.t;
+                const v3 N = calcNormal(H, scene);
+                const METAL(constant) Material& material = materials[hit.material_id];
+
+                u32 seed = 0;
+                const v3 direct = directLighting(uniform, light_info, clusters, shadow_maps, shadow_depths, P, H, N, scene, PIXEL_RADIUS, 100.0, v3(-1,-1,-1), 0.0, seed);
+                radiance = material.color * (direct + ambientLight(H, N) + material.emission);
+            }
+
+            sh[0] += radiance * 0.282095;
+            sh[1] += radiance * (0.488603 * rd.y);
+            sh[2] += radiance * (0.488603 * rd.z);
+            sh[3] += radiance * (0.488603 * rd.x);
+        }
+
+        const f32 weight = 4.0 * PI / PROBE_RAYS;
+        for (s32 k = 0; k < 4; ++k) probe.sh[k] = sh[k] * weight;
+        probe.state = PROBE_VALID;
+    }
+}
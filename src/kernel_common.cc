@@ -3,6 +3,15 @@
 
 #define PIXEL_RADIUS 0.001
 
+// Over-relaxation factors used by the different kinds of rays
+#define PRIMARY_RELAXATION 1.6
+#define SECONDARY_RELAXATION 1.6
+#define SHADOW_RELAXATION 1.2
+
+#ifndef PI
+#define PI 3.141592653589793
+#endif
+
 METAL_INTERNAL f32 mod289(f32 x){return x - floor(x * (1.0 / 289.0)) * 289.0;}
 METAL_INTERNAL v4 mod289(v4 x){return x - floor(x * (1.0 / 289.0)) * 289.0;}
 METAL_INTERNAL v4 perm(v4 x){return mod289(((x * 34.0) + 1.0) * x);}
@@ -36,6 +45,29 @@ METAL_INTERNAL f32 hash21(v2 p)
     return fract(p.x * p.y);
 }
 
+// PCG hash (Jarzynski & Olano, "Hash Functions for GPU Rendering")
+METAL_INTERNAL u32 pcgHash(u32 v)
+{
+    u32 state = v * 747796405u + 2891336453u;
+    u32 word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Uniform random number in [0, 1). Advances the seed.
+METAL_INTERNAL f32 randomFloat(METAL(thread) u32& seed)
+{
+    seed = pcgHash(seed);
+    return (seed >> 8) * (1.0f / 16777216.0f);
+}
+
+METAL_INTERNAL v3 randomUnitVector(METAL(thread) u32& seed)
+{
+    const f32 z = randomFloat(seed) * 2.0f - 1.0f;
+    const f32 a = randomFloat(seed) * 2.0f * PI;
+    const f32 r = sqrt(1.0f - z * z);
+    return v3(r * cos(a), r * sin(a), z);
+}
+
 METAL_INTERNAL v3 mmod(v3 x, v3 y)
 {
     return x - y * floor(x / y);
@@ -166,10 +198,48 @@ pIntersect(v2 d2, v2 d1)
     return (d1.x > d2.x) ? d1 : d2;
 }
 
+// Distance to the closest primitive of a run that the compiler turned into one
+// OP_BATCH. The kind is switched on once, and each loop reads the centers one
+// coordinate array at a time so it can be vectorized.
+METAL_INTERNAL f32 batchDistance(v3 p, METAL(constant) Primitive_Batches& batches, OpKind kind, u32 first, u32 count, v3 size, f32 rounding)
+{
+    METAL(device) const f32* x = batches.x + first;
+    METAL(device) const f32* y = batches.y + first;
+    METAL(device) const f32* z = batches.z + first;
+
+    f32 result = FLT_MAX;
+    switch (kind)
+    {
+        case SD_SPHERE:
+            for (u32 i = 0; i < count; ++i) { const f32 d = sdSphere(p - v3(x[i], y[i], z[i]), size.x); result = d < result ? d : result; }
+            break;
+        case SD_BOX:
+            for (u32 i = 0; i < count; ++i) { const f32 d = sdBox(p - v3(x[i], y[i], z[i]), size); result = d < result ? d : result; }
+            break;
+        case SD_ROUND_BOX:
+            for (u32 i = 0; i < count; ++i) { const f32 d = sdRoundBox(p - v3(x[i], y[i], z[i]), size, rounding); result = d < result ? d : result; }
+            break;
+        case SD_TORUS:
+            for (u32 i = 0; i < count; ++i) { const f32 d = sdTorus(p - v3(x[i], y[i], z[i]), size.xy); result = d < result ? d : result; }
+            break;
+        case SD_CAPPED_CYLINDER:
+            for (u32 i = 0; i < count; ++i) { const f32 d = sdCappedCylinder(p - v3(x[i], y[i], z[i]), size.x, size.y); result = d < result ? d : result; }
+            break;
+        default: break;
+    }
+    return result;
+}
+
 // Return the distance and material id of the closest object hit in the scene.
+// 'footprint' is the size of a pixel at p. Compiled programs mark primitives with
+// OP_LOD, and those smaller than the footprint are replaced by their bounding
+// sphere. Blends narrower than the footprint become the hard operation, shifted
+// by the most a blend can take off so the distance stays a lower bound.
 // @Todo: Smoothing amount can be based on the edits pos.x
-v2 map(v3 p, Scene scene, v2 res = v2(FLT_MAX, 0.0))
+v2 map(v3 p, Scene scene, f32 footprint = 0.0)
 {
+    v2 res = v2(FLT_MAX, 0.0);
+
     // holds the temporary result of each operation
     v2 d;
 
@@ -178,27 +248,37 @@ v2 map(v3 p, Scene scene, v2 res = v2(FLT_MAX, 0.0))
 
     // state
     v3 size = v3(0.01,0.01,0.01);
-    f32 material_id = 11.0;
+    f32 material_id = DEFAULT_MATERIAL_ID;
     f32 rounding = 0.1;
 
-    auto count = scene.edit_info.count;
-    METAL(constant) auto& edits = scene.edit_info.edits;
+    const u32 count = scene.edit_info.count;
+    COUNT_WORK(scene.work, WORK_MAP_CALLS, 1);
+    COUNT_WORK(scene.work, WORK_EDITS, count);
 
     // clang-format off
-    for (s8 i = 0; i < count; ++i) {
-        METAL(constant) Edit& e = edits[i];
+    for (u32 i = 0; i < count; ++i) {
+        METAL(constant) Edit& e = edit_at(scene.edit_info, i);
         switch (e.kind) {
 
             case SET_SIZE:            size = e.data;                                                         break;
             case SET_MATERIAL_ID:     material_id = e.data.x;                                                break;
             case SET_ROUNDING:        rounding = e.data.x;                                                   break;
+            case OP_LOD:
+            {
+                if (footprint <= e.data.y) break;
+                // Subtracting a bounding sphere would carve out too much, so a
+                // subtracted primitive is dropped instead
+                const f32 distance = e.data.x < 0.0 ? FLT_MAX : length(pp - edit_at(scene.edit_info, i+1).data) - e.data.x;
+                d = v2(distance, material_id);
+                i += 1;
+            } break;
 
             case SD_TRIANGLE:
             {
                 // get the three next edits as vertices
                 v3 p1 = e.data;
-                v3 p2 = edits[i+1].data;
-                v3 p3 = edits[i+2].data;
+                v3 p2 = edit_at(scene.edit_info, i+1).data;
+                v3 p3 = edit_at(scene.edit_info, i+2).data;
                 d = v2(udTriangle(pp, p1, p2, p3)-PIXEL_RADIUS, material_id);
                 i += 2;
             } break;
@@ -209,12 +289,21 @@ v2 map(v3 p, Scene scene, v2 res = v2(FLT_MAX, 0.0))
             case SD_ROUND_BOX:        d = v2(sdRoundBox(pp - e.data, size, rounding), material_id);          break;
             case SD_TORUS:            d = v2(sdTorus(pp - e.data, size.xy), material_id);                    break;
             case SD_CAPPED_CYLINDER:  d = v2(sdCappedCylinder(pp - e.data, size.x, size.y), material_id);    break;
+            case OP_BATCH:
+            {
+                COUNT_WORK(scene.work, WORK_EDITS, (u32)e.data.z);
+                d = v2(batchDistance(pp, scene.compiled.batches, (OpKind)e.data.x, e.data.y, e.data.z, size, rounding), material_id);
+            } break;
             case OP_UNION:            res = pUnion(res, d);                                                 break;
             case OP_SUBTRACT:         res = pSub(res, d);                                                   break;
             case OP_INTERSECT:        res = pIntersect(res, d);                                             break;
-            case OP_SMOOTH_UNION:     res = pSmoothUnion(res, d, e.data.x);                                  break;
-            case OP_SMOOTH_SUBTRACT:  res = pSmoothSubtraction(res, d, e.data.x);                            break;
-            case OP_SMOOTH_INTERSECT: res = pSmoothIntersection(res, d, e.data.x);                           break;
+            case OP_SMOOTH_UNION:
+            {
+                if (e.data.x < footprint) res = pUnion(res, d) - v2(e.data.x * 0.25, 0.0);
+                else res = pSmoothUnion(res, d, e.data.x);
+            } break;
+            case OP_SMOOTH_SUBTRACT:  res = e.data.x < footprint ? pSub(res, d) : pSmoothSubtraction(res, d, e.data.x);            break;
+            case OP_SMOOTH_INTERSECT: res = e.data.x < footprint ? pIntersect(res, d) : pSmoothIntersection(res, d, e.data.x);     break;
 
             case OP_ROUNDED:          d.x -= e.data.x;                                                       break;
             case OP_ANNULAR:          d.x = fabs(d.x) - e.data.x;                                            break;
@@ -250,16 +339,212 @@ METAL_INTERNAL v3 calcNormal(v3 p, T scene)
     );
 }
 
+// Direction of the camera ray through a position in a res sized image.
+METAL_INTERNAL v3 cameraRay(METAL(constant) Uniform& uniform, v2 pixel, v2 res)
+{
+    v2 uv = SS2NDC(pixel, res);
+
+    uv.y *= -1; // we are software rendering, so we need to flip it manually.
+
+    return uniform.camera_matrix * normalize(v3(uv.x, uv.y, uniform.camera_zoom));
+}
+
+// Primary ray through a pixel of the viewport, offset by this frame's jitter.
+METAL_INTERNAL v3 primaryRay(METAL(constant) Uniform& uniform, v2 pixel)
+{
+    return cameraRay(uniform, pixel + uniform.jitter, v2(uniform.viewport_size.x, uniform.viewport_size.y));
+}
+
+// Inverse of cameraRay: the position in a res sized image that P projects to, and
+// in z its depth along the view axis, which is negative behind the camera.
+METAL_INTERNAL v3 projectToPixel(METAL(constant) Uniform& uniform, v3 P, v2 res)
+{
+    const v3 v = transpose(uniform.camera_matrix) * (P - uniform.camera_position);
+    v2 uv = v2(v.x, v.y) * (uniform.camera_zoom / v.z);
+    uv.y *= -1;
+    const v2 pixel = uv * res.y + res * 0.5;
+    return v3(pixel.x, pixel.y, v.z);
+}
+
+// Angle subtended by a single pixel, used for footprint relative termination.
+METAL_INTERNAL f32 pixelAngle(METAL(constant) Uniform& uniform)
+{
+    return 1.0 / (uniform.viewport_size.y * uniform.camera_zoom);
+}
+
+// Rays stop within the radius of the pixel's footprint, half its angle. Stopping
+// within the whole angle grows every silhouette and shadow by a pixel on each side.
+METAL_INTERNAL f32 marchEpsilon(f32 t, March march)
+{
+    return march.pixel_angle > 0.0 ? t * march.pixel_angle * 0.5 : PIXEL_RADIUS;
+}
+
+// Enhanced sphere tracing (Keinert et al. 2014). Steps are scaled by the relaxation
+// factor, and whenever the unbounding spheres of two consecutive samples no longer
+// overlap we step back and continue with plain sphere tracing. If the step budget
+// runs out, the sample closest to the surface relative to its epsilon is returned.
 template <class T>
-METAL_INTERNAL Hit castRay(v3 ro, v3 rd, s32 steps, f32 t_min, f32 t_max, f32 side, T scene)
+METAL_INTERNAL Hit sphereTrace(v3 ro, v3 rd, s32 steps, f32 t_min, f32 t_max, f32 side, T scene, March march)
 {
     Hit hit = { t_min, 0, 0 };
-    for (s32 i = 0; i < steps && (hit.t < t_max || abs(hit.t) < t_min); ++i)
+    Hit candidate = hit;
+    f32 candidate_error = FLT_MAX;
+
+    f32 omega = march.relaxation;
+    f32 previous_radius = 0.0;
+    f32 step_length = 0.0;
+
+    s32 i = 0;
+    for (; i < steps; ++i)
     {
-        const v2 r = map(ro+rd*hit.t, scene);
-        hit.t += r.x * side;
+        // The level of detail only keeps distances lower bounds outside of objects
+        const v2 r = map(ro+rd*hit.t, scene, side > 0.0 ? hit.t * march.pixel_angle : 0.0);
+        const f32 signed_radius = r.x * side;
+        const f32 radius = fabs(signed_radius);
+
+        const bool relaxation_failed = omega > 1.0 && (radius + previous_radius) < step_length;
+        if (relaxation_failed)
+        {
+            step_length -= omega * step_length;
+            omega = 1.0;
+        }
+        else
+        {
+            step_length = signed_radius * omega;
+
+            // A relaxed step past t_max would never be checked, only a plain step is known to be safe
+            if (hit.t + step_length > t_max) step_length = signed_radius;
+        }
+        previous_radius = radius;
+
         hit.material_id = (s16)(r.y);
         hit.steps = (s16)(i);
+
+        const f32 error = radius / marchEpsilon(hit.t, march);
+        if (!relaxation_failed && error < candidate_error)
+        {
+            candidate = hit;
+            candidate_error = error;
+        }
+        if ((!relaxation_failed && error < 1.0) || hit.t > t_max) break;
+
+        hit.t += step_length;
+    }
+
+    COUNT_WORK(scene.work, WORK_MARCH_STEPS, i < steps ? i + 1 : steps);
+
+    if (i == steps && hit.t <= t_max)
+    {
+        candidate.steps = (s16)(i);
+        return candidate;
+    }
+    return hit;
+}
+
+// Ray intersections with the analytic primitives. They return the entry and exit
+// distances along the ray, or v2(-1,-1) on a miss.
+METAL_INTERNAL v2 iSphere(v3 ro, v3 rd, v3 center, f32 radius)
+{
+    const v3 oc = ro - center;
+    const f32 b = dot(oc, rd);
+    const f32 c = dot(oc, oc) - radius * radius;
+    f32 h = b * b - c;
+    if (h < 0.0) return v2(-1.0, -1.0);
+    h = sqrt(h);
+    return v2(-b - h, -b + h);
+}
+
+METAL_INTERNAL v2 iBox(v3 ro, v3 rd, v3 center, v3 size)
+{
+    // Keep axis aligned rays away from 0 * inf
+    const v3 m = 1.0 / v3(fabs(rd.x) < 1e-8 ? 1e-8 : rd.x, fabs(rd.y) < 1e-8 ? 1e-8 : rd.y, fabs(rd.z) < 1e-8 ? 1e-8 : rd.z);
+    const v3 n = m * (ro - center);
+    const v3 k = fabs(m) * size;
+    const v3 t1 = -n - k;
+    const v3 t2 = -n + k;
+    const f32 t_near = max(max(t1.x, t1.y), t1.z);
+    const f32 t_far = min(min(t2.x, t2.y), t2.z);
+    if (t_near > t_far || t_far < 0.0) return v2(-1.0, -1.0);
+    return v2(t_near, t_far);
+}
+
+// The solid side of a plane is dot(p, n) < h.
+METAL_INTERNAL v2 iPlane(v3 ro, v3 rd, v3 n, f32 h)
+{
+    const f32 d = dot(ro, n) - h;
+    const f32 rate = dot(rd, n);
+    if (d < 0.0) return v2(-FLT_MAX, rate > 0.0 ? -d / rate : FLT_MAX);
+    if (rate >= 0.0) return v2(-1.0, -1.0);
+    return v2(-d / rate, FLT_MAX);
+}
+
+METAL_INTERNAL v2 intersectPrimitive(v3 ro, v3 rd, METAL(constant) Analytic_Primitive& primitive)
+{
+    switch (primitive.kind) {
+        case SD_SPHERE: return iSphere(ro, rd, primitive.data, primitive.size.x);
+        case SD_BOX:    return iBox(ro, rd, primitive.data, primitive.size);
+        case SD_PLANE:  return iPlane(ro, rd, primitive.data, primitive.size.x);
+        default:        return v2(-1.0, -1.0);
+    }
+}
+
+// Closest analytic hit in [t_min, t_max). A ray starting inside a primitive hits at t_min.
+METAL_INTERNAL Hit intersectAnalytic(v3 ro, v3 rd, f32 t_min, f32 t_max, METAL(constant) Compiled_Scene& compiled)
+{
+    Hit hit = { t_max, 0, 0 };
+    for (u32 i = 0; i < compiled.analytic_count; ++i)
+    {
+        METAL(constant) Analytic_Primitive& primitive = compiled.analytic[i];
+        const v2 t = intersectPrimitive(ro, rd, primitive);
+        if (t.y < t_min) continue;
+        const f32 t_hit = max(t.x, t_min);
+        if (t_hit < hit.t)
+        {
+            hit.t = t_hit;
+            hit.material_id = (s16)(primitive.material_id);
+        }
+    }
+    return hit;
+}
+
+// Clips [t_min, t_max] to the part of the ray inside the bounds. The returned range
+// is empty (x >= y) when the ray misses them.
+METAL_INTERNAL v2 clipRay(v3 ro, v3 rd, f32 t_min, f32 t_max, METAL(constant) Bounds& bounds)
+{
+    if (bounds.is_unbounded) return v2(t_min, t_max);
+    if (bounds.min.x > bounds.max.x) return v2(t_max, t_max);
+
+    const v2 t = iBox(ro, rd, (bounds.min + bounds.max) * 0.5, (bounds.max - bounds.min) * 0.5);
+    if (t.y < 0.0) return v2(t_max, t_max);
+    return v2(max(t_min, t.x), min(t_max, t.y));
+}
+
+// Hybrid tracer. Hard unioned analytic primitives are intersected exactly and only
+// the residual program is sphere traced, clamped to the analytic hit.
+// Rays travelling inside objects (side < 0) trace the whole program.
+template <class T>
+METAL_INTERNAL Hit castRay(v3 ro, v3 rd, s32 steps, f32 t_min, f32 t_max, f32 side, T scene, March march = (March) { 1.0, 0.0 })
+{
+    if (side < 0.0) return sphereTrace(ro, rd, steps, t_min, t_max, side, scene, march);
+
+    const Hit analytic = intersectAnalytic(ro, rd, t_min, t_max, scene.compiled);
+
+    // Only march the part of the ray that can reach the residual, a miss keeps
+    // t = t_max so callers can still compare against their far clip.
+    Hit hit = { t_max, 0, 0 };
+    const v2 range = clipRay(ro, rd, t_min, analytic.t, scene.compiled.residual_bounds);
+    if (scene.compiled.residual_primitive_count > 0 && range.x < range.y)
+    {
+        const auto residual = (Scene) { scene.compiled.residual, scene.compiled, scene.work };
+        const Hit traced = sphereTrace(ro, rd, steps, range.x, range.y, 1.0, residual, march);
+        if (traced.t < range.y) return traced;
+        hit.steps = traced.steps;
+    }
+
+    if (analytic.t < t_max)
+    {
+        hit.t = analytic.t;
+        hit.material_id = analytic.material_id;
     }
     return hit;
 }
@@ -280,13 +565,13 @@ METAL_INTERNAL v3 ACES(v3 x)
     return (x * (a * x + b)) / (x * (c * x + d) + e);
 }
 template <class T>
-METAL_INTERNAL f32 ambientOcclusion(v3 p, v3 n, T scene)
+METAL_INTERNAL f32 ambientOcclusion(v3 p, v3 n, T scene, s32 samples = 5)
 {
     f32 stepDist = 0.2;
     f32 maxDist = 8.0;
-    s32 samples = 5;
     f32 sca = 1.0;
     f32 ao = 0.0;
+    COUNT_WORK(scene.work, WORK_AO_RAYS, 1);
     for (s32 i = 1; i <= samples; ++i) {
         f32 h = stepDist * i / maxDist;
         f32 d = map(p + n * h, scene).x;
@@ -297,25 +582,56 @@ METAL_INTERNAL f32 ambientOcclusion(v3 p, v3 n, T scene)
 }
 
 template <class T>
-METAL_INTERNAL f32 shadow(v3 ro, v3 rd, f32 nearClip, f32 farClip, T scene)
+METAL_INTERNAL f32 shadow(v3 ro, v3 rd, f32 nearClip, f32 farClip, T scene, March march = (March) { 1.0, 0.0 })
 #ifdef SOFT_SHADOWS
 {
+    COUNT_WORK(scene.work, WORK_SHADOW_RAYS, 1);
     f32 res = 1.0;
     f32 k = 32.0;
+    f32 omega = march.relaxation;
+    f32 previous_h = 0.0;
+    f32 step_length = 0.0;
     for (f32 t = nearClip; t < farClip;) {
         f32 h = map(ro + rd * t, scene).x;
-        if (h < nearClip) return 0.0;
-        res = min(res, k * h / t);
-        t += h;
+        COUNT_WORK(scene.work, WORK_MARCH_STEPS, 1);
+        if (omega > 1.0 && (h + previous_h) < step_length) {
+            step_length -= omega * step_length;
+            omega = 1.0;
+        } else {
+            if (h < max(nearClip, marchEpsilon(t, march))) return 0.0;
+            res = min(res, k * h / t);
+            step_length = h * omega;
+        }
+        previous_h = h;
+        t += step_length;
     }
     return res;
 }
 #else
 {
-    for (f32 t = nearClip; t < farClip;) {
-        f32 h = map(ro + rd * t, scene).x;
-        if (h < nearClip) return 0.0;
-        t += h;
+    // Hard shadows only need to know if anything is in the way, so the analytic
+    // primitives are tested in closed form and only the residual is marched.
+    COUNT_WORK(scene.work, WORK_SHADOW_RAYS, 1);
+    if (intersectAnalytic(ro, rd, nearClip, farClip, scene.compiled).t < farClip) return 0.0;
+    if (scene.compiled.residual_primitive_count == 0) return 1.0;
+    const auto residual = (Scene) { scene.compiled.residual, scene.compiled, scene.work };
+
+    const v2 range = clipRay(ro, rd, nearClip, farClip, scene.compiled.residual_bounds);
+    f32 omega = march.relaxation;
+    f32 previous_h = 0.0;
+    f32 step_length = 0.0;
+    for (f32 t = range.x; t < range.y;) {
+        f32 h = map(ro + rd * t, residual).x;
+        COUNT_WORK(scene.work, WORK_MARCH_STEPS, 1);
+        if (omega > 1.0 && (h + previous_h) < step_length) {
+            step_length -= omega * step_length;
+            omega = 1.0;
+        } else {
+            if (h < max(nearClip, marchEpsilon(t, march))) return 0.0;
+            step_length = h * omega;
+        }
+        previous_h = h;
+        t += step_length;
     }
     return 1.0;
 }
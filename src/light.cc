@@ -0,0 +1,93 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Contribution below which a light is considered out of range. Lights fade to
+// zero at their radius (see lightFalloff), so this has to stay small enough that
+// the window is invisible at the distances lights are placed at.
+#define LIGHT_THRESHOLD 0.001
+
+// Distance where intensity * color / d^2 drops below LIGHT_THRESHOLD.
+internal f32 light_radius(Light light)
+{
+    const f32 brightest = max(light.color.x, max(light.color.y, light.color.z));
+    return sqrt(max(light.intensity * brightest, 0.0f) / LIGHT_THRESHOLD);
+}
+
+// View space bounds of a cluster. Tiles are cut in the same normalized screen
+// coordinates the kernels use (see SS2NDC), with y pointing up and row 0 on top.
+internal Bounds cluster_bounds(s32 x, s32 y, s32 z, f32 aspect, f32 zoom)
+{
+    const f32 u0 = ((f32)x / CLUSTER_X - 0.5) * aspect;
+    const f32 u1 = ((f32)(x + 1) / CLUSTER_X - 0.5) * aspect;
+    const f32 v0 = 0.5 - (f32)(y + 1) / CLUSTER_Y;
+    const f32 v1 = 0.5 - (f32)y / CLUSTER_Y;
+
+    const f32 ratio = CLUSTER_FAR / CLUSTER_NEAR;
+    const f32 z0 = CLUSTER_NEAR * pow(ratio, (f32)z / CLUSTER_Z);
+    const f32 z1 = CLUSTER_NEAR * pow(ratio, (f32)(z + 1) / CLUSTER_Z);
+
+    // The tile is a frustum, so its extent in x and y is largest at either depth.
+    const f32 s0 = z0 / zoom;
+    const f32 s1 = z1 / zoom;
+    return (Bounds)
+    {
+        v3(min(u0 * s0, u0 * s1), min(v0 * s0, v0 * s1), z0),
+        v3(max(u1 * s0, u1 * s1), max(v1 * s0, v1 * s1), z1),
+        false
+    };
+}
+
+// Bins every light into the clusters its influence sphere touches. Clusters
+// that would take more than MAX_LIGHTS_PER_CLUSTER lights drop the rest.
+internal void assign_lights(Uniform* uniform, Light_Info* light_info, Light_Clusters* clusters)
+{
+    memset(clusters->count, 0, sizeof(clusters->count));
+
+    const mat3 to_view = transpose(uniform->camera_matrix);
+    const f32 aspect = (f32)uniform->viewport_size.x / (f32)uniform->viewport_size.y;
+
+    v3 centers[MAX_LIGHTS];
+    f32 radii[MAX_LIGHTS];
+    foreach(i, light_info->count)
+    {
+        Light* light = &light_info->lights[i];
+        light->radius = light_radius(*light);
+        centers[i] = to_view * (light->pos - uniform->camera_position);
+        radii[i] = light->radius;
+    }
+
+    foreach(z, CLUSTER_Z)
+    foreach(y, CLUSTER_Y)
+    foreach(x, CLUSTER_X)
+    {
+        const Bounds b = cluster_bounds(x, y, z, aspect, uniform->camera_zoom);
+        const s32 cluster = (z * CLUSTER_Y + y) * CLUSTER_X + x;
+
+        u8 count = 0;
+        foreach(i, light_info->count)
+        {
+            const v3 d = centers[i] - clamp(centers[i], b.min, b.max);
+            if (dot(d, d) > radii[i] * radii[i]) continue;
+            if (count == MAX_LIGHTS_PER_CLUSTER) break;
+            clusters->lights[cluster][count++] = (u8)i;
+        }
+        clusters->count[cluster] = count;
+    }
+}
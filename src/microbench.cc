@@ -0,0 +1,273 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Throughput of the primitives, operators and noise in kernel_common.cc, in
+// evaluations per nanosecond over a fixed set of random points. Every function is
+// timed one point at a time, and the primitives map() also evaluates in batches
+// are timed a second time through batchDistance itself:
+//
+//   scalar  one call per point from an array of v3, with vectorizing across
+//           points disabled, the way map() calls a primitive on its own
+//   batch   one batchDistance over the points as the centers of a batch, the
+//           way map() runs an OP_BATCH
+//
+// The batch's distance must be the smallest of the scalar ones, so a change that
+// only breaks one path shows up. The batch column only measures vectorized code
+// when the compiler vectorized batchDistance's loops, the microbench script
+// fails the build when it reports that it didn't.
+//
+//   ./microbench [--filter sdBox] [--points 4096] [--time 50]
+//                [--out microbench.jsonl] [--baseline microbench_baseline.jsonl] [--threshold 5]
+#include <math.h>
+
+#include "common.h"
+#include "bench_common.h"
+
+#define WORK_COUNTERS 0
+
+#include "shader_common.h"
+#include "utility.cc"
+#include "counters.cc"
+#include "kernel_common.cc"
+
+#if defined(__clang__)
+#define SCALAR_LOOP _Pragma("clang loop vectorize(disable) interleave(disable)")
+#elif defined(__GNUC__) && __GNUC__ >= 14
+#define SCALAR_LOOP _Pragma("GCC novector")
+#else
+#define SCALAR_LOOP
+#endif
+
+#define MAX_MICROBENCH_RESULTS 64
+#define MICROBENCH_TRIALS 5 // the fastest trial is kept
+
+// The points, and where the results go
+struct Point_Set
+{
+    v3* points;
+    Primitive_Batches batches; // centers at minus the points, so batchDistance from the origin sees the points
+    f32* scalar_out;
+    f32 batch_out;
+    s32 count;
+};
+
+// Uniform in [-2, 2]^3 with a fixed seed, so every run sees the same points
+internal Point_Set make_point_set(s32 count)
+{
+    Point_Set set = {};
+    set.points = (v3*)malloc(count * sizeof(v3));
+    set.batches.x = (f32*)malloc(count * sizeof(f32));
+    set.batches.y = (f32*)malloc(count * sizeof(f32));
+    set.batches.z = (f32*)malloc(count * sizeof(f32));
+    set.batches.count = set.batches.capacity = count;
+    set.scalar_out = (f32*)malloc(count * sizeof(f32));
+    set.count = count;
+
+    u32 seed = 1;
+    foreach(i, count)
+    {
+        const v3 p = v3(randomFloat(seed), randomFloat(seed), randomFloat(seed)) * 4.0 - 2.0;
+        set.points[i] = p;
+        set.batches.x[i] = -p.x;
+        set.batches.y[i] = -p.y;
+        set.batches.z[i] = -p.z;
+    }
+    return set;
+}
+
+template <class F>
+internal void eval_scalar(F f, const v3* points, f32* out, s32 count)
+{
+    SCALAR_LOOP
+    for (s32 i = 0; i < count; ++i) out[i] = f(points[i]);
+}
+
+// How batchDistance is called for a primitive, see OP_BATCH
+struct Batch_Call
+{
+    OpKind kind; // _NONE_ when map() never batches the function
+    v3 size;
+    f32 rounding;
+};
+
+struct Microbench_Result
+{
+    char name[32];
+    f64 scalar; // evaluations per ns
+    f64 batch;  // 0 when the function isn't batched
+    f32 difference; // between the batch's distance and the smallest scalar one
+};
+
+// Repeats a pass over the points until it has taken 'min_time' ns, and returns
+// the evaluations per ns of the fastest of a few such trials.
+template <class F>
+internal f64 measure(F pass, s32 count, u64 min_time)
+{
+    f64 best = 0.0;
+    foreach(trial, MICROBENCH_TRIALS)
+    {
+        u64 evaluations = 0;
+        const u64 start = wall_time();
+        u64 elapsed = 0;
+        do
+        {
+            pass();
+            evaluations += count;
+            elapsed = wall_time() - start;
+        } while (elapsed < min_time);
+
+        const f64 rate = (f64)evaluations / elapsed;
+        best = rate > best ? rate : best;
+    }
+    return best;
+}
+
+template <class F>
+internal Microbench_Result run_microbench(const char* name, F f, Batch_Call batch, Point_Set* set, u64 min_time)
+{
+    Microbench_Result result = {};
+    snprintf(result.name, sizeof(result.name), "%s", name);
+    result.scalar = measure([&]() { eval_scalar(f, set->points, set->scalar_out, set->count); }, set->count, min_time);
+    if (batch.kind == _NONE_) return result;
+
+    result.batch = measure([&]() { set->batch_out = batchDistance(v3(0.0, 0.0, 0.0), set->batches, batch.kind, 0, set->count, batch.size, batch.rounding); }, set->count, min_time);
+
+    f32 closest = FLT_MAX;
+    foreach(i, set->count) closest = set->scalar_out[i] < closest ? set->scalar_out[i] : closest;
+    result.difference = fabs(closest - set->batch_out);
+    return result;
+}
+
+// Reads a line main writes, it is not a general JSON parser
+internal b32 parse_microbench_result(const char* line, Microbench_Result* r)
+{
+    return sscanf(line, "{\"name\":\"%31[^\"]\",\"scalar\":%lf,\"batch\":%lf}", r->name, &r->scalar, &r->batch) == 3;
+}
+
+s32 main(s32 argc, char** argv)
+{
+    const char* filter = NULL;
+    s32 point_count = 4096; // small enough to stay in cache, so the math is what's measured
+    f64 time_ms = 50.0;
+    const char* out_path = "microbench.jsonl";
+    const char* baseline_path = NULL;
+    f64 threshold = 5.0; // percent throughput may drop before it counts as a regression
+
+    Bench_Arg args[] = {
+        { "--filter",    ARG_STRING, &filter },
+        { "--points",    ARG_S32,    &point_count },
+        { "--time",      ARG_F64,    &time_ms },
+        { "--out",       ARG_STRING, &out_path },
+        { "--baseline",  ARG_STRING, &baseline_path },
+        { "--threshold", ARG_F64,    &threshold },
+    };
+    if (!parse_bench_args(argc, argv, args, array_count(args))) return 1;
+    if (point_count < 1)
+    {
+        printf("points must be at least 1\n");
+        return 1;
+    }
+
+    static Microbench_Result baseline[MAX_MICROBENCH_RESULTS];
+    const s32 baseline_count = baseline_path ? read_baseline(baseline_path, baseline, MAX_MICROBENCH_RESULTS, parse_microbench_result) : 0;
+    if (baseline_count < 0) return 1;
+
+    Point_Set set = make_point_set(point_count);
+    const u64 min_time = (u64)(time_ms * 1e6 / MICROBENCH_TRIALS);
+
+    static Microbench_Result results[MAX_MICROBENCH_RESULTS];
+    s32 result_count = 0;
+
+    // Blend operators take p.x and p.y as the two distances, and domain operators
+    // return the sum of the point they map to. A batched primitive is given the
+    // size and rounding its expression uses.
+#define MICROBENCH_BATCH(name, kind, size, rounding, expression) \
+    if (!filter || strstr(name, filter)) results[result_count++] = run_microbench(name, [](v3 p) -> f32 { return expression; }, (Batch_Call) { kind, size, rounding }, &set, min_time)
+#define MICROBENCH(name, expression) MICROBENCH_BATCH(name, _NONE_, v3(0.0, 0.0, 0.0), 0.0, expression)
+
+    MICROBENCH_BATCH("sdBox",            SD_BOX,             v3(0.5, 0.3, 0.4), 0.0, sdBox(p, v3(0.5, 0.3, 0.4)));
+    MICROBENCH_BATCH("sdRoundBox",       SD_ROUND_BOX,       v3(0.5, 0.3, 0.4), 0.1, sdRoundBox(p, v3(0.5, 0.3, 0.4), 0.1));
+    MICROBENCH_BATCH("sdCappedCylinder", SD_CAPPED_CYLINDER, v3(0.5, 1.0, 0.0), 0.0, sdCappedCylinder(p, 0.5, 1.0));
+    MICROBENCH_BATCH("sdTorus",          SD_TORUS,           v3(1.0, 0.25, 0.0), 0.0, sdTorus(p, v2(1.0, 0.25)));
+    MICROBENCH_BATCH("sdSphere",         SD_SPHERE,          v3(1.0, 0.0, 0.0), 0.0, sdSphere(p, 1.0));
+    MICROBENCH("udTriangle",          udTriangle(p, v3(-1.0, 0.0, 0.0), v3(1.0, 0.0, 0.0), v3(0.0, 1.0, 0.5)));
+    MICROBENCH("sdPlane",             sdPlane(p, v3(0.0, 1.0, 0.0), 0.5));
+    MICROBENCH("pUnion",              pUnion(v2(p.x, 1.0), v2(p.y, 2.0)).x);
+    MICROBENCH("pSub",                pSub(v2(p.x, 1.0), v2(p.y, 2.0)).x);
+    MICROBENCH("pIntersect",          pIntersect(v2(p.x, 1.0), v2(p.y, 2.0)).x);
+    MICROBENCH("pSmoothUnion",        pSmoothUnion(v2(p.x, 1.0), v2(p.y, 2.0), 0.3).x);
+    MICROBENCH("pSmoothSubtraction",  pSmoothSubtraction(v2(p.x, 1.0), v2(p.y, 2.0), 0.3).x);
+    MICROBENCH("pSmoothIntersection", pSmoothIntersection(v2(p.x, 1.0), v2(p.y, 2.0), 0.3).x);
+    MICROBENCH("opRep",               dot(opRep(p, v3(1.5, 1.5, 1.5)), v3(1, 1, 1)));
+    MICROBENCH("rotateX",             dot(rotateX(p, 0.7), v3(1, 1, 1)));
+    MICROBENCH("rotateY",             dot(rotateY(p, 0.7), v3(1, 1, 1)));
+    MICROBENCH("rotateZ",             dot(rotateZ(p, 0.7), v3(1, 1, 1)));
+    MICROBENCH("noise",               noise(p));
+    MICROBENCH("hash21",              hash21(v2(p.x, p.y)));
+
+#undef MICROBENCH
+#undef MICROBENCH_BATCH
+
+    FILE* out = open_results(out_path);
+    if (!out) return 1;
+
+    printf("%-20s %10s %10s %8s", "evaluations/ns", "scalar", "batch", "speedup");
+    if (baseline_count) printf(" %9s %9s", "scalar", "batch");
+    printf("\n");
+
+    s32 regressions = 0;
+    s32 mismatches = 0;
+    foreach(i, result_count)
+    {
+        Microbench_Result* r = &results[i];
+        fprintf(out, "{\"name\":\"%s\",\"scalar\":%.4f,\"batch\":%.4f}\n", r->name, r->scalar, r->batch);
+        printf("%-20s %10.3f", r->name, r->scalar);
+        if (r->batch > 0.0) printf(" %10.3f %7.2fx", r->batch, r->batch / r->scalar);
+        else                printf(" %10s %8s", "-", "-");
+
+        foreach(j, baseline_count)
+        {
+            Microbench_Result* b = &baseline[j];
+            if (strcmp(b->name, r->name) != 0) continue;
+
+            const b32 regressed = print_change(r->scalar, b->scalar) < -threshold | print_change(r->batch, b->batch) < -threshold;
+            if (regressed) printf("  REGRESSION");
+            regressions += regressed;
+            break;
+        }
+
+        // The batch may round differently, anything more is a bug
+        if (r->difference > 1e-3)
+        {
+            printf("  MISMATCH %g", r->difference);
+            mismatches++;
+        }
+        printf("\n");
+    }
+
+    if (!close_results(out, out_path)) return 1;
+
+    if (mismatches)
+    {
+        printf("%d primitives gave a different distance through batchDistance\n", mismatches);
+        return 3;
+    }
+    return report_regressions(regressions, "functions", threshold);
+}
@@ -0,0 +1,228 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// The debug overlay. The main thread only formats its text into the frame arena,
+// the drawing is a kernel over the output tiles run after post.
+#define OVERLAY_MAX_TEXTS 64
+#define OVERLAY_LINE_HEIGHT (GLYPH_HEIGHT + 5)
+
+#define FRAME_GRAPH_LENGTH 128 // frames
+#define FRAME_GRAPH_BAR_WIDTH 2
+#define FRAME_GRAPH_HEIGHT 64
+#define FRAME_BUDGET_MS (1000.0f / 60.0f)
+
+// The kernel times stacked in each bar of the graph, the rest of the frame is
+// drawn above them
+enum Graph_Series
+{
+    GRAPH_GEOMETRY,
+    GRAPH_SHADING,
+    GRAPH_AA,
+    GRAPH_PROBES,
+    GRAPH_POST, // TAA and post
+    GRAPH_SERIES_COUNT,
+};
+
+global_variable const char* graph_series_names[GRAPH_SERIES_COUNT] = { "geometry", "shading", "aa", "probes", "post" };
+
+internal inline u32 pack_color(u8 R, u8 G, u8 B)
+{
+    return (R << 0) | (G << 8) | (B << 16) | (255u << 24);
+}
+
+global_variable const u32 graph_series_colors[GRAPH_SERIES_COUNT] =
+{
+    pack_color(255, 179, 186),
+    pack_color(186, 255, 201),
+    pack_color(186, 225, 255),
+    pack_color(255, 223, 186),
+    pack_color(255, 255, 186),
+};
+global_variable const u32 graph_rest_color = pack_color(128, 128, 128);
+global_variable const u32 graph_budget_color = pack_color(255, 255, 255);
+
+// The last FRAME_GRAPH_LENGTH frames, in ms. A single number for the frame time
+// hides the hitches, the graph shows them and which kernel they came from.
+struct Frame_Graph
+{
+    f32 frame[FRAME_GRAPH_LENGTH];
+    f32 kernels[FRAME_GRAPH_LENGTH][GRAPH_SERIES_COUNT];
+    u32 next;
+    u32 count;
+};
+
+// Times are in seconds, as the kernels are timed
+internal void record_frame(Frame_Graph* graph, f64 frame_time, const f64* kernel_times)
+{
+    graph->frame[graph->next] = frame_time * 1e3;
+    foreach(s, GRAPH_SERIES_COUNT) graph->kernels[graph->next][s] = kernel_times[s] * 1e3;
+    graph->next = (graph->next + 1) % FRAME_GRAPH_LENGTH;
+    if (graph->count < FRAME_GRAPH_LENGTH) graph->count++;
+}
+
+struct Overlay_Text
+{
+    u8* text;
+    s32 length;
+    s32 x, y;
+    u32 color;
+};
+
+struct Overlay
+{
+    Memory_Arena* arena; // holds the overlay and its text
+    Overlay_Text* texts;
+    s32 text_count;
+    s32 line_x, line_y; // where the next line goes
+
+    const Frame_Graph* graph; // not drawn when NULL
+    s32 graph_x, graph_y;     // top left
+    f32 graph_scale;          // ms at the top of the graph
+};
+
+internal Overlay* begin_overlay(Memory_Arena* arena, s32 x, s32 y)
+{
+    if (!glyph_atlas_built) build_glyph_atlas();
+
+    Overlay* overlay = push_struct(arena, Overlay);
+    *overlay = {};
+    overlay->arena = arena;
+    overlay->texts = push_array(arena, OVERLAY_MAX_TEXTS, Overlay_Text);
+    overlay->line_x = x;
+    overlay->line_y = y;
+    return overlay;
+}
+
+internal void overlay_vtext(Overlay* overlay, s32 x, s32 y, u32 color, const char* fmt, va_list args)
+{
+    if (overlay->text_count == OVERLAY_MAX_TEXTS) return;
+    Overlay_Text* text = &overlay->texts[overlay->text_count++];
+    text->text = push_vstrf(overlay->arena, fmt, args);
+    text->length = strlen((const char*)text->text);
+    text->x = x;
+    text->y = y;
+    text->color = color;
+}
+
+internal void overlay_text(Overlay* overlay, s32 x, s32 y, u32 color, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    overlay_vtext(overlay, x, y, color, fmt, args);
+    va_end(args);
+}
+
+// Adds a line below the previous one
+internal void overlay_line(Overlay* overlay, u32 color, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    overlay_vtext(overlay, overlay->line_x, overlay->line_y, color, fmt, args);
+    va_end(args);
+    overlay->line_y += OVERLAY_LINE_HEIGHT;
+}
+
+// Places the graph with its bottom left at (x, y), with the frame times and a
+// legend above it. The scale doubles from one frame at 60Hz until the slowest
+// frame fits.
+internal void overlay_graph(Overlay* overlay, const Frame_Graph* graph, s32 x, s32 y)
+{
+    f32 last = 0;
+    f32 slowest = 0;
+    foreach(i, graph->count) slowest = max(slowest, graph->frame[i]);
+    if (graph->count) last = graph->frame[(graph->next + FRAME_GRAPH_LENGTH - 1) % FRAME_GRAPH_LENGTH];
+
+    f32 scale = FRAME_BUDGET_MS;
+    while (scale < slowest) scale *= 2;
+
+    overlay->graph = graph;
+    overlay->graph_x = x;
+    overlay->graph_y = y - FRAME_GRAPH_HEIGHT;
+    overlay->graph_scale = scale;
+
+    s32 legend_x = x;
+    const s32 legend_y = overlay->graph_y - OVERLAY_LINE_HEIGHT;
+    foreach(s, GRAPH_SERIES_COUNT)
+    {
+        overlay_text(overlay, legend_x, legend_y, graph_series_colors[s], "%s", graph_series_names[s]);
+        legend_x += (strlen(graph_series_names[s]) + 1) * GLYPH_WIDTH;
+    }
+    overlay_text(overlay, x, legend_y - OVERLAY_LINE_HEIGHT, graph_rest_color, "frame: %.1fms max %.1fms /%.0fms", last, slowest, scale);
+}
+
+// Picks the color of a pixel of the graph, 'height' pixels above its bottom and
+// 'age' frames back. The pixel is kept, darkened, where there is no bar.
+internal inline u32 graph_pixel(const Overlay* overlay, s32 age, s32 height, u32 pixel)
+{
+    const Frame_Graph* graph = overlay->graph;
+    const f32 ms_per_pixel = overlay->graph_scale / FRAME_GRAPH_HEIGHT;
+    const f32 ms = (height + 0.5f) * ms_per_pixel;
+
+    if (age < (s32)graph->count)
+    {
+        const u32 sample = (graph->next + FRAME_GRAPH_LENGTH - 1 - age) % FRAME_GRAPH_LENGTH;
+        f32 top = 0;
+        foreach(s, GRAPH_SERIES_COUNT)
+        {
+            top += graph->kernels[sample][s];
+            if (ms < top) return graph_series_colors[s];
+        }
+        if (ms < graph->frame[sample]) return graph_rest_color;
+    }
+    if (height == (s32)ceilf(FRAME_BUDGET_MS / ms_per_pixel) - 1) return graph_budget_color;
+    return ((pixel >> 1) & 0x7f7f7f7f) | (255u << 24);
+}
+
+// Run over the output after post, each job draws the text and graph in its tile
+internal void
+drawOverlay(
+    Frame_Constants& frame,
+    Overlay* overlay,
+    u32* pixels,
+    ushort2 tid,
+    ushort2 gs,
+    Worker_Work* work)
+{
+    const u32 pitch = frame.output_size.x;
+
+    if (overlay->graph)
+    {
+        const s32 gx = overlay->graph_x;
+        const s32 gy = overlay->graph_y;
+        const s32 x0 = gx > tid.x ? gx : tid.x;
+        const s32 y0 = gy > tid.y ? gy : tid.y;
+        const s32 x1 = gx + FRAME_GRAPH_LENGTH * FRAME_GRAPH_BAR_WIDTH < gs.x ? gx + FRAME_GRAPH_LENGTH * FRAME_GRAPH_BAR_WIDTH : gs.x;
+        const s32 y1 = gy + FRAME_GRAPH_HEIGHT < gs.y ? gy + FRAME_GRAPH_HEIGHT : gs.y;
+        for (s32 y = y0; y < y1; ++y)
+        for (s32 x = x0; x < x1; ++x)
+        {
+            const s32 age = FRAME_GRAPH_LENGTH - 1 - (x - gx) / FRAME_GRAPH_BAR_WIDTH;
+            const s32 height = gy + FRAME_GRAPH_HEIGHT - 1 - y;
+            const s32 index = y * pitch + x;
+            pixels[index] = graph_pixel(overlay, age, height, pixels[index]);
+        }
+    }
+
+    foreach(i, overlay->text_count)
+    {
+        const Overlay_Text* text = &overlay->texts[i];
+        draw_text(pixels, pitch, text->text, text->length, text->x, text->y, text->color, tid, gs);
+    }
+}
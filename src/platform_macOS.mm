@@ -19,16 +19,22 @@
 // DEALINGS IN THE SOFTWARE.
 
 #include <mach/mach_time.h>
+#include <sys/event.h> // kqueue, kevent
 #include <sys/mman.h> // mmap
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <copyfile.h> // copyfile
+#include <fcntl.h> // open
 #include <unistd.h>
 
+#include <atomic>
+
 #import <QuartzCore/QuartzCore.h>
 #import <AppKit/AppKit.h>
 
 #include "common.h"
 #include "cello.h"
+#include "jobs.cc"
 
 #include <dlfcn.h> // dlopen, dlsym, dlerror
 
@@ -36,37 +42,110 @@ global_variable NSWindow* window;
 global_variable b32 cursor_is_locked = 0;
 
 
-internal u64 get_file_last_time_changed(char* path)
+#define GAME_CODE_DIRECTORY "."
+#define GAME_CODE_PATH "./cello.dylib"
+#define GAME_CODE_COPY_PATH "./cello_%u.dylib" // what each build is loaded from, see load_game_code
+
+internal u64 get_file_last_time_changed(const char* path)
 {
     struct stat s;
-    stat(path, &s);
-    return s.st_mtimespec.tv_nsec;
+    if (stat(path, &s) != 0) return 0;
+    return (u64)s.st_mtimespec.tv_sec * 1000000000ull + s.st_mtimespec.tv_nsec;
 }
 
 global_variable b32 (*game_update_and_render)(Game_Memory* memory) = NULL;
 global_variable void* game_code_dylib = NULL;
+global_variable char game_code_copy_path[64];
+global_variable u32 game_code_load_count = 0;
 
 internal void unload_game_code()
 {
     if(game_code_dylib)
     if (dlclose(game_code_dylib)) printf("dlcose error\n");
+    game_code_dylib = NULL;
+    if (game_code_copy_path[0]) unlink(game_code_copy_path);
+    game_code_copy_path[0] = 0;
     printf("UNLOADED game code\n");
 }
 
-u64 time_last_changed = 0;
-internal void maybe_load_game_code()
+// Set by the watcher when the dylib changed, the main loop reloads it between frames
+global_variable std::atomic<b32> game_code_changed { true };
+
+// Waits on a kqueue for the dylib to change, so the main loop doesn't stat it every
+// frame. The linker may replace the file rather than write it, so the directory is
+// watched for new entries along with the file itself, which is opened again
+// whenever it was replaced.
+internal void watch_game_code()
 {
-    // Early return if the game code has not changed
-    u64 new_time_last_changed = get_file_last_time_changed("./cello.dylib");
-    if (time_last_changed == new_time_last_changed) return;
-    time_last_changed = new_time_last_changed;
+    const s32 queue = kqueue();
+    const s32 directory = open(GAME_CODE_DIRECTORY, O_EVTONLY);
+    if (queue < 0 || directory < 0)
+    {
+        printf("could not watch '%s': %d %s\n", GAME_CODE_DIRECTORY, errno, strerror(errno));
+        return;
+    }
+
+    struct kevent change;
+    EV_SET(&change, directory, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+    kevent(queue, &change, 1, NULL, 0, NULL);
+
+    s32 file = -1;
+    u64 time_last_changed = get_file_last_time_changed(GAME_CODE_PATH);
+    while (true)
+    {
+        if (file < 0)
+        {
+            file = open(GAME_CODE_PATH, O_EVTONLY);
+            if (file >= 0)
+            {
+                EV_SET(&change, file, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+                kevent(queue, &change, 1, NULL, 0, NULL);
+            }
+        }
+
+        struct kevent event;
+        if (kevent(queue, NULL, 0, &event, 1, NULL) < 0)
+        {
+            if (errno == EINTR) continue;
+            printf("kevent error: %d %s\n", errno, strerror(errno));
+            return;
+        }
+
+        // Closing the file also removes its event
+        if ((s32)event.ident == file && (event.fflags & (NOTE_DELETE | NOTE_RENAME)))
+        {
+            close(file);
+            file = -1;
+        }
+
+        const u64 new_time_last_changed = get_file_last_time_changed(GAME_CODE_PATH);
+        if (new_time_last_changed == time_last_changed) continue;
+        time_last_changed = new_time_last_changed;
+        game_code_changed = true;
+    }
+}
 
+internal void load_game_code()
+{
     printf("CHANGING!\n");
 
-    // We unload the game code first
+    // We unload the game code first. The workers stay, no job of the old code is
+    // left once a frame has returned.
     unload_game_code();
 
-    game_code_dylib = dlopen("./cello.dylib", RTLD_LAZY|RTLD_GLOBAL);
+    // dyld hands back the image it already has for a path, and keeps an image
+    // loaded when anything in it can't be unloaded. Opening every build from a
+    // copy of its own means the new code runs even then.
+    snprintf(game_code_copy_path, sizeof(game_code_copy_path), GAME_CODE_COPY_PATH, game_code_load_count++);
+    if (copyfile(GAME_CODE_PATH, game_code_copy_path, NULL, COPYFILE_DATA) != 0)
+    {
+        printf("could not copy '%s' to '%s': %d %s\n", GAME_CODE_PATH, game_code_copy_path, errno, strerror(errno));
+        game_code_copy_path[0] = 0;
+        game_update_and_render = NULL;
+        return;
+    }
+
+    game_code_dylib = dlopen(game_code_copy_path, RTLD_LAZY|RTLD_GLOBAL);
     if (!game_code_dylib)
     {
         printf("dlopen error: %s\n", dlerror());
@@ -485,7 +564,7 @@ internal CVReturn displayCallback(CVDisplayLinkRef displayLink,
 {
     Game_Memory *game_memory = (Game_Memory*)displayLinkContext;
 
-    // maybe_load_game_code();
+    // if (game_code_changed.exchange(false)) load_game_code();
 
     // cello.cpp has global function ptr to these
     // whenever we reload the dylib they get invalidated.
@@ -561,6 +640,12 @@ s32 main(s32 argc, char** argv)
     game_memory.set_cursor_visibility = set_cursor_visibility;
     game_memory.swap_buffers          = swap_buffers;
     game_memory.get_time              = get_time;
+    game_memory.submit_job            = pool_submit_job;
+    game_memory.parallel_for          = pool_parallel_for;
+    game_memory.wait_jobs             = pool_wait_jobs;
+
+    start_job_pool(std::thread::hardware_concurrency());
+    std::thread(watch_game_code).detach();
 
     @autoreleasepool {
         NSRect screenRect = [[NSScreen mainScreen] frame];
@@ -604,7 +689,7 @@ s32 main(s32 argc, char** argv)
         // [NSApp run];
         while (is_running)
         {
-            maybe_load_game_code();
+            if (game_code_changed.exchange(false)) load_game_code();
 
             // cello.cpp has global function ptr to these
             // whenever we reload the dylib they get invalidated.
@@ -615,6 +700,9 @@ s32 main(s32 argc, char** argv)
             game_memory.swap_buffers          = swap_buffers;
             game_memory.get_time              = get_time;
             game_memory.get_compile_state              = get_compile_state;
+            game_memory.submit_job            = pool_submit_job;
+            game_memory.parallel_for          = pool_parallel_for;
+            game_memory.wait_jobs             = pool_wait_jobs;
 
             get_input_info(&game_memory.inputs);
             if (game_update_and_render)
@@ -622,5 +710,6 @@ s32 main(s32 argc, char** argv)
         }
     }
 
+    if (game_code_copy_path[0]) unlink(game_code_copy_path);
     return 0;
 }
@@ -0,0 +1,245 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// World-space irradiance probes on a regular grid, kept across frames in a hash
+// table keyed by grid cell. Probes are created around the surfaces the camera sees
+// and traced a budget's worth per frame. Edits only re-trace the probes whose rays
+// could reach what changed, and a change in lighting refreshes the stalest probes
+// a budget at a time.
+#define PROBE_REQUEST_STRIDE 8
+#define PROBE_BUDGET 256
+#define PROBE_CHANGE_THRESHOLD 0.05 // relative change below which a re-traced probe is not re-rendered for
+
+struct Probe_Cache
+{
+    Probe* probes; // PROBE_TABLE_SIZE slots
+    s32* updates;  // PROBE_BUDGET slots to trace this frame
+    u32 frame;
+    u64 lighting_hash;
+    u32 lighting_frame; // probes traced before this frame saw older lighting
+    s32 valid_count;
+};
+
+internal void init_probe_cache(Probe_Cache* cache)
+{
+    if (cache->probes)
+    {
+        free(cache->probes);
+        free(cache->updates);
+    }
+    cache->probes = (Probe*)calloc(PROBE_TABLE_SIZE, sizeof(Probe));
+    cache->updates = (s32*)malloc(PROBE_BUDGET * sizeof(s32));
+    cache->frame = 1;
+    cache->lighting_hash = 0;
+    cache->lighting_frame = 0;
+    cache->valid_count = 0;
+}
+
+// Marks the probe of a cell as used this frame, adding it if it is new. When the
+// cell's probe sequence is full, the probe least recently used by an earlier frame
+// gives up its slot.
+internal void touch_probe(Probe_Cache* cache, s32 x, s32 y, s32 z)
+{
+    const u32 start = probeHash(x, y, z);
+    s32 oldest = -1;
+    foreach(i, PROBE_MAX_PROBES)
+    {
+        const u32 slot = (start + i) & (PROBE_TABLE_SIZE - 1);
+        Probe* probe = &cache->probes[slot];
+        if (probe->state != PROBE_EMPTY && probe->cell[0] == x && probe->cell[1] == y && probe->cell[2] == z)
+        {
+            probe->used_frame = cache->frame;
+            return;
+        }
+        if (probe->state == PROBE_EMPTY)
+        {
+            oldest = slot;
+            break;
+        }
+        if (oldest < 0 || probe->used_frame < cache->probes[oldest].used_frame) oldest = slot;
+    }
+
+    Probe* probe = &cache->probes[oldest];
+    if (probe->state != PROBE_EMPTY && probe->used_frame == cache->frame) return;
+
+    *probe = (Probe) {};
+    probe->cell[0] = x;
+    probe->cell[1] = y;
+    probe->cell[2] = z;
+    probe->state = PROBE_REQUESTED;
+    probe->used_frame = cache->frame;
+}
+
+// Touches the probes around a sparse sample of the visible surfaces, the same
+// eight cells probeIrradiance reads from.
+internal void request_probes(Probe_Cache* cache, Uniform* uniform, G_Buffer_Texel* gbuffer)
+{
+    const s32 width = uniform->viewport_size.x;
+    const s32 height = uniform->viewport_size.y;
+    for (s32 y = PROBE_REQUEST_STRIDE / 2; y < height; y += PROBE_REQUEST_STRIDE)
+    for (s32 x = PROBE_REQUEST_STRIDE / 2; x < width; x += PROBE_REQUEST_STRIDE)
+    {
+        const G_Buffer_Texel texel = gbuffer[y * width + x];
+        if (!(texel.t < FLT_MAX)) continue;
+
+        const v3 rd = primaryRay(*uniform, v2(x, y));
+        const v3 P = uniform->camera_position + rd * texel.t;
+
+        const v3 base = floor((P + texel.normal * (PROBE_SPACING * 0.25)) / PROBE_SPACING);
+        foreach(k, 8)
+        {
+            touch_probe(cache, (s32)base.x + (k & 1), (s32)base.y + ((k >> 1) & 1), (s32)base.z + ((k >> 2) & 1));
+        }
+    }
+}
+
+// Probes whose rays can reach the changed region have to be traced again. Until
+// they are, stale probes keep shading with what they saw before.
+internal void invalidate_probes(Probe_Cache* cache, Bounds changed)
+{
+    if (bounds_is_empty(changed)) return;
+    const Bounds region = bounds_expand(changed, PROBE_RAY_LENGTH);
+    foreach(i, PROBE_TABLE_SIZE)
+    {
+        Probe* probe = &cache->probes[i];
+        if (probe->state == PROBE_EMPTY) continue;
+
+        const v3 P = v3(probe->cell[0], probe->cell[1], probe->cell[2]) * PROBE_SPACING;
+        if (!region.is_unbounded &&
+            (P.x < region.min.x || P.y < region.min.y || P.z < region.min.z ||
+             P.x > region.max.x || P.y > region.max.y || P.z > region.max.z)) continue;
+
+        if (probe->state == PROBE_VALID) probe->state = PROBE_STALE;
+        else if (probe->state == PROBE_INSIDE) probe->state = PROBE_REQUESTED;
+    }
+}
+
+internal u64 hash_probe_lighting(Light_Info* light_info, Material* materials, s32 material_count)
+{
+    u64 hash = FNV_OFFSET_BASIS;
+    foreach(i, light_info->count)
+    {
+        hash = hash_v3(hash, light_info->lights[i].pos);
+        hash = hash_v3(hash, light_info->lights[i].color);
+        hash = hash_f32(hash, light_info->lights[i].intensity);
+    }
+    foreach(i, material_count)
+    {
+        hash = hash_v3(hash, materials[i].color);
+        hash = hash_f32(hash, materials[i].emission);
+    }
+    return hash;
+}
+
+// Traces up to PROBE_BUDGET probes: new ones first, then stale ones, then the
+// oldest of those traced before the lighting last changed. Returns the region
+// whose shading the traced probes visibly changed.
+internal Bounds update_probes(Probe_Cache* cache, Frame_Constants* constants, s32 task_count, Memory_Arena* arena)
+{
+    const u64 lighting_hash = hash_probe_lighting(&constants->light_info, constants->materials, constants->material_count);
+    if (lighting_hash != cache->lighting_hash)
+    {
+        cache->lighting_hash = lighting_hash;
+        cache->lighting_frame = cache->frame;
+    }
+
+    // A single pass over the table picks the candidates of each priority and
+    // counts the probes that shade
+    s32* stale = push_array(arena, PROBE_BUDGET, s32);
+    s32* outdated = push_array(arena, PROBE_TABLE_SIZE, s32);
+    s32 update_count = 0;
+    s32 stale_count = 0;
+    s32 outdated_count = 0;
+    s32 valid_count = 0;
+    foreach(i, PROBE_TABLE_SIZE)
+    {
+        const Probe* probe = &cache->probes[i];
+        switch (probe->state)
+        {
+            case PROBE_REQUESTED:
+                if (update_count < PROBE_BUDGET) cache->updates[update_count++] = i;
+                break;
+            case PROBE_STALE:
+                valid_count++;
+                if (stale_count < PROBE_BUDGET) stale[stale_count++] = i;
+                break;
+            case PROBE_VALID:
+                valid_count++;
+                if (probe->updated_frame < cache->lighting_frame) outdated[outdated_count++] = i;
+                break;
+        }
+    }
+    for (s32 i = 0; i < stale_count && update_count < PROBE_BUDGET; ++i) cache->updates[update_count++] = stale[i];
+
+    if (update_count < PROBE_BUDGET)
+    {
+        const s32 free_count = PROBE_BUDGET - update_count;
+        const s32 refresh_count = outdated_count < free_count ? outdated_count : free_count;
+        const auto older = [&](s32 a, s32 b) { return cache->probes[a].updated_frame < cache->probes[b].updated_frame; };
+        std::nth_element(outdated, outdated + refresh_count, outdated + outdated_count, older);
+        foreach(i, refresh_count) cache->updates[update_count++] = outdated[i];
+    }
+
+    // What the probes held before, so only those that changed enough count
+    Probe* previous = push_array(arena, update_count, Probe);
+    foreach(i, update_count) previous[i] = cache->probes[cache->updates[i]];
+
+    if (update_count > 0)
+    {
+        const s32 count = (update_count + task_count - 1) / task_count;
+
+        dispatch_for("updateProbes", task_count, [&](s32 i, s32 worker) {
+            const s32 x0 = i * count;
+            const s32 x1 = x0 + count < update_count ? x0 + count : update_count;
+            if (x0 < x1) updateProbes(*constants, cache->probes, cache->updates, ushort2(x0, 0), ushort2(x1, 1), get_worker_work(worker));
+        });
+
+        foreach(i, update_count) cache->probes[cache->updates[i]].updated_frame = cache->frame;
+    }
+
+    Bounds changed = bounds_empty();
+    foreach(i, update_count)
+    {
+        const Probe* probe = &cache->probes[cache->updates[i]];
+        const b32 was_valid = previous[i].state == PROBE_VALID || previous[i].state == PROBE_STALE;
+        const b32 is_valid = probe->state == PROBE_VALID || probe->state == PROBE_STALE;
+        valid_count += is_valid - was_valid;
+        if (!was_valid && probe->state == PROBE_INSIDE) continue; // shades nothing either way
+        if (was_valid && probe->state == PROBE_VALID)
+        {
+            f32 difference = 0.0;
+            foreach(k, 4)
+            {
+                const v3 d = fabs(probe->sh[k] - previous[i].sh[k]);
+                difference = max(difference, max(d.x, max(d.y, d.z)));
+            }
+            const v3 level = fabs(previous[i].sh[0]);
+            if (difference < PROBE_CHANGE_THRESHOLD * (1.0 + max(level.x, max(level.y, level.z)))) continue;
+        }
+        const v3 P = v3(probe->cell[0], probe->cell[1], probe->cell[2]) * PROBE_SPACING;
+        changed = bounds_union(changed, (Bounds) { P, P, false });
+    }
+
+    cache->valid_count = valid_count;
+    cache->frame++;
+
+    // Shading interpolates between probes up to a cell apart
+    return bounds_expand(changed, PROBE_SPACING);
+}
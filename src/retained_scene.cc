@@ -0,0 +1,258 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// The scene lives in permanent storage and is changed through handles, instead of
+// being rebuilt every frame. Every object, material and light has a version that
+// only moves when a setter is given something different, and each kind of data
+// has a dirty flag. Once a frame the scene is snapshotted into the frame constants,
+// rebuilding only what is dirty, so the compiled program and the diff the caches
+// work from are redone only when the edits actually changed.
+#include <sys/mman.h> // munmap
+
+typedef s32 Scene_Handle; // index of an object, material or light, stable for the life of the scene
+
+#define MAX_SCENE_OBJECTS 16384
+#define MAX_OBJECT_EDITS 8
+
+// A run of edits in the program, like the material, size, primitive and combine
+// operator of one shape. State set by an object carries over to the next ones, as
+// it does in map().
+struct Scene_Object
+{
+    Edit edits[MAX_OBJECT_EDITS];
+    s32 edit_count;
+    u32 version;
+};
+
+struct Retained_Scene
+{
+    Scene_Object objects[MAX_SCENE_OBJECTS];
+    s32 object_count;
+
+    Material materials[MAX_MATERIALS];
+    u32 material_versions[MAX_MATERIALS];
+    s32 material_count;
+
+    Light lights[MAX_LIGHTS];
+    u32 light_versions[MAX_LIGHTS];
+    s32 light_count;
+
+    // Bumped on any change to the kind, the flags are cleared by snapshot_scene
+    u32 edits_version;
+    u32 materials_version;
+    u32 lights_version;
+    b32 edits_dirty;
+    b32 materials_dirty;
+    b32 lights_dirty;
+};
+
+// A compiled program used in place from a mapped scene file, see load_scene. The
+// residual pages and batch centers of the constants point into the mapping until
+// the program is compiled again. The pages and arrays they own wait here until then.
+struct Mapped_Program
+{
+    void* base; // the mapping, NULL while the constants own their program
+    u64 size;
+    u32 page_count;
+    Edit_Page* pages[MAX_EDIT_PAGES];
+    Primitive_Batches batches;
+};
+
+// Which versions of the scene the frame constants hold. The scene parts of the
+// constants stay in permanent storage and only those whose versions moved are
+// rewritten.
+struct Scene_Snapshot
+{
+    u32 edits_version;
+    u32 materials_version;
+    u32 lights_version;
+
+    Bounds changes; // where the program differs from the previous snapshot's
+    Scene_History history;
+    b32 compiled_is_current; // a loaded scene file already put the compiled program of its edits in the constants
+    Mapped_Program mapped;
+};
+
+// Gives the compiled program its own pages and batch arrays back, so it can be
+// compiled into, and unmaps the scene file it was read from.
+internal void unmap_program(Mapped_Program* mapped, Compiled_Scene* compiled)
+{
+    if (!mapped->base) return;
+    foreach(i, mapped->page_count) compiled->residual.pages[i] = mapped->pages[i];
+    compiled->residual.page_count = mapped->page_count;
+    compiled->residual.count = 0;
+    compiled->batches = mapped->batches;
+    compiled->batches.count = 0;
+    munmap(mapped->base, mapped->size);
+    *mapped = (Mapped_Program) {};
+}
+
+internal void init_retained_scene(Retained_Scene* scene, Scene_Snapshot* snapshot, Frame_Constants* constants)
+{
+    memset(scene, 0, sizeof(*scene));
+    scene->edits_dirty = true;
+    scene->materials_dirty = true;
+    scene->lights_dirty = true;
+
+    constants->edit_info.count = 0;
+    constants->material_count = 0;
+    constants->light_info.count = 0;
+    unmap_program(&snapshot->mapped, &constants->compiled);
+    snapshot->history.footprint_count = -1;
+}
+
+internal b32 edits_equal(Edit* a, Edit* b, s32 count)
+{
+    foreach(i, count)
+    {
+        if (a[i].kind != b[i].kind || !v3_equal(a[i].data, b[i].data)) return false;
+    }
+    return true;
+}
+
+internal b32 materials_equal(Material a, Material b)
+{
+    return v3_equal(a.color, b.color) && a.kind == b.kind && a.emission == b.emission && a.roughness == b.roughness && a.metallic == b.metallic;
+}
+
+// The radius is left out, assign_lights derives it from the rest.
+internal b32 lights_equal(Light a, Light b)
+{
+    return v3_equal(a.pos, b.pos) && v3_equal(a.color, b.color) && a.intensity == b.intensity;
+}
+
+internal void set_object(Retained_Scene* scene, Scene_Handle handle, Edit* edits, s32 edit_count)
+{
+    assert(handle >= 0 && handle < scene->object_count && "invalid object handle");
+    assert(edit_count <= MAX_OBJECT_EDITS && "too many edits in one object");
+
+    Scene_Object* object = &scene->objects[handle];
+    if (edit_count == object->edit_count && edits_equal(object->edits, edits, edit_count)) return;
+
+    foreach(i, edit_count) object->edits[i] = edits[i];
+    object->edit_count = edit_count;
+    object->version++;
+    scene->edits_version++;
+    scene->edits_dirty = true;
+}
+
+internal Scene_Handle add_object(Retained_Scene* scene, Edit* edits, s32 edit_count)
+{
+    assert(scene->object_count < MAX_SCENE_OBJECTS && "too many scene objects");
+    const Scene_Handle handle = scene->object_count++;
+    scene->objects[handle].edit_count = -1;
+    set_object(scene, handle, edits, edit_count);
+    return handle;
+}
+
+internal void set_material(Retained_Scene* scene, Scene_Handle handle, Material material)
+{
+    assert(handle >= 0 && handle < scene->material_count && "invalid material handle");
+    if (materials_equal(scene->materials[handle], material)) return;
+
+    scene->materials[handle] = material;
+    scene->material_versions[handle]++;
+    scene->materials_version++;
+    scene->materials_dirty = true;
+}
+
+// Materials are referred to by their index in the program, so the handle of the
+// n-th material added is n.
+internal Scene_Handle add_material(Retained_Scene* scene, Material material)
+{
+    assert(scene->material_count < MAX_MATERIALS && "too many materials");
+    const Scene_Handle handle = scene->material_count++;
+    scene->material_versions[handle]++;
+    scene->materials[handle] = material;
+    scene->materials_version++;
+    scene->materials_dirty = true;
+    return handle;
+}
+
+internal void set_light(Retained_Scene* scene, Scene_Handle handle, Light light)
+{
+    assert(handle >= 0 && handle < scene->light_count && "invalid light handle");
+    if (lights_equal(scene->lights[handle], light)) return;
+
+    scene->lights[handle] = light;
+    scene->light_versions[handle]++;
+    scene->lights_version++;
+    scene->lights_dirty = true;
+}
+
+internal Scene_Handle add_light(Retained_Scene* scene, Light light)
+{
+    assert(scene->light_count < (s32)MAX_LIGHTS && "too many lights");
+    const Scene_Handle handle = scene->light_count++;
+    scene->light_versions[handle]++;
+    scene->lights[handle] = light;
+    scene->lights_version++;
+    scene->lights_dirty = true;
+    return handle;
+}
+
+// Concatenates the edits of all objects into one program.
+internal void flatten_scene(Retained_Scene* scene, Edit_Info* edit_info)
+{
+    edit_info->count = 0;
+    foreach(i, scene->object_count)
+    {
+        const Scene_Object* object = &scene->objects[i];
+        push_edits(edit_info, object->edits, object->edit_count);
+    }
+}
+
+// Brings the scene in the frame constants up to date. Untouched parts are left as
+// they are, and 'changes' is empty unless the edits changed.
+internal void snapshot_scene(Retained_Scene* scene, Scene_Snapshot* snapshot, Frame_Constants* constants)
+{
+    snapshot->changes = bounds_empty();
+    if (scene->edits_dirty)
+    {
+        TRACE_SCOPE("compile_scene");
+        Edit_Info* edit_info = &constants->edit_info;
+        flatten_scene(scene, edit_info);
+        if (!snapshot->compiled_is_current)
+        {
+            unmap_program(&snapshot->mapped, &constants->compiled);
+            compile_scene(edit_info, &constants->compiled);
+        }
+        snapshot->compiled_is_current = false;
+        snapshot->changes = diff_scene(&snapshot->history, edit_info);
+        snapshot->edits_version = scene->edits_version;
+        scene->edits_dirty = false;
+    }
+
+    if (scene->materials_dirty)
+    {
+        foreach(i, scene->material_count) constants->materials[i] = scene->materials[i];
+        constants->material_count = scene->material_count;
+        snapshot->materials_version = scene->materials_version;
+        scene->materials_dirty = false;
+    }
+
+    if (scene->lights_dirty)
+    {
+        foreach(i, scene->light_count) constants->light_info.lights[i] = scene->lights[i];
+        constants->light_info.count = scene->light_count;
+        snapshot->lights_version = scene->lights_version;
+        scene->lights_dirty = false;
+    }
+}
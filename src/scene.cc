@@ -0,0 +1,533 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "common.h"
+#include "shader_common.h"
+
+internal b32 is_primitive(OpKind kind)
+{
+    return kind >= SD_PLANE;
+}
+
+internal b32 is_analytic(OpKind kind)
+{
+    return kind == SD_PLANE || kind == SD_SPHERE || kind == SD_BOX;
+}
+
+// Appends to the program, adding a page when the last one is full.
+internal void push_edit(Edit_Info* edit_info, Edit e)
+{
+    const u32 page = edit_info->count >> EDIT_PAGE_SHIFT;
+    if (page == edit_info->page_count)
+    {
+        assert(page < MAX_EDIT_PAGES && "the program has too many edits");
+        edit_info->pages[edit_info->page_count++] = (Edit_Page*)malloc(sizeof(Edit_Page));
+    }
+    edit_at(*edit_info, edit_info->count++) = e;
+}
+
+internal void push_edits(Edit_Info* edit_info, const Edit* edits, u32 count)
+{
+    foreach(i, count) push_edit(edit_info, edits[i]);
+}
+
+internal void push_batch_center(Primitive_Batches* batches, v3 center)
+{
+    if (batches->count == batches->capacity)
+    {
+        batches->capacity = batches->capacity ? batches->capacity * 2 : 1024;
+        batches->x = (f32*)realloc(batches->x, batches->capacity * sizeof(f32));
+        batches->y = (f32*)realloc(batches->y, batches->capacity * sizeof(f32));
+        batches->z = (f32*)realloc(batches->z, batches->capacity * sizeof(f32));
+    }
+    batches->x[batches->count] = center.x;
+    batches->y[batches->count] = center.y;
+    batches->z[batches->count] = center.z;
+    batches->count++;
+}
+
+internal Bounds bounds_empty()
+{
+    return (Bounds) { v3(FLT_MAX, FLT_MAX, FLT_MAX), v3(-FLT_MAX, -FLT_MAX, -FLT_MAX), false };
+}
+
+internal Bounds bounds_unbounded()
+{
+    return (Bounds) { v3(-FLT_MAX, -FLT_MAX, -FLT_MAX), v3(FLT_MAX, FLT_MAX, FLT_MAX), true };
+}
+
+internal b32 bounds_is_empty(Bounds b)
+{
+    return !b.is_unbounded && b.min.x > b.max.x;
+}
+
+internal Bounds bounds_union(Bounds a, Bounds b)
+{
+    if (a.is_unbounded || b.is_unbounded) return bounds_unbounded();
+    return (Bounds) { min(a.min, b.min), max(a.max, b.max), false };
+}
+
+internal Bounds bounds_expand(Bounds b, f32 amount)
+{
+    if (b.is_unbounded || bounds_is_empty(b)) return b;
+    const v3 r = v3(amount, amount, amount);
+    return (Bounds) { b.min - r, b.max + r, false };
+}
+
+// Half extents of a primitive around its center, negative for the unbounded ones.
+internal v3 primitive_extent(OpKind kind, v3 size, f32 rounding)
+{
+    switch (kind)
+    {
+        case SD_SPHERE:          return fabs(v3(size.x, size.x, size.x));
+        case SD_BOX:             return fabs(size);
+        case SD_ROUND_BOX:       return fabs(size + v3(rounding, rounding, rounding));
+        case SD_TORUS:           return fabs(v3(size.x + size.y, size.y, size.x + size.y));
+        case SD_CAPPED_CYLINDER: return fabs(v3(size.x, size.y, size.x));
+        default:                 return v3(-1, -1, -1);
+    }
+}
+
+// Bounds of a primitive in the (possibly transformed) domain it is evaluated in.
+internal Bounds primitive_bounds(Edit_Info* edit_info, u32 index, v3 size, f32 rounding)
+{
+    const Edit e = edit_at(*edit_info, index);
+    if (e.kind == SD_TRIANGLE)
+    {
+        Bounds b = { e.data, e.data, false };
+        for (u32 j = index + 1; j < index + 3 && j < edit_info->count; ++j)
+        {
+            b.min = min(b.min, edit_at(*edit_info, j).data);
+            b.max = max(b.max, edit_at(*edit_info, j).data);
+        }
+        return b;
+    }
+
+    const v3 extent = primitive_extent(e.kind, size, rounding);
+    if (extent.x < 0.0) return bounds_unbounded();
+    return (Bounds) { e.data - extent, e.data + extent, false };
+}
+
+// Bounds of all the primitives of an OP_BATCH.
+internal Bounds batch_bounds(Edit e, Primitive_Batches* batches, v3 size, f32 rounding)
+{
+    const v3 extent = primitive_extent((OpKind)e.data.x, size, rounding);
+    Bounds b = bounds_empty();
+    for (u32 i = e.data.y; i < e.data.y + e.data.z; ++i)
+    {
+        const v3 center = v3(batches->x[i], batches->y[i], batches->z[i]);
+        b.min = min(b.min, center - extent);
+        b.max = max(b.max, center + extent);
+    }
+    return b;
+}
+
+// Room left around bounds for the noise sdSphere and sdTorus add to their distance
+#define NOISE_BOUNDS_SLACK 0.01
+
+// Conservative bounds of everything an edit program can produce. Combine operators
+// are treated as unions, smooth blends and rounding grow the bounds by their radius.
+// Repetition is infinite, and rotations are about the origin so a rotated primitive
+// is bounded by the sphere through its farthest corner.
+internal Bounds compute_bounds(Edit_Info* edit_info, Primitive_Batches* batches = NULL)
+{
+    // Same initial state as map()
+    v3 size = v3(0.01,0.01,0.01);
+    f32 rounding = 0.1;
+    b32 is_repeated = false;
+    b32 is_rotated = false;
+
+    Bounds result = bounds_empty();
+    Bounds last = bounds_empty();
+    for (u32 i = 0; i < edit_info->count; ++i)
+    {
+        const Edit e = edit_at(*edit_info, i);
+        switch (e.kind)
+        {
+            case SET_SIZE:           size = e.data;                              break;
+            case SET_ROUNDING:       rounding = e.data.x;                        break;
+            case OP_REP:             is_repeated = true;                         break;
+            case OP_ROTATE_X:
+            case OP_ROTATE_Y:
+            case OP_ROTATE_Z:        is_rotated = true;                          break;
+            case OP_RESET:           is_repeated = false; is_rotated = false;    break;
+            case OP_ROUNDED:
+            case OP_ANNULAR:         last = bounds_expand(last, fabs(e.data.x)); break;
+            case OP_UNION:
+            case OP_SUBTRACT:
+            case OP_INTERSECT:       result = bounds_union(result, last);        break;
+            case OP_SMOOTH_UNION:
+            case OP_SMOOTH_SUBTRACT:
+            case OP_SMOOTH_INTERSECT:
+            {
+                result = bounds_expand(bounds_union(result, last), fabs(e.data.x));
+            } break;
+            default: break;
+        }
+
+        if (is_primitive(e.kind) || e.kind == OP_BATCH)
+        {
+            last = e.kind == OP_BATCH ? batch_bounds(e, batches, size, rounding) : primitive_bounds(edit_info, i, size, rounding);
+            if (is_repeated)
+            {
+                last = bounds_unbounded();
+            }
+            else if (is_rotated && !last.is_unbounded)
+            {
+                const f32 r = length(max(fabs(last.min), fabs(last.max)));
+                last = (Bounds) { v3(-r, -r, -r), v3(r, r, r), false };
+            }
+            if (e.kind == SD_TRIANGLE) i += 2;
+        }
+    }
+
+    return bounds_expand(result, NOISE_BOUNDS_SLACK);
+}
+
+internal u64 hash_edit(u64 hash, Edit e)
+{
+    hash = hash_bytes(hash, &e.kind, sizeof(e.kind));
+    return hash_v3(hash, e.data);
+}
+
+// The region one primitive affects and a hash of everything that decides its shape.
+// Comparing these between two versions of a program tells which parts of space
+// changed, without having to care about what the edits look like.
+struct Primitive_Footprint
+{
+    Bounds bounds;
+    u64 hash;
+};
+
+// Fills 'footprints' with one entry per primitive that gets combined into the
+// result and returns how many there are. Materials are left out of the hash,
+// they do not change the shape.
+internal s32 scene_footprints(Edit_Info* edit_info, Primitive_Footprint* footprints)
+{
+    // Same initial state as map()
+    v3 size = v3(0.01,0.01,0.01);
+    f32 rounding = 0.1;
+    b32 is_repeated = false;
+    b32 is_rotated = false;
+    u64 domain_hash = FNV_OFFSET_BASIS;
+
+    s32 count = 0;
+    b32 is_open = false;
+    Primitive_Footprint current = {};
+    for (u32 i = 0; i < edit_info->count; ++i)
+    {
+        const Edit e = edit_at(*edit_info, i);
+        switch (e.kind)
+        {
+            case SET_SIZE:     size = e.data;        break;
+            case SET_ROUNDING: rounding = e.data.x;  break;
+            case OP_REP:
+            case OP_ROTATE_X:
+            case OP_ROTATE_Y:
+            case OP_ROTATE_Z:
+            {
+                if (e.kind == OP_REP) is_repeated = true;
+                else                  is_rotated = true;
+                domain_hash = hash_edit(domain_hash, e);
+            } break;
+            case OP_RESET:
+            {
+                is_repeated = false;
+                is_rotated = false;
+                domain_hash = FNV_OFFSET_BASIS;
+            } break;
+            case OP_ROUNDED:
+            case OP_ANNULAR:
+            {
+                current.bounds = bounds_expand(current.bounds, fabs(e.data.x));
+                current.hash = hash_edit(current.hash, e);
+            } break;
+            case OP_UNION:
+            case OP_SUBTRACT:
+            case OP_INTERSECT:
+            case OP_SMOOTH_UNION:
+            case OP_SMOOTH_SUBTRACT:
+            case OP_SMOOTH_INTERSECT:
+            {
+                if (!is_open) break;
+                if (e.kind >= OP_SMOOTH_UNION) current.bounds = bounds_expand(current.bounds, fabs(e.data.x));
+                current.hash = hash_edit(current.hash, e);
+                footprints[count++] = current;
+                is_open = false;
+            } break;
+            default: break;
+        }
+
+        if (is_primitive(e.kind))
+        {
+            Bounds b = primitive_bounds(edit_info, i, size, rounding);
+            if (is_repeated)
+            {
+                b = bounds_unbounded();
+            }
+            else if (is_rotated && !b.is_unbounded)
+            {
+                const f32 r = length(max(fabs(b.min), fabs(b.max)));
+                b = (Bounds) { v3(-r, -r, -r), v3(r, r, r), false };
+            }
+
+            u64 hash = hash_v3(domain_hash, size);
+            hash = hash_f32(hash, rounding);
+            const s32 edit_count = e.kind == SD_TRIANGLE ? 3 : 1;
+            for (u32 j = i; j < i + edit_count && j < edit_info->count; ++j)
+                hash = hash_edit(hash, edit_at(*edit_info, j));
+
+            current = (Primitive_Footprint) { bounds_expand(b, NOISE_BOUNDS_SLACK), hash };
+            is_open = true;
+            i += edit_count - 1;
+        }
+    }
+    return count;
+}
+
+// The footprints of the previous frame's program, see diff_scene. Both arrays
+// hold one footprint per edit and grow with the program.
+struct Scene_History
+{
+    Primitive_Footprint* footprints;
+    Primitive_Footprint* scratch; // where the next program's footprints are made
+    u32 capacity;
+    s32 footprint_count; // -1 before the first frame
+};
+
+// Returns the region where the program differs from the one it was called with
+// last time, and remembers this one. Caches over the scene only have to redo
+// work that touches that region.
+internal Bounds diff_scene(Scene_History* history, Edit_Info* edit_info)
+{
+    if (edit_info->count > history->capacity)
+    {
+        history->capacity = edit_info->count;
+        history->footprints = (Primitive_Footprint*)realloc(history->footprints, history->capacity * sizeof(Primitive_Footprint));
+        history->scratch = (Primitive_Footprint*)realloc(history->scratch, history->capacity * sizeof(Primitive_Footprint));
+    }
+
+    Primitive_Footprint* footprints = history->scratch;
+    const s32 footprint_count = scene_footprints(edit_info, footprints);
+
+    Bounds changed = bounds_empty();
+    if (footprint_count != history->footprint_count)
+    {
+        changed = bounds_unbounded();
+    }
+    else foreach(i, footprint_count)
+    {
+        if (footprints[i].hash == history->footprints[i].hash) continue;
+        changed = bounds_union(changed, bounds_union(footprints[i].bounds, history->footprints[i].bounds));
+    }
+
+    history->scratch = history->footprints;
+    history->footprints = footprints;
+    history->footprint_count = footprint_count;
+    return changed;
+}
+
+// Does the edit at 'index' leave the previous primitive's distance alone until the
+// next primitive replaces it? Otherwise removing that primitive would change the result.
+internal b32 next_distance_edit_is_primitive(Edit_Info* edit_info, u32 index)
+{
+    for (u32 i = index; i < edit_info->count; ++i)
+    {
+        const OpKind kind = edit_at(*edit_info, i).kind;
+        if (is_primitive(kind)) return true;
+        switch (kind)
+        {
+            case OP_UNION:
+            case OP_SUBTRACT:
+            case OP_INTERSECT:
+            case OP_SMOOTH_UNION:
+            case OP_SMOOTH_SUBTRACT:
+            case OP_SMOOTH_INTERSECT:
+            case OP_ROUNDED:
+            case OP_ANNULAR:
+                return false;
+            default: break;
+        }
+    }
+    return true;
+}
+
+// Level of detail for the primitive at 'index', an OP_LOD edit to put in front of
+// it or _NONE_ when it has none. Below its feature size, the largest half extent
+// after rounding, a primitive is not resolved and map() can use the sphere around
+// its bounds instead. That is only a lower bound on the distance when the sphere
+// is unioned or intersected, a subtracted primitive is dropped. Shells made with
+// OP_ANNULAR and unbounded planes keep their exact distance.
+internal Edit lod_edit(Edit_Info* edit_info, u32 index, v3 size, f32 rounding)
+{
+    const Edit none = { _NONE_ };
+    const OpKind kind = edit_at(*edit_info, index).kind;
+    if (kind == SD_PLANE || kind == SD_TRIANGLE) return none;
+
+    const Bounds bounds = primitive_bounds(edit_info, index, size, rounding);
+    v3 extent = (bounds.max - bounds.min) * 0.5;
+    for (u32 i = index + 1; i < edit_info->count; ++i)
+    {
+        const Edit e = edit_at(*edit_info, i);
+        switch (e.kind)
+        {
+            case OP_ANNULAR:
+                return none;
+            case OP_ROUNDED:
+                extent += v3(fabs(e.data.x), fabs(e.data.x), fabs(e.data.x));
+                break;
+            case OP_SUBTRACT:
+            case OP_SMOOTH_SUBTRACT:
+                return (Edit) { OP_LOD, v3(-1.0, max(extent.x, max(extent.y, extent.z)), 0.0) };
+            case OP_UNION:
+            case OP_INTERSECT:
+            case OP_SMOOTH_UNION:
+            case OP_SMOOTH_INTERSECT:
+                return (Edit) { OP_LOD, v3(length(extent) + NOISE_BOUNDS_SLACK, max(extent.x, max(extent.y, extent.z)), 0.0) };
+            default:
+                // The next primitive replaces the distance before it was combined
+                if (is_primitive(e.kind)) return none;
+                break;
+        }
+    }
+    return none;
+}
+
+// Runs of at least this many primitives are evaluated as one OP_BATCH
+#define MIN_BATCH_SIZE 4
+
+// How many copies of the primitive at 'index' follow one after the other, each hard
+// unioned right away, that can be evaluated as one OP_BATCH. A batch leaves the
+// closest of its primitives as the distance instead of the last one, so it has to
+// be followed by something that replaces it, else the last copy is left out.
+internal u32 batch_run_length(Edit_Info* edit_info, u32 index)
+{
+    const OpKind kind = edit_at(*edit_info, index).kind;
+    if (primitive_extent(kind, v3(1,1,1), 0.0).x < 0.0) return 0;
+
+    u32 end = index;
+    while (end + 1 < edit_info->count && edit_at(*edit_info, end).kind == kind && edit_at(*edit_info, end + 1).kind == OP_UNION) end += 2;
+
+    const u32 run = (end - index) / 2;
+    if (run == 0 || next_distance_edit_is_primitive(edit_info, end)) return run;
+    return run - 1;
+}
+
+// Split the edit program into primitives that rays can intersect in closed form and
+// the residual program that still has to be sphere traced. A primitive qualifies
+// when it is hard unioned in an untransformed domain and nothing but hard unions
+// combine with the result afterwards, so min(residual, analytic) is exact. Runs of
+// one primitive kind left in the residual are turned into batches.
+internal void compile_scene(Edit_Info* edit_info, Compiled_Scene* compiled)
+{
+    compiled->analytic_count = 0;
+    compiled->residual_primitive_count = 0;
+    compiled->residual.count = 0;
+    compiled->batches.count = 0;
+
+    s64 last_non_union = -1;
+    foreach(i, edit_info->count)
+    {
+        switch (edit_at(*edit_info, i).kind)
+        {
+            case OP_SUBTRACT:
+            case OP_INTERSECT:
+            case OP_SMOOTH_UNION:
+            case OP_SMOOTH_SUBTRACT:
+            case OP_SMOOTH_INTERSECT:
+                last_non_union = i;
+                break;
+            default: break;
+        }
+    }
+
+    // Same initial state as map()
+    v3 size = v3(0.01,0.01,0.01);
+    f32 material_id = 11.0;
+    f32 rounding = 0.1;
+    b32 is_transformed = false;
+
+    Edit_Info* residual = &compiled->residual;
+    for (u32 i = 0; i < edit_info->count; ++i)
+    {
+        const Edit e = edit_at(*edit_info, i);
+        switch (e.kind)
+        {
+            case SET_SIZE:        size = e.data;           break;
+            case SET_MATERIAL_ID: material_id = e.data.x;  break;
+            case SET_ROUNDING:    rounding = e.data.x;     break;
+            case OP_REP:
+            case OP_ROTATE_X:
+            case OP_ROTATE_Y:
+            case OP_ROTATE_Z:     is_transformed = true;   break;
+            case OP_RESET:        is_transformed = false;  break;
+            default: break;
+        }
+
+        // Triangles take their two other vertices from the following edits
+        if (e.kind == SD_TRIANGLE)
+        {
+            for (u32 j = i; j < i + 3 && j < edit_info->count; ++j)
+                push_edit(residual, edit_at(*edit_info, j));
+            compiled->residual_primitive_count++;
+            i += 2;
+            continue;
+        }
+
+        if (is_analytic(e.kind) &&
+            !is_transformed &&
+            (s64)i > last_non_union &&
+            i + 1 < edit_info->count &&
+            edit_at(*edit_info, i + 1).kind == OP_UNION &&
+            next_distance_edit_is_primitive(edit_info, i + 2) &&
+            compiled->analytic_count < MAX_ANALYTIC_PRIMITIVES)
+        {
+            compiled->analytic[compiled->analytic_count++] = (Analytic_Primitive) { e.kind, e.data, size, material_id };
+            i += 1; // skip the union
+            continue;
+        }
+
+        const u32 run = is_primitive(e.kind) ? batch_run_length(edit_info, i) : 0;
+        if (run >= MIN_BATCH_SIZE)
+        {
+            const u32 first = compiled->batches.count;
+            foreach(j, run) push_batch_center(&compiled->batches, edit_at(*edit_info, i + 2 * j).data);
+            push_edit(residual, (Edit) { OP_BATCH, v3((f32)e.kind, (f32)first, (f32)run) });
+            push_edit(residual, (Edit) { OP_UNION });
+            compiled->residual_primitive_count += run;
+            i += 2 * run - 1;
+            continue;
+        }
+
+        // Leave room for the rest of the program before spending any on level of detail
+        const u32 remaining = edit_info->count - i;
+        if (is_primitive(e.kind) && residual->count + remaining < MAX_EDITS)
+        {
+            const Edit lod = lod_edit(edit_info, i, size, rounding);
+            if (lod.kind == OP_LOD) push_edit(residual, lod);
+        }
+
+        if (is_primitive(e.kind)) compiled->residual_primitive_count++;
+        push_edit(residual, e);
+    }
+
+    compiled->bounds = compute_bounds(edit_info);
+    compiled->residual_bounds = compute_bounds(residual, &compiled->batches);
+}
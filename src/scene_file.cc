@@ -0,0 +1,407 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>    // open
+#include <unistd.h>   // close
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+
+// Scenes on disk are the in-memory structs of the retained scene, one array per
+// section, so a file is mapped and read in place instead of parsed. Every section
+// starts on a cache line and the header records the size of each element type,
+// a file written by a build with another layout is refused rather than converted.
+// The file is mapped read only and shared, processes that open the same scene
+// share its pages. A loaded compiled program is used from the mapping directly.
+#define SCENE_FILE_MAGIC 0x4f4c4543 // "CELO"
+#define SCENE_FILE_VERSION 2
+#define SCENE_FILE_ALIGNMENT CACHE_LINE_SIZE
+#define MAX_SCENE_FILE_SECTIONS 16
+#define SCENE_FILE_PATH "scene.cello" // saved with F5 and loaded with F9
+
+// Readers skip kinds they don't know, new kinds of baked data can be added without
+// a new version.
+enum Scene_Section_Kind : u32
+{
+    SECTION_OBJECTS = 1, // Scene_Object[]
+    SECTION_MATERIALS,   // Material[]
+    SECTION_LIGHTS,      // Light[]
+    SECTION_CAMERA,      // Camera
+    SECTION_COMPILED,    // Compiled_Scene of the objects' program, optional, its residual and batches are in the next sections
+    SECTION_RESIDUAL,    // Edit[] of the compiled residual program
+    SECTION_BATCH_X,     // f32[] of the compiled batch centers, one section per coordinate
+    SECTION_BATCH_Y,
+    SECTION_BATCH_Z,
+};
+
+struct Scene_File_Section
+{
+    u32 kind;
+    u32 element_size; // sizeof the element type when written
+    u64 offset;       // from the start of the file, a multiple of SCENE_FILE_ALIGNMENT
+    u64 count;
+};
+
+struct alignas(SCENE_FILE_ALIGNMENT) Scene_File_Header
+{
+    u32 magic;
+    u32 version;
+    u64 file_size;
+    u64 program_hash; // of the objects' edits, the compiled section is only used when it matches
+    u32 section_count;
+    Scene_File_Section sections[MAX_SCENE_FILE_SECTIONS];
+};
+
+// An open scene file. Sections point straight into the mapping and stay valid
+// until it is closed.
+struct Scene_File
+{
+    u8* base;
+    u64 size;
+    const Scene_File_Header* header;
+};
+
+// Hash of the program the objects flatten to
+internal u64 hash_program(const Scene_Object* objects, u64 object_count)
+{
+    u64 hash = FNV_OFFSET_BASIS;
+    foreach(i, object_count)
+    {
+        foreach(j, objects[i].edit_count) hash = hash_edit(hash, objects[i].edits[j]);
+    }
+    return hash;
+}
+
+internal u64 align_scene_offset(u64 offset)
+{
+    return (offset + SCENE_FILE_ALIGNMENT - 1) & ~(u64)(SCENE_FILE_ALIGNMENT - 1);
+}
+
+internal void add_section(Scene_File_Header* header, Scene_Section_Kind kind, u32 element_size, u64 count)
+{
+    assert(header->section_count < MAX_SCENE_FILE_SECTIONS && "too many scene file sections");
+    Scene_File_Section* section = &header->sections[header->section_count++];
+    section->kind = kind;
+    section->element_size = element_size;
+    section->offset = align_scene_offset(header->file_size);
+    section->count = count;
+    header->file_size = section->offset + element_size * count;
+}
+
+// Writes the scene next to 'path' and renames it over it, so a process that has
+// the old file mapped keeps reading the old pages. The compiled program is only
+// written while it matches the edits, that is when the scene has been snapshotted
+// since it last changed. Its pointers are written as null.
+internal b32 write_scene(const char* path, Retained_Scene* scene, Camera* camera, Frame_Constants* constants)
+{
+    Compiled_Scene* compiled = &constants->compiled;
+    Compiled_Scene compiled_header = *compiled;
+    compiled_header.residual = (Edit_Info) {};
+    compiled_header.batches = (Primitive_Batches) {};
+
+    Scene_File_Header header = {};
+    header.magic = SCENE_FILE_MAGIC;
+    header.version = SCENE_FILE_VERSION;
+    header.file_size = sizeof(header);
+    header.program_hash = hash_program(scene->objects, scene->object_count);
+    add_section(&header, SECTION_OBJECTS, sizeof(Scene_Object), scene->object_count);
+    add_section(&header, SECTION_MATERIALS, sizeof(Material), scene->material_count);
+    add_section(&header, SECTION_LIGHTS, sizeof(Light), scene->light_count);
+    add_section(&header, SECTION_CAMERA, sizeof(Camera), 1);
+    if (!scene->edits_dirty)
+    {
+        add_section(&header, SECTION_COMPILED, sizeof(Compiled_Scene), 1);
+        add_section(&header, SECTION_RESIDUAL, sizeof(Edit), compiled->residual.count);
+        add_section(&header, SECTION_BATCH_X, sizeof(f32), compiled->batches.count);
+        add_section(&header, SECTION_BATCH_Y, sizeof(f32), compiled->batches.count);
+        add_section(&header, SECTION_BATCH_Z, sizeof(f32), compiled->batches.count);
+    }
+
+    // The residual program is written page by page
+    const void* data[MAX_SCENE_FILE_SECTIONS] = {
+        scene->objects, scene->materials, scene->lights, camera,
+        &compiled_header, NULL, compiled->batches.x, compiled->batches.y, compiled->batches.z
+    };
+
+    char temp_path[1024];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE* file = fopen(temp_path, "wb");
+    if (!file)
+    {
+        printf("could not write scene '%s': %d %s\n", temp_path, errno, strerror(errno));
+        return false;
+    }
+
+    const u8 padding[SCENE_FILE_ALIGNMENT] = {};
+    b32 ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    u64 written = sizeof(header);
+    foreach(i, header.section_count)
+    {
+        const Scene_File_Section* section = &header.sections[i];
+        const u64 size = section->element_size * section->count;
+        ok = ok && fwrite(padding, 1, section->offset - written, file) == section->offset - written;
+        if (section->kind == SECTION_RESIDUAL) foreach(page, compiled->residual.page_count)
+        {
+            const u64 count = compiled->residual.count - page * EDIT_PAGE_SIZE;
+            const u64 page_size = (count < EDIT_PAGE_SIZE ? count : EDIT_PAGE_SIZE) * sizeof(Edit);
+            if ((s64)count > 0) ok = ok && fwrite(compiled->residual.pages[page], 1, page_size, file) == page_size;
+        }
+        else ok = ok && fwrite(data[i], 1, size, file) == size;
+        written = section->offset + size;
+    }
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(temp_path, path) != 0)
+    {
+        printf("could not write scene '%s': %d %s\n", path, errno, strerror(errno));
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
+
+internal void close_scene_file(Scene_File* file)
+{
+    if (file->base) munmap(file->base, file->size);
+    *file = (Scene_File) {};
+}
+
+// Maps the file and checks that the header and every section it lists are
+// inside it and have the layout of this build. Nothing is copied.
+internal b32 open_scene_file(const char* path, Scene_File* file)
+{
+    *file = (Scene_File) {};
+
+    const s32 fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("could not open scene '%s': %d %s\n", path, errno, strerror(errno));
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (u64)info.st_size < sizeof(Scene_File_Header))
+    {
+        printf("scene '%s' is too small to be a scene file\n", path);
+        close(fd);
+        return false;
+    }
+
+    void* base = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (base == MAP_FAILED)
+    {
+        printf("mmap error: %d %s\n", errno, strerror(errno));
+        return false;
+    }
+
+    file->base = (u8*)base;
+    file->size = info.st_size;
+    file->header = (const Scene_File_Header*)base;
+
+    const Scene_File_Header* header = file->header;
+    b32 valid = header->magic == SCENE_FILE_MAGIC
+             && header->version == SCENE_FILE_VERSION
+             && header->file_size == file->size
+             && header->section_count <= MAX_SCENE_FILE_SECTIONS;
+    if (valid) foreach(i, header->section_count)
+    {
+        const Scene_File_Section* section = &header->sections[i];
+        valid = valid
+             && section->offset % SCENE_FILE_ALIGNMENT == 0
+             && section->offset <= file->size
+             && section->count <= (file->size - section->offset) / (section->element_size ? section->element_size : 1);
+    }
+    if (!valid)
+    {
+        printf("scene '%s' is not a version %d scene file\n", path, SCENE_FILE_VERSION);
+        close_scene_file(file);
+        return false;
+    }
+    return true;
+}
+
+// The elements of the first section of a kind, in place in the mapping. NULL
+// when the file has none, or they were written with a different layout.
+internal const void* scene_file_section(Scene_File* file, Scene_Section_Kind kind, u32 element_size, u64* count)
+{
+    *count = 0;
+    foreach(i, file->header->section_count)
+    {
+        const Scene_File_Section* section = &file->header->sections[i];
+        if (section->kind != kind) continue;
+        if (section->element_size != element_size) return NULL;
+        *count = section->count;
+        return file->base + section->offset;
+    }
+    return NULL;
+}
+
+#define get_scene_section(file, kind, type, count) (const type*)scene_file_section(file, kind, sizeof(type), count)
+
+// Whether map() can run a program without reading past what the file holds:
+// only known edit kinds, material ids that index the materials, and the edits
+// and batch centers that OP_LOD, OP_BATCH and SD_TRIANGLE read after themselves.
+// 'material_id' carries map()'s current id from one part of a program to the next.
+internal b32 valid_program(const Edit* edits, u64 count, u64 material_count, u64 batch_count, f32* material_id)
+{
+    foreach(i, count)
+    {
+        const Edit e = edits[i];
+        const u32 kind = e.kind;
+        if (kind > SD_TRIANGLE) return false;
+        if (kind == SET_MATERIAL_ID) *material_id = e.data.x;
+        if (kind == OP_LOD && i + 1 >= count) return false;
+        if (kind == OP_BATCH && !(e.data.x >= SD_SPHERE && e.data.x <= SD_CAPPED_CYLINDER
+                                  && e.data.y >= 0.0 && e.data.z >= 0.0
+                                  && (u64)e.data.y + (u64)e.data.z <= batch_count)) return false;
+        if ((is_primitive((OpKind)kind) || kind == OP_BATCH || kind == OP_LOD)
+            && !(*material_id >= 0.0 && *material_id < material_count)) return false;
+        if (kind == SD_TRIANGLE)
+        {
+            if (i + 2 >= count) return false;
+            i += 2; // the vertices
+        }
+    }
+    return true;
+}
+
+internal b32 valid_compiled(const Compiled_Scene* compiled, u64 material_count, u64 residual_count)
+{
+    if (compiled->analytic_count > MAX_ANALYTIC_PRIMITIVES || compiled->residual_primitive_count > residual_count) return false;
+    foreach(i, compiled->analytic_count)
+    {
+        const Analytic_Primitive* primitive = &compiled->analytic[i];
+        if (primitive->kind != SD_PLANE && primitive->kind != SD_SPHERE && primitive->kind != SD_BOX) return false;
+        if (!(primitive->material_id >= 0.0 && primitive->material_id < material_count)) return false;
+    }
+    return true;
+}
+
+// Replaces the scene and camera with the ones in the file. Everything the kernels
+// index with is checked before anything is replaced. The retained scene is edited
+// in place and lives in fixed size arrays, so its sections are block copied out
+// of the mapping. When the file carries the compiled program of its edits, the
+// frame constants use it in place: the file stays mapped until the program is
+// next compiled, and the next snapshot doesn't compile the scene.
+internal b32 load_scene(const char* path, Retained_Scene* scene, Scene_Snapshot* snapshot, Frame_Constants* constants, Camera* camera)
+{
+    Scene_File file;
+    if (!open_scene_file(path, &file)) return false;
+
+    u64 object_count, material_count, light_count, camera_count, compiled_count;
+    const Scene_Object* objects     = get_scene_section(&file, SECTION_OBJECTS, Scene_Object, &object_count);
+    const Material* materials       = get_scene_section(&file, SECTION_MATERIALS, Material, &material_count);
+    const Light* lights             = get_scene_section(&file, SECTION_LIGHTS, Light, &light_count);
+    const Camera* file_camera       = get_scene_section(&file, SECTION_CAMERA, Camera, &camera_count);
+    const Compiled_Scene* compiled  = get_scene_section(&file, SECTION_COMPILED, Compiled_Scene, &compiled_count);
+
+    u64 residual_count, batch_count[3];
+    const Edit* residual = get_scene_section(&file, SECTION_RESIDUAL, Edit, &residual_count);
+    const f32* batch_x   = get_scene_section(&file, SECTION_BATCH_X, f32, &batch_count[0]);
+    const f32* batch_y   = get_scene_section(&file, SECTION_BATCH_Y, f32, &batch_count[1]);
+    const f32* batch_z   = get_scene_section(&file, SECTION_BATCH_Z, f32, &batch_count[2]);
+
+    s64 edit_count = 0;
+    foreach(i, object_count) edit_count += objects[i].edit_count;
+    foreach(i, object_count) if (objects[i].edit_count < 0 || objects[i].edit_count > MAX_OBJECT_EDITS) edit_count = MAX_EDITS + 1;
+
+    if (!objects || !materials || !lights || !file_camera
+        || object_count > MAX_SCENE_OBJECTS || material_count > MAX_MATERIALS || light_count > MAX_LIGHTS
+        || edit_count > MAX_EDITS || residual_count > MAX_EDITS)
+    {
+        printf("scene '%s' has sections this build can't hold\n", path);
+        close_scene_file(&file);
+        return false;
+    }
+
+    // The objects flatten to one program, so map()'s state runs on from one to the next
+    b32 valid = true;
+    f32 material_id = DEFAULT_MATERIAL_ID;
+    foreach(i, material_count) valid = valid && (u32)materials[i].kind <= REFR;
+    foreach(i, object_count) valid = valid && valid_program(objects[i].edits, objects[i].edit_count, material_count, 0, &material_id);
+
+    const b32 has_compiled = compiled && compiled_count == 1;
+    if (has_compiled)
+    {
+        material_id = DEFAULT_MATERIAL_ID;
+        valid = valid && residual && batch_count[0] == batch_count[1] && batch_count[0] == batch_count[2]
+                      && valid_compiled(compiled, material_count, residual_count)
+                      && valid_program(residual, residual_count, material_count, batch_count[0], &material_id);
+    }
+    if (!valid)
+    {
+        printf("scene '%s' is corrupt, it refers to edits, materials or batches it doesn't hold\n", path);
+        close_scene_file(&file);
+        return false;
+    }
+
+    // Versions keep counting from the current scene's, so everything keyed on
+    // them sees the change
+    const u32 edits_version = scene->edits_version;
+    const u32 materials_version = scene->materials_version;
+    const u32 lights_version = scene->lights_version;
+
+    memcpy(scene->objects, objects, object_count * sizeof(Scene_Object));
+    memcpy(scene->materials, materials, material_count * sizeof(Material));
+    memcpy(scene->lights, lights, light_count * sizeof(Light));
+    scene->object_count = object_count;
+    scene->material_count = material_count;
+    scene->light_count = light_count;
+    foreach(i, MAX_MATERIALS) scene->material_versions[i]++;
+    foreach(i, MAX_LIGHTS) scene->light_versions[i]++;
+
+    scene->edits_version = edits_version + 1;
+    scene->materials_version = materials_version + 1;
+    scene->lights_version = lights_version + 1;
+    scene->edits_dirty = true;
+    scene->materials_dirty = true;
+    scene->lights_dirty = true;
+
+    *camera = *file_camera;
+
+    // The residual program is contiguous in the file, so its pages are pointers
+    // into it. The constants' own pages and batch arrays are kept for the next
+    // compile.
+    snapshot->compiled_is_current = has_compiled && file.header->program_hash == hash_program(objects, object_count);
+    if (!snapshot->compiled_is_current)
+    {
+        close_scene_file(&file);
+        return true;
+    }
+
+    Compiled_Scene* target = &constants->compiled;
+    Mapped_Program* mapped = &snapshot->mapped;
+    unmap_program(mapped, target);
+    foreach(i, target->residual.page_count) mapped->pages[i] = target->residual.pages[i];
+    mapped->page_count = target->residual.page_count;
+    mapped->batches = target->batches;
+
+    memcpy(target, compiled, sizeof(Compiled_Scene));
+    target->residual.count = residual_count;
+    target->residual.page_count = (residual_count + EDIT_PAGE_SIZE - 1) / EDIT_PAGE_SIZE;
+    foreach(i, target->residual.page_count) target->residual.pages[i] = (Edit_Page*)(residual + i * EDIT_PAGE_SIZE);
+    target->batches = (Primitive_Batches) { (u32)batch_count[0], (u32)batch_count[0], (f32*)batch_x, (f32*)batch_y, (f32*)batch_z };
+
+    mapped->base = file.base;
+    mapped->size = file.size;
+    return true;
+}
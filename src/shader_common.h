@@ -87,6 +87,12 @@ typedef struct {
     s16 steps;
 } Hit;
 
+// How a ray is marched through the scene. Each call site picks its own policy.
+typedef struct {
+    f32 relaxation;  // step scale, 1 is plain sphere tracing and up to 2 is over-relaxed
+    f32 pixel_angle; // stop once the distance drops below t * pixel_angle / 2, 0 stops at PIXEL_RADIUS
+} March;
+
 #define METAL_INTERNAL static inline
 
 #ifndef FLT_MIN
@@ -144,6 +150,8 @@ enum OpKind
   OP_ROTATE_Y,
   OP_ROTATE_Z,
   OP_RESET,
+  OP_LOD, // x: proxy sphere radius, or -1 to drop the next primitive, y: its feature size
+  OP_BATCH, // x: primitive kind, y: first center in the compiled batches, z: center count
   _NONE_,
 
   SD_PLANE,
@@ -163,13 +171,32 @@ struct Edit
   v3 data;
 };
 
-#define MAX_EDITS ((1024 * 4-sizeof(s8)) / sizeof(Edit))
+// Edit programs are stored in fixed size pages, so a program can grow to a million
+// edits without moving the ones it has or needing one large block. Pages are
+// allocated as a program grows and kept when it is rebuilt, see push_edit.
+#define EDIT_PAGE_SHIFT 10
+#define EDIT_PAGE_SIZE (1 << EDIT_PAGE_SHIFT)
+#define MAX_EDIT_PAGES 1024
+#define MAX_EDITS (EDIT_PAGE_SIZE * MAX_EDIT_PAGES)
+struct Edit_Page
+{
+  Edit edits[EDIT_PAGE_SIZE];
+};
+
 struct Edit_Info
 {
-  s8 count;
-  Edit edits[MAX_EDITS];
+  u32 count;
+  u32 page_count;
+  METAL(device) Edit_Page* pages[MAX_EDIT_PAGES];
 };
 
+METAL_INTERNAL Edit& edit_at(METAL(constant) const Edit_Info& edit_info, u32 index)
+{
+  return edit_info.pages[index >> EDIT_PAGE_SHIFT]->edits[index & (EDIT_PAGE_SIZE - 1)];
+}
+
+#define MAX_MATERIALS 32
+#define DEFAULT_MATERIAL_ID 11.0 // of edits before the first SET_MATERIAL_ID
 enum MaterialKind { DIFF, SPEC, REFR };
 struct Material
 {
@@ -185,6 +212,7 @@ struct Light
   v3 pos;
   v3 color;
   f32 intensity;
+  f32 radius; // distance where the contribution falls below LIGHT_THRESHOLD, set by assign_lights
 };
 
 #define MAX_LIGHTS ((1024 * 4-sizeof(s8)) / sizeof(Light))
@@ -194,9 +222,119 @@ struct Light_Info
   Light lights[MAX_LIGHTS];
 };
 
+// Lights are binned into a froxel grid of screen tiles and exponential depth
+// slices, so shading only has to visit the lights whose influence radius
+// reaches its cluster.
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 16
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+#define CLUSTER_NEAR 0.1
+#define CLUSTER_FAR 100.0
+#define MAX_LIGHTS_PER_CLUSTER 32
+struct Light_Clusters
+{
+  u8 count[CLUSTER_COUNT];
+  u8 lights[CLUSTER_COUNT][MAX_LIGHTS_PER_CLUSTER];
+};
+
+// Cached visibility for lights that stay put. Each map is a perspective frustum
+// from the light that encloses the scene bounds, and every texel holds the
+// distance to the first surface along its ray (FLT_MAX when nothing is hit).
+#define MAX_SHADOW_MAPS 4
+#define SHADOW_MAP_SIZE 512
+struct Shadow_Map
+{
+  v3 position;
+  v3 forward;
+  v3 right;
+  v3 up;
+  f32 tan_half_angle;
+  f32 far;
+  s32 light_index; // -1 when the map is unused or not built yet
+};
+
+struct Shadow_Maps
+{
+  Shadow_Map maps[MAX_SHADOW_MAPS];
+};
+
+// Irradiance probes on a sparse world space grid, kept in a hash table keyed by
+// their grid cell. Each stores the incoming radiance as L1 spherical harmonics.
+#define PROBE_SPACING 1.0
+#define PROBE_TABLE_SIZE 16384 // power of two
+#define PROBE_MAX_PROBES 8     // linear probing distance
+#define PROBE_RAYS 32
+#define PROBE_RAY_LENGTH 8.0
+enum Probe_State
+{
+  PROBE_EMPTY,
+  PROBE_REQUESTED, // wanted by a visible surface, not traced yet
+  PROBE_VALID,
+  PROBE_STALE,     // valid, but something in range changed
+  PROBE_INSIDE,    // inside geometry, never used for shading
+};
+
+struct Probe
+{
+  v3 sh[4];    // L00, L1-1, L10, L11
+  s32 cell[3]; // the probe sits at cell * PROBE_SPACING
+  u32 state;
+  u32 updated_frame;
+  u32 used_frame;
+};
+
+// A primitive that is hard unioned into the scene in an untransformed domain,
+// so rays can intersect it in closed form instead of sphere tracing it.
+struct Analytic_Primitive
+{
+  OpKind kind; // SD_PLANE, SD_SPHERE or SD_BOX
+  v3 data;     // center, or the normal for SD_PLANE
+  v3 size;     // half extents, radius in x, or the plane offset in x
+  f32 material_id;
+};
+
+// Conservative world space bounds of an edit program. Empty when min > max.
+struct Bounds
+{
+  v3 min;
+  v3 max;
+  bool is_unbounded; // infinite repetition or planes
+};
+
+// Centers of the runs of one primitive kind that the compiled program evaluates in
+// one loop, see OP_BATCH. They are stored per coordinate so that loop vectorizes.
+struct Primitive_Batches
+{
+  u32 count;
+  u32 capacity;
+  METAL(device) f32* x;
+  METAL(device) f32* y;
+  METAL(device) f32* z;
+};
+
+#define MAX_ANALYTIC_PRIMITIVES 64
+struct Compiled_Scene
+{
+  Bounds bounds;          // the whole program
+  Bounds residual_bounds; // only the residual program
+
+  u32 analytic_count;
+  Analytic_Primitive analytic[MAX_ANALYTIC_PRIMITIVES];
+
+  // The edit program without the analytic primitives. Only this part is sphere traced.
+  u32 residual_primitive_count;
+  Edit_Info residual;
+  Primitive_Batches batches; // the residual's OP_BATCH centers
+};
+
+struct Worker_Work; // see counters.cc
+
 struct Scene
 {
     METAL(constant) Edit_Info& edit_info;
+    METAL(constant) Compiled_Scene& compiled;
+    Worker_Work* work; // the work counts of the job tracing it, null when not counted
 };
 
 
@@ -207,6 +345,51 @@ typedef struct
     f32 camera_zoom;
     mat3 camera_matrix;
     ushort2 viewport_size;
+    u32 sample_index; // progressive accumulation sample, seeds the per pixel random sequence
+    u16 lighting_scale; // AO and shadows are traced at 1/lighting_scale resolution
+    u16 use_probes;     // ambient light comes from the irradiance probes instead of AO
+    u16 aa_samples;     // samples per edge pixel, 1 turns edge antialiasing off
+    v2 jitter;          // sub-pixel offset of the primary rays this frame, for TAA
+    u16 reference;      // trace plainly with more steps, for the golden images
 } Uniform;
 
+// Everything the kernels of a frame only read, written before the first dispatch
+// and bound as buffer 0 of every kernel. Tasks share it by reference instead of
+// each getting copies of the scene, like a Metal constant buffer. The scene parts
+// are only rewritten when they changed, see snapshot_scene.
+#define CACHE_LINE_SIZE 64
+struct alignas(CACHE_LINE_SIZE) Frame_Constants
+{
+    Uniform uniform;
+    Uniform previous;    // last frame's, to reproject into its history
+    ushort2 output_size; // the window, larger than the viewport when TAA upsamples
+
+    Light_Info light_info;
+    Material materials[MAX_MATERIALS];
+    s32 material_count;
+    Edit_Info edit_info;
+    Compiled_Scene compiled;
+
+    METAL(constant) Light_Clusters* clusters;
+    METAL(constant) Shadow_Maps* shadow_maps;
+    METAL(device)   f32* shadow_depths;
+};
+
+// What the primary ray of a pixel hit. The geometry pass writes it once per frame
+// and the shading and debug views all read from it.
+typedef struct
+{
+    v3 normal;
+    f32 t; // FLT_MAX when the ray missed
+    s16 material_id;
+    s16 steps;
+} G_Buffer_Texel;
+
+// The low resolution lighting pass stores AO in x and the shadows of the first
+// lights in yzw.
+#define LOW_RES_SHADOWED_LIGHTS 3
+
+// Screen tiles that share a variable shading rate
+#define VRS_TILE_SIZE 16
+
 #endif /* _SHADER_TYPES_H_ */
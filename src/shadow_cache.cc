@@ -0,0 +1,170 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Shadow maps for lights that did not move since the previous frame. A map is
+// built in full when a light gets one, and after that only the texels whose rays
+// pass through primitives that changed are traced again.
+struct Shadow_Cache
+{
+    Shadow_Maps maps;
+    f32* depths; // MAX_SHADOW_MAPS maps of SHADOW_MAP_SIZE^2 texels
+
+    // Last frame, to tell which lights stayed put
+    v3 light_positions[MAX_LIGHTS];
+    s32 light_count;
+};
+
+// Frees every map, lights get one again once they stay put for a frame
+internal void clear_shadow_cache(Shadow_Cache* cache)
+{
+    foreach(m, MAX_SHADOW_MAPS) cache->maps.maps[m].light_index = -1;
+    cache->light_count = 0;
+}
+
+internal void init_shadow_cache(Shadow_Cache* cache)
+{
+    if (cache->depths)
+    {
+        free(cache->depths);
+    }
+    cache->depths = (f32*)malloc(MAX_SHADOW_MAPS * SHADOW_MAP_SIZE * SHADOW_MAP_SIZE * sizeof(f32));
+    clear_shadow_cache(cache);
+}
+
+internal v3 bounds_corner(Bounds b, s32 i)
+{
+    return v3(i & 1 ? b.max.x : b.min.x, i & 2 ? b.max.y : b.min.y, i & 4 ? b.max.z : b.min.z);
+}
+
+// Aims a map from 'position' at the bounds and widens it until it covers them.
+// Fails when the bounds are infinite, surround the light or would need too wide
+// a frustum to get any useful resolution.
+internal b32 fit_shadow_map(Shadow_Map* map, v3 position, Bounds bounds)
+{
+    if (bounds.is_unbounded || bounds_is_empty(bounds)) return false;
+
+    const v3 forward = normalize((bounds.min + bounds.max) * 0.5 - position);
+    const v3 helper = fabs(forward.y) < 0.99 ? v3(0,1,0) : v3(1,0,0);
+    const v3 right = normalize(cross(helper, forward));
+    const v3 up = cross(forward, right);
+
+    f32 tan_half_angle = 0.0;
+    f32 far = 0.0;
+    foreach(i, 8)
+    {
+        const v3 d = bounds_corner(bounds, i) - position;
+        const f32 z = dot(d, forward);
+        if (z <= 0.0) return false;
+        tan_half_angle = max(tan_half_angle, max(fabs(dot(d, right)), fabs(dot(d, up))) / z);
+        far = max(far, length(d));
+    }
+    if (tan_half_angle > 2.0) return false;
+
+    map->position = position;
+    map->forward = forward;
+    map->right = right;
+    map->up = up;
+    map->tan_half_angle = tan_half_angle * 1.01;
+    map->far = far * 1.01;
+    return true;
+}
+
+internal b32 shadow_map_covers(Shadow_Map* map, Bounds bounds)
+{
+    if (bounds.is_unbounded) return false;
+    if (bounds_is_empty(bounds)) return true;
+    foreach(i, 8)
+    {
+        const v3 d = bounds_corner(bounds, i) - map->position;
+        const f32 z = dot(d, map->forward);
+        if (z <= 0.0 || length(d) > map->far) return false;
+        if (max(fabs(dot(d, map->right)), fabs(dot(d, map->up))) > z * map->tan_half_angle) return false;
+    }
+    return true;
+}
+
+internal void build_shadow_map(Shadow_Cache* cache, s32 index, Bounds region, Frame_Constants* constants, s32 task_count)
+{
+    f32* depths = cache->depths + index * SHADOW_MAP_SIZE * SHADOW_MAP_SIZE;
+    const s32 rows = (SHADOW_MAP_SIZE + task_count - 1) / task_count;
+
+    dispatch_for("shadowMapBuild", task_count, [&](s32 i, s32 worker) {
+        const s32 y0 = i * rows;
+        const s32 y1 = y0 + rows < SHADOW_MAP_SIZE ? y0 + rows : SHADOW_MAP_SIZE;
+        if (y0 < y1) shadowMapBuild(*constants, cache->maps.maps[index], region, depths, ushort2(0, y0), ushort2(SHADOW_MAP_SIZE, y1), get_worker_work(worker));
+    });
+}
+
+// 'changed' is the region where the scene differs from last frame, see diff_scene.
+internal void update_shadow_cache(Shadow_Cache* cache, Frame_Constants* constants, Bounds changed, s32 task_count)
+{
+    Light_Info* light_info = &constants->light_info;
+    Compiled_Scene* compiled = &constants->compiled;
+
+    // Keep the maps of lights that are still in place up to date
+    foreach(m, MAX_SHADOW_MAPS)
+    {
+        Shadow_Map* map = &cache->maps.maps[m];
+        const s32 light_index = map->light_index;
+        if (light_index < 0) continue;
+
+        if (light_index >= light_info->count || !v3_equal(light_info->lights[light_index].pos, map->position))
+        {
+            map->light_index = -1;
+        }
+        else if (!shadow_map_covers(map, compiled->bounds))
+        {
+            if (fit_shadow_map(map, map->position, compiled->bounds))
+                build_shadow_map(cache, m, bounds_unbounded(), constants, task_count);
+            else
+                map->light_index = -1;
+        }
+        else if (!bounds_is_empty(changed))
+        {
+            build_shadow_map(cache, m, changed, constants, task_count);
+        }
+    }
+
+    // Give lights that did not move since last frame a map while there are free ones
+    foreach(i, light_info->count)
+    {
+        const v3 position = light_info->lights[i].pos;
+        if (i >= cache->light_count || !v3_equal(position, cache->light_positions[i])) continue;
+
+        s32 free_index = -1;
+        b32 has_map = false;
+        foreach(m, MAX_SHADOW_MAPS)
+        {
+            const s32 light_index = cache->maps.maps[m].light_index;
+            if (light_index == i) has_map = true;
+            if (light_index < 0 && free_index < 0) free_index = m;
+        }
+        if (has_map) continue;
+        if (free_index < 0) break;
+
+        Shadow_Map* map = &cache->maps.maps[free_index];
+        if (!fit_shadow_map(map, position, compiled->bounds)) continue;
+        build_shadow_map(cache, free_index, bounds_unbounded(), constants, task_count);
+        map->light_index = i;
+    }
+
+    foreach(i, light_info->count) cache->light_positions[i] = light_info->lights[i].pos;
+    cache->light_count = light_info->count;
+}
@@ -0,0 +1,156 @@
+// Copyright (c) 2020 Marcus Mathiassen
+
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Begin and end events of frames, kernels, tasks and the passes between them,
+// recorded into a ring buffer per worker, see Job_Proc. write_trace turns whatever the buffers
+// still hold into a Chrome trace, which chrome://tracing and ui.perfetto.dev open.
+// Building with TRACING 0 removes all of it.
+#ifndef TRACING
+#define TRACING 1
+#endif
+
+#define TRACE_FILE_PATH "trace.json" // written with F7
+
+#if TRACING
+
+#include <atomic>
+#include <errno.h>
+#include <stdio.h>
+
+#define TRACE_BUFFER_SIZE 16384 // events per worker, power of two
+
+enum Trace_Phase : u32
+{
+    TRACE_PHASE_BEGIN,
+    TRACE_PHASE_END,
+};
+
+struct Trace_Event
+{
+    u64 time;
+    const char* name; // a string literal, null for end events
+    Trace_Phase phase;
+};
+
+// Only the owning thread writes to a buffer, and it publishes the head after
+// the event is written, so recording takes no locks. Once the buffer is full
+// the oldest events are overwritten.
+struct Trace_Buffer
+{
+    Trace_Event* events;
+    std::atomic<u64> head;
+};
+
+// Indexed by worker, 0 is the thread running the frame. The events are allocated
+// by the worker's first event.
+global_variable Trace_Buffer trace_buffers[MAX_JOB_WORKERS + 1];
+
+internal void trace_event(s32 worker, Trace_Phase phase, const char* name)
+{
+    Trace_Buffer* buffer = &trace_buffers[worker];
+    if (!buffer->events) buffer->events = (Trace_Event*)malloc(TRACE_BUFFER_SIZE * sizeof(Trace_Event));
+
+    const u64 head = buffer->head.load(std::memory_order_relaxed);
+    buffer->events[head & (TRACE_BUFFER_SIZE - 1)] = (Trace_Event) { get_time(), name, phase };
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+struct Trace_Scope
+{
+    s32 worker;
+    Trace_Scope(s32 worker, const char* name) : worker(worker) { trace_event(worker, TRACE_PHASE_BEGIN, name); }
+    ~Trace_Scope() { trace_event(worker, TRACE_PHASE_END, NULL); }
+};
+
+// TRACE_SCOPE, TRACE_BEGIN and TRACE_END record on the thread running the frame,
+// jobs use TRACE_WORKER_SCOPE with the worker they were given
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) Trace_Scope TRACE_CONCAT(trace_scope_, __LINE__)(0, name)
+#define TRACE_WORKER_SCOPE(worker, name) Trace_Scope TRACE_CONCAT(trace_scope_, __LINE__)(worker, name)
+#define TRACE_BEGIN(name) trace_event(0, TRACE_PHASE_BEGIN, name)
+#define TRACE_END() trace_event(0, TRACE_PHASE_END, NULL)
+
+// Writes every thread's buffer as Chrome trace events. Call it between frames,
+// while the workers are idle. An end whose begin was already overwritten is
+// left out, and the viewer closes begins that have no end yet.
+internal b32 write_trace(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        printf("could not write trace '%s': %d %s\n", path, errno, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char* separator = "";
+    foreach(thread, MAX_JOB_WORKERS + 1)
+    {
+        Trace_Buffer* buffer = &trace_buffers[thread];
+        if (!buffer->events) continue;
+
+        if (thread == 0) fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"frame\"}}", separator);
+        else             fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}", separator, (s32)thread, (s32)thread);
+        separator = ",\n";
+
+        const u64 head = buffer->head.load(std::memory_order_acquire);
+        const u64 first = head > TRACE_BUFFER_SIZE ? head - TRACE_BUFFER_SIZE : 0;
+        s32 depth = 0;
+        for (u64 i = first; i < head; ++i)
+        {
+            const Trace_Event e = buffer->events[i & (TRACE_BUFFER_SIZE - 1)];
+            const f64 timestamp = e.time / 1e3; // microseconds
+            if (e.phase == TRACE_PHASE_BEGIN)
+            {
+                fprintf(file, "%s{\"ph\":\"B\",\"name\":\"%s\",\"pid\":0,\"tid\":%d,\"ts\":%.3f}", separator, e.name, (s32)thread, timestamp);
+                depth++;
+            }
+            else if (depth > 0)
+            {
+                fprintf(file, "%s{\"ph\":\"E\",\"pid\":0,\"tid\":%d,\"ts\":%.3f}", separator, (s32)thread, timestamp);
+                depth--;
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0)
+    {
+        printf("could not write trace '%s': %d %s\n", path, errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_WORKER_SCOPE(worker, name)
+#define TRACE_BEGIN(name)
+#define TRACE_END()
+
+internal b32 write_trace(const char* path)
+{
+    printf("built without tracing, not writing '%s'\n", path);
+    return false;
+}
+
+#endif
@@ -37,3 +37,106 @@ strf(const char* fmt, ...)
     str[n] = '\0';
     return str;
 }
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// FNV-1a, continuing from a previous hash so several fields can be chained.
+internal u64
+hash_bytes(u64 hash, const void* data, u64 size)
+{
+    const u8* bytes = (const u8*)data;
+    foreach(i, size)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+internal u64
+hash_f32(u64 hash, f32 value)
+{
+    return hash_bytes(hash, &value, sizeof(value));
+}
+
+// Hashes the components one by one, the padding lane of a v3 is undefined.
+internal u64
+hash_v3(u64 hash, v3 value)
+{
+    hash = hash_f32(hash, value.x);
+    hash = hash_f32(hash, value.y);
+    return hash_f32(hash, value.z);
+}
+
+// Compares the components one by one for the same reason.
+internal b32
+v3_equal(v3 a, v3 b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+// Radical inverse of index in the given base, the Halton low discrepancy sequence.
+internal f32
+halton(u32 index, u32 base)
+{
+    f32 result = 0.0;
+    f32 f = 1.0;
+    while (index > 0)
+    {
+        f /= base;
+        result += f * (index % base);
+        index /= base;
+    }
+    return result;
+}
+
+// Linear allocator over a block of memory. Everything pushed is released at
+// once by resetting it, which is how the transient storage is used per frame.
+struct Memory_Arena
+{
+    u8* base;
+    u64 size;
+    u64 used;
+};
+
+internal Memory_Arena
+make_arena(void* base, u64 size)
+{
+    return (Memory_Arena) { (u8*)base, size, 0 };
+}
+
+internal void*
+push_size(Memory_Arena* arena, u64 size, u64 alignment = 16)
+{
+    const u64 start = (arena->used + alignment - 1) & ~(alignment - 1);
+    assert(start + size <= arena->size);
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+#define push_struct(arena, type)       (type*)push_size(arena, sizeof(type), alignof(type))
+#define push_array(arena, count, type) (type*)push_size(arena, (count) * sizeof(type), alignof(type))
+
+// Like strf, but the string is pushed to the arena and released with it
+internal u8*
+push_vstrf(Memory_Arena* arena, const char* fmt, va_list args)
+{
+    va_list copy;
+    va_copy(copy, args);
+    const s64 n = 1 + vsnprintf(0, 0, fmt, copy);
+    va_end(copy);
+    u8* str = (u8*)push_size(arena, n, 1);
+    vsnprintf((char*)str, n, fmt, args);
+    return str;
+}
+
+internal u8*
+push_strf(Memory_Arena* arena, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    u8* str = push_vstrf(arena, fmt, args);
+    va_end(args);
+    return str;
+}